@@ -0,0 +1,151 @@
+#include "inode.h"
+#include "block_allocation.h"
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define GROUP_BLOCKS 4096
+#define NUM_THREADS  4
+#define NUM_FILES    300
+
+struct worker
+{
+    struct inode* root;
+    int           number;
+};
+
+/* Create files of 1 to 3 blocks in a directory of the thread. */
+static void* work( void* arg )
+{
+    struct worker* w = arg;
+    char name[32];
+
+    snprintf( name, sizeof(name), "t%d", w->number );
+    struct inode* own = create_dir( w->root, name );
+    for( int i=0; i<NUM_FILES; i++ )
+    {
+        snprintf( name, sizeof(name), "file-%03d", i );
+        create_file( own, name, 0, ( i % 3 + 1 ) * BLOCKSIZE );
+    }
+    return NULL;
+}
+
+/* Count how often every block is in a file below node. */
+static void count_blocks( struct inode* node, uint8_t* uses )
+{
+    for( uint32_t i=0; i<node->num_entries; i++ )
+    {
+        if( node->is_directory )
+        {
+            count_blocks( (struct inode*)node->entries[i], uses );
+            continue;
+        }
+        struct Extent* extent = (struct Extent*)node->entries + i;
+        for( uint32_t b=0; b<extent->extent; b++ )
+            uses[extent->blockno + b]++;
+    }
+}
+
+/* Print the free blocks of every group, and check that no block is
+ * in two files and that the groups count the blocks that no file
+ * has as free.
+ */
+static void check_blocks( struct inode* root )
+{
+    static uint8_t uses[NUM_THREADS * GROUP_BLOCKS];
+    memset( uses, 0, sizeof(uses) );
+    count_blocks( root, uses );
+
+    int used  = 0;
+    int twice = 0;
+    for( uint32_t b=0; b<get_num_blocks( ); b++ )
+    {
+        used  += uses[b] > 0;
+        twice += uses[b] > 1;
+    }
+    int64_t free_blocks = 0;
+    printf("Free blocks in the groups:");
+    for( uint32_t g=0; g<get_num_allocation_groups( ); g++ )
+    {
+        printf(" %lld", (long long)get_free_blocks_in_group( g ) );
+        free_blocks += get_free_blocks_in_group( g );
+    }
+    printf("\n%d blocks are in files, %d of them in more than one\n", used, twice );
+    printf("The groups count %s free blocks\n", free_blocks + used == get_num_blocks( ) ? "the right" : "the wrong" );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 3 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char  name[32];
+    int   size;
+
+    set_block_allocation_table_name( bat_name );
+
+    printf("===================================\n");
+    printf("= Fill the group of this thread   =\n");
+    printf("===================================\n");
+    format_disk_blocks( 2 * GROUP_BLOCKS );
+    set_allocation_groups( 2 );
+    printf("%u groups\n", get_num_allocation_groups( ) );
+    printf("allocate_block(%d) returned %d\n", GROUP_BLOCKS, allocate_block( GROUP_BLOCKS ) );
+    printf("allocate_block(10) returned %d\n", allocate_block( 10 ) );
+    printf("Free blocks in the groups: %lld %lld\n",
+           (long long)get_free_blocks_in_group( 0 ), (long long)get_free_blocks_in_group( 1 ) );
+    printf("allocate_block(%d) returned %d, the longest run is %d\n", GROUP_BLOCKS,
+           allocate_block( GROUP_BLOCKS ), get_largest_free_extent( ) );
+    int block = allocate_largest_block( GROUP_BLOCKS, &size );
+    printf("allocate_largest_block(%d) returned %d with %d blocks\n", GROUP_BLOCKS, block, size );
+    free_extent( 0, GROUP_BLOCKS );
+    printf("After freeing the first group: %lld %lld\n",
+           (long long)get_free_blocks_in_group( 0 ), (long long)get_free_blocks_in_group( 1 ) );
+
+    printf("===================================\n");
+    printf("= Create files from %d threads in\n", NUM_THREADS );
+    printf("= %d groups\n", NUM_THREADS );
+    printf("===================================\n");
+    format_disk_blocks( NUM_THREADS * GROUP_BLOCKS );
+    set_allocation_groups( NUM_THREADS );
+    set_thread_safe( 1 );
+    struct inode*  root = create_dir( NULL, "/" );
+    pthread_t      threads[NUM_THREADS];
+    struct worker  workers[NUM_THREADS];
+    for( int t=0; t<NUM_THREADS; t++ )
+    {
+        workers[t].root   = root;
+        workers[t].number = t;
+        pthread_create( &threads[t], NULL, work, &workers[t] );
+    }
+    for( int t=0; t<NUM_THREADS; t++ )
+        pthread_join( threads[t], NULL );
+    check_blocks( root );
+
+    printf("===================================\n");
+    printf("= Delete every second file        =\n");
+    printf("===================================\n");
+    for( int t=0; t<NUM_THREADS; t++ )
+    {
+        snprintf( name, sizeof(name), "t%d", t );
+        struct inode* own = find_inode_by_name( root, name );
+        for( int i=0; i<NUM_FILES; i+=2 )
+        {
+            snprintf( name, sizeof(name), "file-%03d", i );
+            delete_file( own, find_inode_by_name( own, name ) );
+        }
+    }
+    check_blocks( root );
+
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+}
@@ -0,0 +1,154 @@
+#include "block_allocation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* The name of the block allocation table can only be set once in a
+ * process, so every step opens the table in a child process. A step
+ * syncs the table and stops with _exit(), so that only what the sync
+ * wrote is in the file.
+ */
+typedef void (*step_fn)( const char* bat_name );
+
+static void run_step( step_fn step, const char* bat_name )
+{
+    fflush( stdout );
+    pid_t pid = fork( );
+    if( pid == 0 )
+    {
+        step( bat_name );
+        fflush( stdout );
+        _exit( 0 );
+    }
+    if( pid == -1 || waitpid( pid, NULL, 0 ) != pid )
+    {
+        fprintf( stderr, "Failed to run a step in a child process\n" );
+        exit( -1 );
+    }
+}
+
+static void print_file_size( const char* bat_name )
+{
+    struct stat st;
+    if( stat( bat_name, &st ) == 0 )
+        printf("The table file has %lld bytes\n", (long long)st.st_size );
+}
+
+/* Write a table of 60 blocks in an older format: one byte per block,
+ * after a version 1 header or without a header. Blocks 0-9 and 30-34
+ * are used.
+ */
+static void write_old_table( const char* bat_name, int with_header )
+{
+    unsigned char bytes[60];
+    memset( bytes, 0, sizeof(bytes) );
+    memset( bytes, 1, 10 );
+    memset( bytes + 30, 1, 5 );
+
+    FILE* f = fopen( bat_name, "w" );
+    if( !f )
+    {
+        perror( bat_name );
+        exit( -1 );
+    }
+    uint32_t header[4] = { 0x31544142 /* "BAT1" */, 1, sizeof(bytes), BLOCKSIZE };
+    if( with_header )
+        fwrite( header, sizeof(header), 1, f );
+    fwrite( bytes, sizeof(bytes), 1, f );
+    fclose( f );
+}
+
+static void format_and_allocate( const char* bat_name )
+{
+    set_block_allocation_table_mapped( 1 );
+    set_block_allocation_table_name( bat_name );
+    format_disk_blocks( 100 );
+    int a = allocate_block( 5 );
+    int b = allocate_block( 20 );
+    int c = allocate_block( 3 );
+    free_extent( b, 20 );
+    printf("Allocated blocks %d, %d and %d, and freed the %d\n", a, b, c, b );
+    debug_disk( );
+    printf("sync_block_allocation_table returned %d\n", sync_block_allocation_table( ) );
+}
+
+static void reopen_mapped( const char* bat_name )
+{
+    set_block_allocation_table_mapped( 1 );
+    set_block_allocation_table_name( bat_name );
+    printf("The mapped table has %u blocks\n", get_num_blocks( ) );
+    debug_disk( );
+    printf("allocate_block(10) returned %d\n", allocate_block( 10 ) );
+    sync_block_allocation_table( );
+}
+
+static void reopen_in_memory( const char* bat_name )
+{
+    set_block_allocation_table_name( bat_name );
+    printf("The table read into memory has %u blocks\n", get_num_blocks( ) );
+    debug_disk( );
+}
+
+static void allocate_mapped( const char* bat_name )
+{
+    set_block_allocation_table_mapped( 1 );
+    set_block_allocation_table_name( bat_name );
+    printf("The table has %u blocks\n", get_num_blocks( ) );
+    debug_disk( );
+    printf("allocate_block(20) returned %d\n", allocate_block( 20 ) );
+    free_extent( 30, 5 );
+    sync_block_allocation_table( );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 2 )
+    {
+        fprintf( stderr, "Usage: %s BAT\n"
+                         "       where\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* bat_name = argv[1];
+
+    printf("===================================\n");
+    printf("= Allocate in a mapped table and  =\n");
+    printf("= sync it                         =\n");
+    printf("===================================\n");
+    run_step( format_and_allocate, bat_name );
+    print_file_size( bat_name );
+
+    printf("===================================\n");
+    printf("= Map it again                    =\n");
+    printf("===================================\n");
+    run_step( reopen_mapped, bat_name );
+    run_step( reopen_in_memory, bat_name );
+
+    printf("===================================\n");
+    printf("= A table without a header is     =\n");
+    printf("= read into memory, and written   =\n");
+    printf("= back without a header           =\n");
+    printf("===================================\n");
+    write_old_table( bat_name, 0 );
+    print_file_size( bat_name );
+    run_step( allocate_mapped, bat_name );
+    print_file_size( bat_name );
+    run_step( reopen_in_memory, bat_name );
+
+    printf("===================================\n");
+    printf("= A version 1 table is read into  =\n");
+    printf("= memory, and written back as     =\n");
+    printf("= version 2                       =\n");
+    printf("===================================\n");
+    write_old_table( bat_name, 1 );
+    print_file_size( bat_name );
+    run_step( allocate_mapped, bat_name );
+    print_file_size( bat_name );
+    run_step( reopen_mapped, bat_name );
+}
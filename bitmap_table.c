@@ -0,0 +1,135 @@
+#include "block_allocation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* The name of the block allocation table can only be set once in a
+ * process, so every step opens the table in a child process.
+ */
+typedef void (*step_fn)( const char* bat_name );
+
+static void run_step( step_fn step, const char* bat_name )
+{
+    fflush( stdout );
+    pid_t pid = fork( );
+    if( pid == 0 )
+    {
+        step( bat_name );
+        exit( 0 );
+    }
+    if( pid == -1 || waitpid( pid, NULL, 0 ) != pid )
+    {
+        fprintf( stderr, "Failed to run a step in a child process\n" );
+        exit( -1 );
+    }
+}
+
+static void print_file_size( const char* bat_name )
+{
+    struct stat st;
+    if( stat( bat_name, &st ) == 0 )
+        printf("The table file has %lld bytes\n", (long long)st.st_size );
+}
+
+/* Read a version 1 table, change it and write it back. */
+static void change_version_1( const char* bat_name )
+{
+    set_block_allocation_table_name( bat_name );
+    debug_disk( );
+    printf("allocate_block(4) returned %d\n", allocate_block( 4 ) );
+    printf("free_extent(20, 3) returned %d\n", free_extent( 20, 3 ) );
+}
+
+static void show_table( const char* bat_name )
+{
+    set_block_allocation_table_name( bat_name );
+    debug_disk( );
+}
+
+/* Allocate and free single blocks and extents that cross the words
+ * of the bitmap and of its summary level.
+ */
+static void allocate_across_words( const char* bat_name )
+{
+    set_block_allocation_table_name( bat_name );
+    format_disk_blocks( 100 );
+    printf("allocate_block(63) returned %d\n", allocate_block( 63 ) );
+    printf("allocate_block(3) returned %d\n", allocate_block( 3 ) );
+    printf("allocate_block(34) returned %d\n", allocate_block( 34 ) );
+    printf("allocate_block(1) returned %d\n", allocate_block( 1 ) );
+    printf("free_extent(60, 10) returned %d\n", free_extent( 60, 10 ) );
+    printf("free_extent(65, 10) returned %d\n", free_extent( 65, 10 ) );
+    printf("free_block(62) returned %d\n", free_block( 62 ) );
+    printf("The longest free run has %d blocks\n", get_largest_free_extent( ) );
+    debug_disk( );
+}
+
+/* Fill a disk of several summary words, free a hole far into it
+ * and find it again.
+ */
+static void find_in_full_disk( const char* bat_name )
+{
+    set_block_allocation_table_name( bat_name );
+    format_disk_blocks( 3 * 64 * 64 + 37 );
+    printf("allocate_block(%d) returned %d\n", 3 * 64 * 64 + 37, allocate_block( 3 * 64 * 64 + 37 ) );
+    printf("allocate_block(1) returned %d\n", allocate_block( 1 ) );
+    free_extent( 9000, 64 );
+    free_block( 12000 );
+    printf("The longest free run has %d blocks\n", get_largest_free_extent( ) );
+    printf("allocate_block(1) returned %d\n", allocate_block( 1 ) );
+    printf("allocate_block(64) returned %d\n", allocate_block( 64 ) );
+    printf("allocate_block(1) returned %d\n", allocate_block( 1 ) );
+    printf("allocate_block(1) returned %d\n", allocate_block( 1 ) );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 2 )
+    {
+        fprintf( stderr, "Usage: %s BAT\n"
+                         "       where\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* bat_name = argv[1];
+
+    printf("===================================\n");
+    printf("= A version 1 table with one byte =\n");
+    printf("= per block                       =\n");
+    printf("===================================\n");
+    unsigned char bytes[45];
+    memset( bytes, 0, sizeof(bytes) );
+    memset( bytes, 1, 3 );
+    memset( bytes + 20, 7, 3 );
+    memset( bytes + 40, 1, 5 );
+    FILE* f = fopen( bat_name, "w" );
+    if( !f )
+    {
+        perror( bat_name );
+        exit( -1 );
+    }
+    uint32_t header[4] = { 0x31544142 /* "BAT1" */, 1, sizeof(bytes), BLOCKSIZE };
+    fwrite( header, sizeof(header), 1, f );
+    fwrite( bytes, sizeof(bytes), 1, f );
+    fclose( f );
+    print_file_size( bat_name );
+    run_step( change_version_1, bat_name );
+    print_file_size( bat_name );
+    run_step( show_table, bat_name );
+
+    printf("===================================\n");
+    printf("= Extents across words            =\n");
+    printf("===================================\n");
+    run_step( allocate_across_words, bat_name );
+
+    printf("===================================\n");
+    printf("= A full disk of %d blocks\n", 3 * 64 * 64 + 37 );
+    printf("===================================\n");
+    run_step( find_in_full_disk, bat_name );
+}
@@ -2,15 +2,35 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/mman.h> 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "block_allocation.h"
+#include "extent_tree.h"
 
 /* Read the block allocation table from file into memory, if such a
  * file exists.
  */
-static char* read_table( );
+static uint64_t* read_table( );
+
+/* Map the block allocation table file into memory, if it has the
+ * current format. Other files are read with read_table().
+ */
+static uint64_t* map_table( );
+
+/* Read or map the table, depending on the mode that was chosen
+ * with set_block_allocation_table_mapped().
+ */
+static uint64_t* load_table( );
+
+/* Release the table in memory, and the structures built on it.
+ */
+static void release_table( );
 
 /* Write the block allocation from memory into a file, if such a
  * file can be written.
@@ -29,7 +49,235 @@ void save_and_release_block_allocation_table( );
  */
 static char* file_name = NULL;
 
-static char* block_allocation_table = NULL;
+/* The block allocation table in memory is a bitmap with one bit
+ * per block, 1 for used and 0 for free, packed into 64-bit words.
+ * The bits after the last block in the last word are kept at 1,
+ * so that they are never handed out.
+ */
+static uint64_t* block_allocation_table = NULL;
+
+/* Summary level over the bitmap: bit w is set when word w of the
+ * table is completely used. A search for free blocks skips 64 full
+ * words with a single test on this level.
+ */
+static uint64_t* full_words = NULL;
+
+/* The disk is split into allocation groups of consecutive blocks.
+ * Every group has its own index of the free runs in it, its own
+ * count of free blocks and its own lock. allocate_block() asks the
+ * index of a group for the lowest run that is long enough, and
+ * free_block() gives blocks back to it.
+ *
+ * Every thread prefers one group, and only tries the neighbouring
+ * groups when its own has no run that fits, so threads that
+ * allocate at the same time work in different parts of the table.
+ * Groups span whole words of the summary level, so no word of the
+ * bitmap or the summary is changed under two locks. A run of free
+ * blocks never spans two groups in the index. With one group, the
+ * default, allocation is first fit over the whole disk.
+ *
+ * The summary level and the index are built from the bitmap by
+ * prepare_index() when the first block is allocated, not when the
+ * table is loaded, so that opening a table costs the same for
+ * every size of disk. Until then, index_ready is 0 and free_block()
+ * only changes the bitmap.
+ */
+struct alloc_group
+{
+    pthread_mutex_t    lock;
+    uint32_t           first;        /* blocks [first, end) */
+    uint32_t           end;
+    uint32_t           free_blocks;
+    struct extent_tree free_extents;
+};
+
+static struct alloc_group* groups           = NULL;
+static uint32_t            num_groups       = 0;
+static uint32_t            group_size       = 0;
+static int                 requested_groups = 1;
+static int                 index_ready      = 0;
+
+/* Groups are a multiple of this many blocks, one word of the
+ * summary level.
+ */
+#define GROUP_GRANULE ( 64 * 64 )
+
+/* When the table is mapped, block_allocation_table points into
+ * the mapping, right after the header. Changes are written to the
+ * file by msync() for the pages in dirty_pages only, in
+ * sync_block_allocation_table(), at exit, or when sync_interval
+ * seconds have passed since the last sync.
+ */
+static int       use_mapping    = 0;
+static char*     mapping        = NULL;
+static size_t    mapping_size   = 0;
+static int       mapping_fd     = -1;
+static uint64_t* dirty_pages    = NULL; /* under dirty_lock */
+static uint32_t  num_dirty      = 0;    /* under dirty_lock */
+static int       sync_interval  = 0;
+static time_t    last_sync      = 0;
+
+/* A block allocation table file starts with this header.
+ * In version 2 it is followed by the words of the bitmap, in
+ * version 1 by one byte per block.
+ * Files that were written before the header was introduced
+ * contain only the bytes, one per block. They are still read,
+ * and they are written back in the same format. Version 1 files
+ * are written back as version 2.
+ */
+#define BAT_MAGIC     0x31544142 /* "BAT1" */
+#define BAT_VERSION   2
+#define BAT_VERSION_1 1
+
+struct bat_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_blocks;
+    uint32_t block_size;
+};
+
+/* The number of blocks in the table that is currently in memory,
+ * and whether it was read from a file without header.
+ */
+static uint32_t num_blocks    = 0;
+static int      legacy_format = 0;
+
+/* The number of words in block_allocation_table and in full_words.
+ */
+static uint32_t num_words         = 0;
+static uint32_t num_summary_words = 0;
+
+#define WORD_BITS 64
+
+/* Allocate a bitmap for the given number of blocks, all of them
+ * free, together with its summary level.
+ */
+static uint64_t* alloc_table( uint32_t blocks );
+
+/* Recompute the summary level from the words of the bitmap.
+ * Returns 0 on success and -1 if it could not be allocated.
+ */
+static int build_summary( );
+
+/* Build the summary level and the free extent index if that has
+ * not been done since the table was loaded.
+ */
+static int prepare_index( );
+
+/* Split the disk into groups and fill their indexes from the
+ * bitmap. Returns 0 on success and -1 if the index could not be
+ * allocated.
+ */
+static int build_free_extents( );
+
+/* Release the groups and their indexes. */
+static void release_groups( );
+
+/* Add the free run [start, start+length) to the indexes of the
+ * groups it lies in. Returns 0 on success and -1 on error.
+ */
+static int add_free_run( uint32_t start, uint32_t length );
+
+/* Mark extent_size blocks starting at block as used.
+ */
+static void mark_used( uint32_t block, uint32_t extent_size );
+
+/* Remember that word w of the table has changed, and must be
+ * written at the next sync if the table is mapped.
+ */
+static void mark_dirty( uint32_t w );
+
+/* Sync the mapped table, once sync_due() found that the interval
+ * has passed. Called without table_lock.
+ */
+static void sync_if_due( );
+
+/* The bodies of the public functions of the same names, called
+ * with table_lock held for writing.
+ */
+static int sync_table( );
+static int format_blocks( uint32_t blocks );
+
+/* Every public function that reads or changes the table holds
+ * this lock. Allocating and freeing hold it for reading, together
+ * with the locks of the groups they change, so that threads in
+ * different groups run at the same time. Everything else that
+ * changes the table holds it for writing.
+ */
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Guards dirty_pages and num_dirty, which every group changes. */
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Take table_lock for reading, once the table is loaded, and with
+ * need_index 1 also its index. Both are done with the lock held
+ * for writing first, if they are still to be done.
+ * Returns 0 with the lock held, or -1 without it if the table
+ * could not be loaded.
+ */
+static int read_lock_table( int need_index );
+
+/* Return 1 if the mapped table should be synced now. Called with
+ * table_lock held.
+ */
+static int sync_due( );
+
+/* Return the group that the calling thread prefers. */
+static uint32_t preferred_group( );
+
+/* Return the group after i others in the order in which a thread
+ * that prefers group g tries them: g, g+1, g-1, g+2, g-2, ...
+ * Returns num_groups if there is no such group on that side.
+ */
+static uint32_t nearby_group( uint32_t g, uint32_t i );
+
+/* Blocks that reserve_blocks() promised and that were neither
+ * allocated with allocate_reserved_block() nor released yet.
+ * While there are any, allocations that do not take from them
+ * hold reserve_lock, so that they leave enough free blocks.
+ */
+static atomic_int_fast64_t reserved_blocks = 0;
+static pthread_mutex_t     reserve_lock    = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return the free blocks that are not reserved. Called with
+ * table_lock held and the index built.
+ */
+static int64_t unreserved_free_blocks( );
+
+/* Allocate extent_size blocks from a group, with its lock held.
+ * Returns the first block or -1.
+ */
+static int allocate_in_group( struct alloc_group* group, uint32_t extent_size );
+static inline int block_is_used( uint32_t block )
+{
+    return ( block_allocation_table[block / WORD_BITS] >> ( block % WORD_BITS ) ) & 1;
+}
+
+/* Return the mask of the bits of word w that belong to the range
+ * [block, end), where block lies in word w.
+ */
+static inline uint64_t range_mask( uint32_t block, uint32_t end )
+{
+    uint32_t first = block % WORD_BITS;
+    uint32_t n     = end - block < WORD_BITS - first ? end - block : WORD_BITS - first;
+    return ( n == WORD_BITS ? ~0ULL : ( ( 1ULL << n ) - 1 ) ) << first;
+}
+
+void set_block_allocation_table_mapped( int enable )
+{
+    if( file_name != NULL )
+    {
+        fprintf( stderr, "The mode of the block allocation table must be chosen before its name is set\n" );
+        return;
+    }
+    use_mapping = enable;
+}
+
+void set_block_allocation_table_sync_interval( int seconds )
+{
+    sync_interval = seconds > 0 ? seconds : 0;
+}
 
 void set_block_allocation_table_name( const char* str )
 {
@@ -43,7 +291,9 @@ void set_block_allocation_table_name( const char* str )
 
     file_name = strdup( str );
 
-    block_allocation_table = read_table();
+    pthread_rwlock_wrlock( &table_lock );
+    block_allocation_table = load_table();
+    pthread_rwlock_unlock( &table_lock );
 
     atexit( &save_and_release_block_allocation_table );
 }
@@ -52,18 +302,20 @@ void save_and_release_block_allocation_table( )
 {
     if( file_name )
     {
+        pthread_rwlock_wrlock( &table_lock );
         if( block_allocation_table )
         {
-            write_table( );
-            free( block_allocation_table );
+            sync_table( );
         }
+        release_table( );
+        pthread_rwlock_unlock( &table_lock );
 
         free( file_name );
     }
 }
 
 
-static char* read_table( )
+static uint64_t* read_table( )
 {
     if( file_name == NULL )
     {
@@ -71,36 +323,339 @@ static char* read_table( )
         exit( -1 );
     }
 
-    char* table = malloc( NUM_BLOCKS );
-    if( table == NULL )
-    {
-        fprintf( stderr, "Failed to allocate %d bytes\n", NUM_BLOCKS );
-        return NULL;
-    }
-
     FILE* f = fopen( file_name, "r" );
     if( !f )
     {
         fprintf( stderr, "Failed to open file %s for reading\n", file_name );
         perror("Reason:");
-        free( table );
         return NULL;
     }
 
-    int num_read = fread( table, 1, NUM_BLOCKS, f );
-    if( num_read != NUM_BLOCKS )
+    int byte_per_block = 1;
+
+    struct bat_header header;
+    size_t num_read = fread( &header, 1, sizeof(header), f );
+    if( num_read == sizeof(header) && header.magic == BAT_MAGIC )
+    {
+        if( header.version != BAT_VERSION && header.version != BAT_VERSION_1 )
+        {
+            fprintf( stderr, "Block allocation table %s has unknown version %u\n", file_name, header.version );
+            fclose( f );
+            return NULL;
+        }
+        if( header.block_size != BLOCKSIZE )
+        {
+            fprintf( stderr, "Block allocation table %s uses blocks of %u bytes, expected %d\n",
+                             file_name, header.block_size, BLOCKSIZE );
+            fclose( f );
+            return NULL;
+        }
+        num_blocks     = header.num_blocks;
+        legacy_format  = 0;
+        byte_per_block = ( header.version == BAT_VERSION_1 );
+    }
+    else
+    {
+        /* No header, the whole file is the table. */
+        if( fseek( f, 0, SEEK_END ) != 0 )
+        {
+            perror("Reason:");
+            fclose( f );
+            return NULL;
+        }
+        long size = ftell( f );
+        rewind( f );
+        num_blocks    = size > 0 ? (uint32_t)size : 0;
+        legacy_format = 1;
+    }
+
+    if( num_blocks == 0 || num_blocks > INT32_MAX )
+    {
+        fprintf( stderr, "Block allocation table %s has an invalid number of blocks\n", file_name );
+        fclose( f );
+        num_blocks = 0;
+        return NULL;
+    }
+
+    uint64_t* table = alloc_table( num_blocks );
+    if( table == NULL )
     {
-        fprintf( stderr, "Failed to load %d block entries from disk\n", NUM_BLOCKS );
+        fclose( f );
+        num_blocks = 0;
+        return NULL;
+    }
+
+    uint32_t loaded = 0;
+    if( byte_per_block )
+    {
+        /* Pack the bytes into bits, one buffer of bytes at a time. */
+        unsigned char buf[4096];
+        while( loaded < num_blocks )
+        {
+            size_t want = num_blocks - loaded < sizeof(buf) ? num_blocks - loaded : sizeof(buf);
+            if( fread( buf, 1, want, f ) != want ) break;
+            for( size_t i=0; i<want; i++, loaded++ )
+                if( buf[i] ) table[loaded / WORD_BITS] |= 1ULL << ( loaded % WORD_BITS );
+        }
+    }
+    else
+    {
+        /* Keep the padding bits of the last word set, whatever the
+         * file says.
+         */
+        uint64_t padding = table[num_words-1];
+        if( fread( table, sizeof(uint64_t), num_words, f ) == num_words )
+            loaded = num_blocks;
+        table[num_words-1] |= padding;
+    }
+
+    if( loaded != num_blocks )
+    {
+        fprintf( stderr, "Failed to load %u block entries from disk\n", num_blocks );
         perror("Reason:");
         fclose(f);
         free( table );
+        num_blocks = 0;
         return NULL;
     }
     fclose( f );
 
+    index_ready = 0;
     return table;
 }
 
+static uint64_t* map_table( )
+{
+    if( file_name == NULL )
+    {
+        fprintf( stderr, "Failed to set the name of the block allocation table file.\n" );
+        exit( -1 );
+    }
+
+    int fd = open( file_name, O_RDWR );
+    if( fd == -1 )
+    {
+        fprintf( stderr, "Failed to open file %s for reading\n", file_name );
+        perror("Reason:");
+        return NULL;
+    }
+
+    /* Only a version 2 table has the bitmap in the file exactly as
+     * it is in memory. Older formats are read into memory instead.
+     */
+    struct bat_header header;
+    struct stat       st;
+    if( pread( fd, &header, sizeof(header), 0 ) != sizeof(header)
+        || header.magic != BAT_MAGIC || header.version != BAT_VERSION
+        || fstat( fd, &st ) == -1 )
+    {
+        close( fd );
+        return read_table( );
+    }
+
+    uint32_t words = ( header.num_blocks + WORD_BITS - 1 ) / WORD_BITS;
+    size_t   size  = sizeof(header) + (size_t)words * sizeof(uint64_t);
+    if( header.block_size != BLOCKSIZE || header.num_blocks == 0 || header.num_blocks > INT32_MAX
+        || (size_t)st.st_size != size )
+    {
+        fprintf( stderr, "Block allocation table %s has an invalid header\n", file_name );
+        close( fd );
+        return NULL;
+    }
+
+    char* base = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if( base == MAP_FAILED )
+    {
+        fprintf( stderr, "Failed to map file %s\n", file_name );
+        perror("Reason:");
+        close( fd );
+        return NULL;
+    }
+
+    mapping       = base;
+    mapping_size  = size;
+    mapping_fd    = fd;
+    num_blocks    = header.num_blocks;
+    num_words     = words;
+    legacy_format = 0;
+    index_ready   = 0;
+    last_sync     = time( NULL );
+
+    uint64_t* table = (uint64_t*)( base + sizeof(header) );
+
+    /* The padding bits of the last word must read as used. */
+    if( num_blocks % WORD_BITS )
+    {
+        uint64_t padding = ~0ULL << ( num_blocks % WORD_BITS );
+        if( ( table[words-1] & padding ) != padding )
+        {
+            table[words-1] |= padding;
+            mark_dirty( words-1 );
+        }
+    }
+
+    return table;
+}
+
+static uint64_t* load_table( )
+{
+    return use_mapping ? map_table( ) : read_table( );
+}
+
+static void release_table( )
+{
+    if( mapping )
+    {
+        munmap( mapping, mapping_size );
+        close( mapping_fd );
+        mapping    = NULL;
+        mapping_fd = -1;
+    }
+    else
+    {
+        free( block_allocation_table );
+    }
+    block_allocation_table = NULL;
+
+    free( full_words );
+    full_words = NULL;
+    free( dirty_pages );
+    dirty_pages = NULL;
+    num_dirty   = 0;
+    release_groups( );
+    index_ready = 0;
+}
+
+int sync_block_allocation_table( )
+{
+    pthread_rwlock_wrlock( &table_lock );
+    int retval = sync_table( );
+    pthread_rwlock_unlock( &table_lock );
+    return retval;
+}
+
+static int sync_table( )
+{
+    if( block_allocation_table == NULL )
+        return 0;
+
+    if( mapping == NULL )
+        return write_table( );
+
+    if( num_dirty == 0 )
+        return 0;
+
+    /* Write each run of consecutive dirty pages with one msync(). */
+    long     page_size  = sysconf( _SC_PAGESIZE );
+    uint32_t num_pages  = ( mapping_size + page_size - 1 ) / page_size;
+    uint32_t run_start  = 0;
+    uint32_t run_len    = 0;
+    int      retval     = 0;
+    for( uint32_t w=0; w<( num_pages + WORD_BITS - 1 ) / WORD_BITS; w++ )
+    {
+        uint64_t bits = dirty_pages[w];
+        dirty_pages[w] = 0;
+        while( bits )
+        {
+            uint32_t page = w * WORD_BITS + __builtin_ctzll( bits );
+            bits &= bits - 1;
+            if( run_len && page == run_start + run_len )
+            {
+                run_len++;
+                continue;
+            }
+            if( run_len && msync( mapping + (size_t)run_start * page_size, (size_t)run_len * page_size, MS_SYNC ) == -1 )
+                retval = -1;
+            run_start = page;
+            run_len   = 1;
+        }
+    }
+    if( run_len && msync( mapping + (size_t)run_start * page_size, (size_t)run_len * page_size, MS_SYNC ) == -1 )
+        retval = -1;
+
+    if( retval == -1 )
+    {
+        fprintf( stderr, "Failed to write changed blocks of %s\n", file_name );
+        perror("Reason:");
+    }
+    num_dirty = 0;
+    last_sync = time( NULL );
+    return retval;
+}
+
+static void mark_dirty( uint32_t w )
+{
+    if( mapping == NULL )
+        return;
+
+    long     page_size = sysconf( _SC_PAGESIZE );
+    uint32_t page      = ( sizeof(struct bat_header) + (size_t)w * sizeof(uint64_t) ) / page_size;
+    pthread_mutex_lock( &dirty_lock );
+    if( dirty_pages == NULL )
+    {
+        uint32_t num_pages = ( mapping_size + page_size - 1 ) / page_size;
+        dirty_pages = calloc( ( num_pages + WORD_BITS - 1 ) / WORD_BITS, sizeof(uint64_t) );
+        if( dirty_pages == NULL )
+        {
+            /* Without the dirty set, the changes still reach the
+             * file through the shared mapping, only later.
+             */
+            pthread_mutex_unlock( &dirty_lock );
+            return;
+        }
+    }
+
+    uint64_t bit = 1ULL << ( page % WORD_BITS );
+    if( !( dirty_pages[page / WORD_BITS] & bit ) )
+    {
+        dirty_pages[page / WORD_BITS] |= bit;
+        num_dirty++;
+    }
+    pthread_mutex_unlock( &dirty_lock );
+}
+
+static int sync_due( )
+{
+    if( mapping == NULL || sync_interval == 0 )
+        return 0;
+
+    pthread_mutex_lock( &dirty_lock );
+    int due = num_dirty && time( NULL ) - last_sync >= sync_interval;
+    pthread_mutex_unlock( &dirty_lock );
+    return due;
+}
+
+static void sync_if_due( )
+{
+    pthread_rwlock_wrlock( &table_lock );
+    if( mapping && num_dirty )
+        sync_table( );
+    pthread_rwlock_unlock( &table_lock );
+}
+
+static int read_lock_table( int need_index )
+{
+    for( ;; )
+    {
+        pthread_rwlock_rdlock( &table_lock );
+        if( block_allocation_table != NULL && ( index_ready || !need_index ) )
+            return 0;
+        pthread_rwlock_unlock( &table_lock );
+
+        pthread_rwlock_wrlock( &table_lock );
+        if( block_allocation_table == NULL )
+            block_allocation_table = load_table( );
+        int ready = block_allocation_table != NULL && ( !need_index || prepare_index( ) == 0 );
+        pthread_rwlock_unlock( &table_lock );
+        if( !ready )
+            return -1;
+
+        /* Another thread may format the disk before the lock is
+         * taken again, so the checks are repeated.
+         */
+    }
+}
+
 static int write_table( )
 {
     if( file_name == NULL )
@@ -122,19 +677,116 @@ static int write_table( )
         perror("Reason:");
         return -1;
     }
-    int num = fwrite( block_allocation_table, 1, NUM_BLOCKS, f );
-    if( num != NUM_BLOCKS )
+    if( !legacy_format )
+    {
+        struct bat_header header = { BAT_MAGIC, BAT_VERSION, num_blocks, BLOCKSIZE };
+        if( fwrite( &header, sizeof(header), 1, f ) != 1 )
+        {
+            fprintf( stderr, "Failed to write the header to %s\n", file_name );
+            perror("Reason:");
+            fclose( f );
+            return -1;
+        }
+    }
+
+    uint32_t num = 0;
+    if( legacy_format )
+    {
+        /* Unpack the bits into one byte per block. */
+        unsigned char buf[4096];
+        while( num < num_blocks )
+        {
+            size_t n = num_blocks - num < sizeof(buf) ? num_blocks - num : sizeof(buf);
+            for( size_t i=0; i<n; i++ )
+                buf[i] = block_is_used( num + i );
+            if( fwrite( buf, 1, n, f ) != n ) break;
+            num += n;
+        }
+    }
+    else if( fwrite( block_allocation_table, sizeof(uint64_t), num_words, f ) == num_words )
     {
-        fprintf( stderr, "Failed to write %d bytes to %s, ", NUM_BLOCKS, file_name);
-        fprintf( stderr, "fwrite returned %d\n", num );
+        num = num_blocks;
+    }
+
+    if( num != num_blocks )
+    {
+        fprintf( stderr, "Failed to write %u blocks to %s, ", num_blocks, file_name);
+        fprintf( stderr, "wrote %u\n", num );
         perror("Reason:");
+        fclose( f );
         return-1;
     }
     fclose( f );
     return 0;
 }
 
+static uint64_t* alloc_table( uint32_t blocks )
+{
+    uint32_t words = ( blocks + WORD_BITS - 1 ) / WORD_BITS;
+
+    uint64_t* table = calloc( words, sizeof(uint64_t) );
+    if( table == NULL )
+    {
+        fprintf( stderr, "Failed to allocate a table for %u blocks\n", blocks );
+        return NULL;
+    }
+
+    /* Padding after the last block is marked as used. */
+    if( blocks % WORD_BITS )
+        table[words-1] = ~0ULL << ( blocks % WORD_BITS );
+
+    num_words = words;
+    return table;
+}
+
+static int build_summary( )
+{
+    num_summary_words = ( num_words + WORD_BITS - 1 ) / WORD_BITS;
+
+    free( full_words );
+    full_words = calloc( num_summary_words, sizeof(uint64_t) );
+    if( full_words == NULL )
+    {
+        fprintf( stderr, "Failed to allocate the summary of %u words\n", num_words );
+        return -1;
+    }
+
+    /* Padding after the last word is marked as full. */
+    if( num_words % WORD_BITS )
+        full_words[num_summary_words-1] = ~0ULL << ( num_words % WORD_BITS );
+
+    for( uint32_t w=0; w<num_words; w++ )
+        if( block_allocation_table[w] == ~0ULL )
+            full_words[w / WORD_BITS] |= 1ULL << ( w % WORD_BITS );
+    return 0;
+}
+
+static int prepare_index( )
+{
+    if( index_ready )
+        return 0;
+
+    if( build_summary( ) == -1 || build_free_extents( ) == -1 )
+        return -1;
+
+    index_ready = 1;
+    return 0;
+}
+
 int format_disk()
+{
+    return format_disk_blocks( DEFAULT_NUM_BLOCKS );
+}
+
+int format_disk_blocks( uint32_t blocks )
+{
+    pthread_rwlock_wrlock( &table_lock );
+    int retval = format_blocks( blocks );
+    pthread_rwlock_unlock( &table_lock );
+    return retval;
+}
+
+static int format_blocks( uint32_t blocks )
 {
     if( file_name == NULL )
     {
@@ -146,19 +798,33 @@ int format_disk()
 
     if( error == 0 || ( error == -1 && errno == ENOENT ) )
     {
-        if( block_allocation_table ) free( block_allocation_table );
+        release_table( );
+        num_blocks = 0;
 
-        /* We want to set all NUM_BLOCK chars to 0, convenient to use
-         * calloc.
-         */
-        block_allocation_table = calloc( NUM_BLOCKS, 1 );
-        if( block_allocation_table == NULL )
+        if( blocks == 0 || blocks > INT32_MAX )
         {
-            fprintf( stderr, "Failed to allocate %d bytes\n", NUM_BLOCKS );
+            fprintf( stderr, "Cannot format a disk with %u blocks\n", blocks );
             return -1;
         }
 
+        block_allocation_table = alloc_table( blocks );
+        if( block_allocation_table == NULL )
+            return -1;
+
+        num_blocks    = blocks;
+        legacy_format = 0;
+        index_ready   = 0;
+
         int retval = write_table( );
+
+        /* The new file is written in full once, and mapped afterwards. */
+        if( retval == 0 && use_mapping )
+        {
+            release_table( );
+            block_allocation_table = map_table( );
+            if( block_allocation_table == NULL )
+                return -1;
+        }
         return retval;
     }
     fprintf( stderr, "Failed to remove existing file %s (%s)\n", file_name, strerror(errno) );
@@ -166,6 +832,175 @@ int format_disk()
     return -1;
 }
 
+void set_allocation_groups( int count )
+{
+    if( count <= 0 )
+    {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        count = cpus > 0 ? cpus : 1;
+    }
+
+    /* The groups are built again with the next allocation. */
+    pthread_rwlock_wrlock( &table_lock );
+    requested_groups = count;
+    release_groups( );
+    index_ready = 0;
+    pthread_rwlock_unlock( &table_lock );
+}
+
+uint32_t get_num_allocation_groups( )
+{
+    if( read_lock_table( 1 ) == -1 )
+        return 0;
+
+    uint32_t count = num_groups;
+    pthread_rwlock_unlock( &table_lock );
+    return count;
+}
+
+int64_t get_free_blocks_in_group( uint32_t group )
+{
+    if( read_lock_table( 1 ) == -1 )
+        return -1;
+
+    int64_t count = -1;
+    if( group < num_groups )
+    {
+        pthread_mutex_lock( &groups[group].lock );
+        count = groups[group].free_blocks;
+        pthread_mutex_unlock( &groups[group].lock );
+    }
+    pthread_rwlock_unlock( &table_lock );
+    return count;
+}
+
+/* Every thread gets the next slot when it first allocates. */
+static _Thread_local int thread_slot = -1;
+static atomic_int        next_slot   = 0;
+
+static uint32_t preferred_group( )
+{
+    if( thread_slot == -1 )
+        thread_slot = atomic_fetch_add( &next_slot, 1 );
+    return (uint32_t)thread_slot % num_groups;
+}
+
+static uint32_t nearby_group( uint32_t g, uint32_t i )
+{
+    uint32_t d = ( i + 1 ) / 2;
+    if( i % 2 )
+        return g + d < num_groups ? g + d : num_groups;
+    return d <= g ? g - d : num_groups;
+}
+
+static int allocate_in_group( struct alloc_group* group, uint32_t extent_size )
+{
+    /* first fit algorithm, served by the index of free runs */
+    int64_t block = extent_tree_first_fit( &group->free_extents, extent_size );
+    if( block == -1 )
+        return -1;
+
+    group->free_blocks -= extent_size;
+    mark_used( block, extent_size );
+    return (int)block;
+}
+
+static int64_t unreserved_free_blocks( )
+{
+    int64_t count = 0;
+    for( uint32_t g=0; g<num_groups; g++ )
+    {
+        pthread_mutex_lock( &groups[g].lock );
+        count += groups[g].free_blocks;
+        pthread_mutex_unlock( &groups[g].lock );
+    }
+    return count - atomic_load( &reserved_blocks );
+}
+
+/* The body of allocate_block(), called with table_lock held. */
+static int allocate_exact( int extent_size )
+{
+    /* The preferred group first, then its neighbours. */
+    int      block = -1;
+    uint32_t home  = preferred_group( );
+    for( uint32_t i=0; i<2*num_groups && block == -1; i++ )
+    {
+        uint32_t g = nearby_group( home, i );
+        if( g >= num_groups )
+            continue;
+        pthread_mutex_lock( &groups[g].lock );
+        block = allocate_in_group( &groups[g], extent_size );
+        pthread_mutex_unlock( &groups[g].lock );
+    }
+    return block;
+}
+
+/* The body of allocate_largest_block(), called with table_lock
+ * held.
+ */
+static int allocate_longest( int max_blocks, int* extent_size )
+{
+    int      block = -1;
+    uint32_t home  = preferred_group( );
+    for( ;; )
+    {
+        /* The first group, from the preferred one outwards, that
+         * has a run of max_blocks, otherwise the longest run.
+         */
+        uint32_t best        = num_groups;
+        uint32_t best_length = 0;
+        for( uint32_t i=0; i<2*num_groups && block == -1; i++ )
+        {
+            uint32_t g = nearby_group( home, i );
+            if( g >= num_groups )
+                continue;
+            pthread_mutex_lock( &groups[g].lock );
+            uint32_t longest = extent_tree_longest( &groups[g].free_extents );
+            if( longest >= (uint32_t)max_blocks )
+            {
+                block = allocate_in_group( &groups[g], max_blocks );
+                *extent_size = max_blocks;
+            }
+            else if( longest > best_length )
+            {
+                best        = g;
+                best_length = longest;
+            }
+            pthread_mutex_unlock( &groups[g].lock );
+        }
+        if( block != -1 || best_length == 0 )
+            break;
+
+        /* Another thread may have taken the run in the meantime,
+         * then the groups are searched again.
+         */
+        pthread_mutex_lock( &groups[best].lock );
+        uint32_t longest = extent_tree_longest( &groups[best].free_extents );
+        if( longest > 0 )
+        {
+            *extent_size = longest < (uint32_t)max_blocks ? (int)longest : max_blocks;
+            block = allocate_in_group( &groups[best], *extent_size );
+        }
+        pthread_mutex_unlock( &groups[best].lock );
+        if( block != -1 )
+            break;
+    }
+    if( block == -1 )
+        *extent_size = 0;
+    return block;
+}
+
+/* Release table_lock after an allocation, and sync the mapped
+ * table if that is due.
+ */
+static void finish_allocation( )
+{
+    int due = sync_due( );
+    pthread_rwlock_unlock( &table_lock );
+    if( due )
+        sync_if_due( );
+}
+
 int allocate_block( int extent_size )
 {
     if( extent_size == 0 )
@@ -182,86 +1017,472 @@ int allocate_block( int extent_size )
         exit( -1 );
     }
 
-    if( extent_size > 4 )
+    if( read_lock_table( 1 ) == -1 )
+        return -1;
+
+    int block;
+    if( atomic_load( &reserved_blocks ) > 0 )
     {
-        // outside the permitted range
+        pthread_mutex_lock( &reserve_lock );
+        block = unreserved_free_blocks( ) >= extent_size ? allocate_exact( extent_size ) : -1;
+        pthread_mutex_unlock( &reserve_lock );
+    }
+    else
+        block = allocate_exact( extent_size );
+
+    finish_allocation( );
+    return block;
+}
+
+int allocate_largest_block( int max_blocks, int* extent_size )
+{
+    *extent_size = 0;
+    if( max_blocks <= 0 || read_lock_table( 1 ) == -1 )
+        return -1;
+
+    int block = -1;
+    if( atomic_load( &reserved_blocks ) > 0 )
+    {
+        pthread_mutex_lock( &reserve_lock );
+        int64_t available = unreserved_free_blocks( );
+        if( available > 0 )
+            block = allocate_longest( available < max_blocks ? (int)available : max_blocks, extent_size );
+        pthread_mutex_unlock( &reserve_lock );
+    }
+    else
+        block = allocate_longest( max_blocks, extent_size );
+
+    finish_allocation( );
+    return block;
+}
+
+int reserve_blocks( uint32_t count )
+{
+    if( read_lock_table( 1 ) == -1 )
         return -1;
+
+    pthread_mutex_lock( &reserve_lock );
+    int retval = -1;
+    if( unreserved_free_blocks( ) >= (int64_t)count )
+    {
+        atomic_fetch_add( &reserved_blocks, count );
+        retval = 0;
     }
+    pthread_mutex_unlock( &reserve_lock );
+    pthread_rwlock_unlock( &table_lock );
+    return retval;
+}
 
-    if( block_allocation_table == NULL )
-        block_allocation_table = read_table( );
+void release_reserved_blocks( uint32_t count )
+{
+    pthread_mutex_lock( &reserve_lock );
+    atomic_fetch_sub( &reserved_blocks, count );
+    pthread_mutex_unlock( &reserve_lock );
+}
+
+int allocate_reserved_block( int max_blocks, int* extent_size )
+{
+    *extent_size = 0;
+    if( max_blocks <= 0 || read_lock_table( 1 ) == -1 )
+        return -1;
 
-    if( block_allocation_table == NULL ) 
+    pthread_mutex_lock( &reserve_lock );
+    int block = -1;
+    if( atomic_load( &reserved_blocks ) >= max_blocks )
     {
+        block = allocate_longest( max_blocks, extent_size );
+        atomic_fetch_sub( &reserved_blocks, *extent_size );
+    }
+    else
+        fprintf( stderr, "Programming error: Trying to allocate %d blocks from a reservation of fewer.\n", max_blocks );
+    pthread_mutex_unlock( &reserve_lock );
+
+    finish_allocation( );
+    return block;
+}
+
+uint64_t get_reserved_blocks( )
+{
+    return atomic_load( &reserved_blocks );
+}
+
+/* Return the index of the first word at or after word w that has
+ * at least one free block, or num_words if there is none.
+ */
+static uint32_t next_free_word( uint32_t w )
+{
+    if( w >= num_words ) return num_words;
+
+    uint32_t s     = w / WORD_BITS;
+    uint64_t avail = ~full_words[s] & ( ~0ULL << ( w % WORD_BITS ) );
+    while( avail == 0 )
+    {
+        if( ++s >= num_summary_words ) return num_words;
+        avail = ~full_words[s];
+    }
+    return s * WORD_BITS + __builtin_ctzll( avail );
+}
+
+static int build_free_extents( )
+{
+    release_groups( );
+
+    /* As many groups as were asked for, of whole summary words,
+     * if the disk is large enough for them.
+     */
+    uint32_t granules = ( num_blocks + GROUP_GRANULE - 1 ) / GROUP_GRANULE;
+    if( granules == 0 ) granules = 1;
+    uint32_t count = (uint32_t)requested_groups < granules ? (uint32_t)requested_groups : granules;
+    group_size = ( granules + count - 1 ) / count * GROUP_GRANULE;
+    uint32_t n = num_blocks ? ( num_blocks + group_size - 1 ) / group_size : 1;
+
+    groups = calloc( n, sizeof(struct alloc_group) );
+    if( groups == NULL )
+    {
+        fprintf( stderr, "Failed to allocate %u allocation groups\n", n );
         return -1;
     }
+    num_groups = n;
+    for( uint32_t g=0; g<num_groups; g++ )
+    {
+        pthread_mutex_init( &groups[g].lock, NULL );
+        groups[g].first = g * group_size;
+        groups[g].end   = num_blocks - groups[g].first < group_size ? num_blocks : groups[g].first + group_size;
+        extent_tree_init( &groups[g].free_extents );
+    }
 
-    /* first fit algorithm */
-    for( int i=0; i<NUM_BLOCKS; i++ )
+    /* Collect the runs of free bits a word at a time, skipping full
+     * words through the summary level. Shifting right fills the top
+     * of a word with zeros, which read as used.
+     */
+    uint32_t run_start = 0;
+    uint32_t run_len   = 0;
+    for( uint32_t w = next_free_word( 0 ); w < num_words; w++ )
     {
-        /* extent_size blocks in a row that are free? */
-        int found_blk = 1;
-        for( int j=0; j<extent_size; j++ )
-            if( ( i+j>=NUM_BLOCKS ) || ( block_allocation_table[i+j] != 0 ) )
+        uint64_t free_bits = ~block_allocation_table[w];
+        int b = 0;
+        while( b < WORD_BITS )
+        {
+            uint64_t rest = free_bits >> b;
+            int used = rest ? __builtin_ctzll( rest ) : WORD_BITS - b;
+            if( used > 0 )
             {
-                found_blk = 0;
-                break;
+                if( run_len && add_free_run( run_start, run_len ) == -1 )
+                    return -1;
+                run_len = 0;
+                b      += used;
+                if( b >= WORD_BITS ) break;
+                rest >>= used;
             }
-        /* If not, continue to next i */
-        if( found_blk == 0 ) continue;
+            int avail = ~rest ? __builtin_ctzll( ~rest ) : WORD_BITS;
+            if( run_len == 0 ) run_start = w * WORD_BITS + b;
+            run_len += avail;
+            b       += avail;
+        }
+
+        /* Jump over the full words that follow. */
+        uint32_t next = next_free_word( w + 1 );
+        if( next != w + 1 )
+        {
+            if( run_len && add_free_run( run_start, run_len ) == -1 )
+                return -1;
+            run_len = 0;
+            w = next - 1;
+        }
+    }
+    if( run_len && add_free_run( run_start, run_len ) == -1 )
+        return -1;
+    return 0;
+}
 
-        /* Found extent_size unused contiguous blocks.
-         * Allocate them. */
-        for( int j=0; j<extent_size; j++ )
-            block_allocation_table[i+j] = 1;
+static int add_free_run( uint32_t start, uint32_t length )
+{
+    while( length > 0 )
+    {
+        struct alloc_group* group = &groups[start / group_size];
+        uint32_t n = group->end - start < length ? group->end - start : length;
+        if( extent_tree_insert( &group->free_extents, start, n ) == -1 )
+            return -1;
+        group->free_blocks += n;
+        start  += n;
+        length -= n;
+    }
+    return 0;
+}
 
-        return i;
+static void release_groups( )
+{
+    for( uint32_t g=0; g<num_groups; g++ )
+    {
+        extent_tree_clear( &groups[g].free_extents );
+        pthread_mutex_destroy( &groups[g].lock );
+    }
+    free( groups );
+    groups     = NULL;
+    num_groups = 0;
+}
+
+static void mark_used( uint32_t block, uint32_t extent_size )
+{
+    uint32_t end = block + extent_size;
+    while( block < end )
+    {
+        uint32_t w = block / WORD_BITS;
+
+        block_allocation_table[w] |= range_mask( block, end );
+        if( block_allocation_table[w] == ~0ULL )
+            full_words[w / WORD_BITS] |= 1ULL << ( w % WORD_BITS );
+        mark_dirty( w );
+
+        block = ( w + 1 ) * WORD_BITS;
     }
-    return -1;
 }
 
 int free_block( int block )
 {
-    if( block < 0 || block >= NUM_BLOCKS )
+    return free_extent( block, 1 );
+}
+
+/* The body of free_extent, called with table_lock held. With the
+ * index built, the lock is held for reading and the groups of the
+ * extent are locked here; without it, the lock is held for
+ * writing.
+ */
+static int free_blocks( int block, int extent_size )
+{
+    if( block < 0 || extent_size < 1 || (int64_t)block + extent_size > (int64_t)num_blocks )
     {
-        fprintf( stderr, "Block number %d is not in range\n", block );
+        if( extent_size == 1 )
+            fprintf( stderr, "Block number %d is not in range\n", block );
+        else
+            fprintf( stderr, "Extent of %d blocks at block %d is not in range\n", extent_size, block );
         return -1;
     }
 
-    if( block_allocation_table == NULL )
-        block_allocation_table = read_table( );
+    uint32_t end         = block + extent_size;
+    uint32_t first_group = 0;
+    uint32_t last_group  = 0;
+    if( index_ready )
+    {
+        /* In order, so that two threads never wait for each other. */
+        first_group = block / group_size;
+        last_group  = ( end - 1 ) / group_size;
+        for( uint32_t g=first_group; g<=last_group; g++ )
+            pthread_mutex_lock( &groups[g].lock );
+    }
 
-    if( block_allocation_table == NULL ) 
-        return -1;
+    /* Every block of the extent must be in use before any of them
+     * is freed.
+     */
+    int retval = 0;
+    for( uint32_t b = block; b < end; b = ( b / WORD_BITS + 1 ) * WORD_BITS )
+    {
+        uint64_t mask   = range_mask( b, end );
+        uint64_t unused = ~block_allocation_table[b / WORD_BITS] & mask;
+        if( unused )
+        {
+            fprintf( stderr, "Block %d was not allocated\n", (int)( b / WORD_BITS * WORD_BITS + __builtin_ctzll( unused ) ) );
+            retval = -1;
+            break;
+        }
+    }
+
+    /* The extent goes back to the index of every group it lies in.
+     * If one of them cannot take its part, the others give theirs
+     * back, and nothing is freed.
+     */
+    uint32_t added = block;
+    while( retval == 0 && index_ready && added < end )
+    {
+        struct alloc_group* group = &groups[added / group_size];
+        uint32_t n = ( group->end < end ? group->end : end ) - added;
+        if( extent_tree_insert( &group->free_extents, added, n ) == -1 )
+        {
+            for( uint32_t b = block; b < added; )
+            {
+                struct alloc_group* undo = &groups[b / group_size];
+                uint32_t m = ( undo->end < added ? undo->end : added ) - b;
+                extent_tree_remove( &undo->free_extents, b, m );
+                undo->free_blocks -= m;
+                b += m;
+            }
+            retval = -1;
+            break;
+        }
+        group->free_blocks += n;
+        added += n;
+    }
 
-    if( block_allocation_table[block] != 1 )
+    for( uint32_t b = block; retval == 0 && b < end; b = ( b / WORD_BITS + 1 ) * WORD_BITS )
     {
-        fprintf( stderr, "Block %d was not allocated\n", block );
+        uint32_t w = b / WORD_BITS;
+        block_allocation_table[w] &= ~range_mask( b, end );
+        if( index_ready )
+            full_words[w / WORD_BITS] &= ~( 1ULL << ( w % WORD_BITS ) );
+        mark_dirty( w );
+    }
+
+    if( index_ready )
+    {
+        for( uint32_t g=first_group; g<=last_group; g++ )
+            pthread_mutex_unlock( &groups[g].lock );
+    }
+    return retval;
+}
+
+int free_extent( int block, int extent_size )
+{
+    if( read_lock_table( 0 ) == -1 )
         return -1;
+
+    /* Without the index, the bitmap is changed with the table
+     * locked for writing.
+     */
+    if( !index_ready )
+    {
+        pthread_rwlock_unlock( &table_lock );
+        pthread_rwlock_wrlock( &table_lock );
+        if( block_allocation_table == NULL )
+        {
+            pthread_rwlock_unlock( &table_lock );
+            return -1;
+        }
     }
 
-    block_allocation_table[block] = 0;
+    int retval = free_blocks( block, extent_size );
+    int due    = sync_due( );
+    pthread_rwlock_unlock( &table_lock );
+    if( due )
+        sync_if_due( );
+    return retval;
+}
+
+/* Change the blocks of [block, end) that are not in the state used
+ * yet, a run at a time, in the bitmap and in the indexes of their
+ * groups. Called with table_lock held for writing.
+ */
+static int set_blocks( uint32_t block, uint32_t end, int used )
+{
+    while( block < end )
+    {
+        if( block_is_used( block ) == used )
+        {
+            block++;
+            continue;
+        }
 
+        /* The run of blocks to change, cut at the end of its group,
+         * so that it is one run in one index.
+         */
+        uint32_t run_end = end;
+        if( index_ready && groups[block / group_size].end < run_end )
+            run_end = groups[block / group_size].end;
+        uint32_t last = block + 1;
+        while( last < run_end && block_is_used( last ) != used )
+            last++;
+
+        if( index_ready )
+        {
+            struct alloc_group* group = &groups[block / group_size];
+            if( used )
+            {
+                extent_tree_remove( &group->free_extents, block, last - block );
+                group->free_blocks -= last - block;
+            }
+            else
+            {
+                if( extent_tree_insert( &group->free_extents, block, last - block ) == -1 )
+                    return -1;
+                group->free_blocks += last - block;
+            }
+        }
+
+        for( uint32_t b = block; b < last; b = ( b / WORD_BITS + 1 ) * WORD_BITS )
+        {
+            uint32_t w = b / WORD_BITS;
+            if( used )
+                block_allocation_table[w] |= range_mask( b, last );
+            else
+                block_allocation_table[w] &= ~range_mask( b, last );
+            if( index_ready && block_allocation_table[w] == ~0ULL )
+                full_words[w / WORD_BITS] |= 1ULL << ( w % WORD_BITS );
+            else if( index_ready )
+                full_words[w / WORD_BITS] &= ~( 1ULL << ( w % WORD_BITS ) );
+            mark_dirty( w );
+        }
+        block = last;
+    }
     return 0;
 }
 
+int mark_extent( int block, int extent_size, int used )
+{
+    pthread_rwlock_wrlock( &table_lock );
+    if( block_allocation_table == NULL )
+        block_allocation_table = load_table( );
+
+    int retval = -1;
+    if( block_allocation_table == NULL )
+        fprintf( stderr, "Failed to read block allocation table\n" );
+    else if( block < 0 || extent_size < 1 || (int64_t)block + extent_size > (int64_t)num_blocks )
+        fprintf( stderr, "Extent of %d blocks at block %d is not in range\n", extent_size, block );
+    else
+        retval = set_blocks( block, block + extent_size, used != 0 );
+
+    int due = sync_due( );
+    pthread_rwlock_unlock( &table_lock );
+    if( due )
+        sync_if_due( );
+    return retval;
+}
+
+int get_largest_free_extent( )
+{
+    if( read_lock_table( 1 ) == -1 )
+        return 0;
+
+    uint32_t longest = 0;
+    for( uint32_t g=0; g<num_groups; g++ )
+    {
+        pthread_mutex_lock( &groups[g].lock );
+        uint32_t length = extent_tree_longest( &groups[g].free_extents );
+        pthread_mutex_unlock( &groups[g].lock );
+        if( length > longest )
+            longest = length;
+    }
+    pthread_rwlock_unlock( &table_lock );
+    return (int)longest;
+}
+
 void debug_disk( )
 {
+    pthread_rwlock_wrlock( &table_lock );
     if( block_allocation_table == NULL )
-        block_allocation_table = read_table( );
+        block_allocation_table = load_table( );
 
     if( block_allocation_table == NULL )
     {
+        pthread_rwlock_unlock( &table_lock );
         fprintf( stderr, "Failed to read block allocation table\n" );
         return;
     }
 
     printf("Blocks recorded in the block allocation table:");
-    for( int i=0; i<NUM_BLOCKS; i++ )
+    for( int i=0; i<(int)num_blocks; i++ )
     {
         if( i % 20 == 0 ) printf("\n%03d: ", i);
-        printf("%d", block_allocation_table[i] );
+        printf("%d", block_is_used( i ) );
     }
     printf("\n\n");
+    pthread_rwlock_unlock( &table_lock );
 }
 
+uint32_t get_num_blocks( )
+{
+    if( read_lock_table( 0 ) == -1 )
+        return 0;
+
+    uint32_t blocks = num_blocks;
+    pthread_rwlock_unlock( &table_lock );
+    return blocks;
+}
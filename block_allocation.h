@@ -1,7 +1,14 @@
 #ifndef ALLOCATION_H
 #define ALLOCATION_H
 
-#define NUM_BLOCKS 80
+#include <stdint.h>
+
+/* The number of blocks that format_disk() gives a new disk.
+ * Disks of other sizes are created with format_disk_blocks(),
+ * and the size of an existing disk is read from the header of
+ * its block allocation table file.
+ */
+#define DEFAULT_NUM_BLOCKS 80
 #define BLOCKSIZE 4096
 
 /* Set the name of block allocation table file.
@@ -15,13 +22,49 @@ void set_block_allocation_table_name( const char* str );
  */
 void release_block_allocation_table_name( );
 
+/* Choose whether the block allocation table file is mapped into
+ * memory with mmap() instead of being read in full. Must be called
+ * before set_block_allocation_table_name().
+ * A mapped table is opened in constant time, whatever the size of
+ * the disk. Only the pages of the table that were changed are
+ * written back, by sync_block_allocation_table(), at exit, or
+ * automatically after the interval that is set with
+ * set_block_allocation_table_sync_interval().
+ * Tables in older formats are read into memory even in this mode.
+ */
+void set_block_allocation_table_mapped( int enable );
+
+/* Write the changes to the block allocation table to its file.
+ * A mapped table writes only the pages that changed since the last
+ * sync, a table in memory is written in full.
+ * Returns 0 on success and -1 if writing failed.
+ */
+int sync_block_allocation_table( );
+
+/* Sync a mapped table from allocate_block() and free_block() once
+ * the given number of seconds has passed since the last sync.
+ * 0 turns this off, which is the default.
+ */
+void set_block_allocation_table_sync_interval( int seconds );
+
 /* Set all the blocks in our simulated disk into an unused
- * state.
+ * state. The disk gets DEFAULT_NUM_BLOCKS blocks.
  * This function returns 0 in case of success and -1 if the
  * file simulating the blocks cannot be written.
  */
 int format_disk();
 
+/* Like format_disk(), but the new disk has num_blocks blocks.
+ * The block count and the block size are recorded in the header
+ * of the block allocation table file.
+ */
+int format_disk_blocks( uint32_t num_blocks );
+
+/* Return the number of blocks of the simulated disk, or 0 if
+ * the block allocation table could not be read.
+ */
+uint32_t get_num_blocks( );
+
 /* Allocate extent_size consecutive blocks from the available
  * free disk blocks. It does not wrap.
  * Disk blocks are counted from 0 to max.
@@ -30,12 +73,89 @@ int format_disk();
  */
 int allocate_block( int extent_size );
 
+/* Allocate the longest run of free blocks, but no more than
+ * max_blocks of them, in one step. The length of the run is
+ * stored in extent_size.
+ * The function returns the first block of the run, or -1 if no
+ * block is free.
+ */
+int allocate_largest_block( int max_blocks, int* extent_size );
+
+/* Promise count free blocks to a later allocate_reserved_block(),
+ * without choosing them yet. Until then, allocate_block() and
+ * allocate_largest_block() leave that many blocks free.
+ * The function returns 0, or -1 if fewer than count free blocks
+ * are left unreserved.
+ */
+int reserve_blocks( uint32_t count );
+
+/* Give back count reserved blocks that will not be allocated. */
+void release_reserved_blocks( uint32_t count );
+
+/* Like allocate_largest_block(), but the blocks are taken from
+ * the reservation, which shrinks by extent_size. At least
+ * max_blocks blocks must be reserved.
+ */
+int allocate_reserved_block( int max_blocks, int* extent_size );
+
+/* Return the number of reserved blocks that were not allocated
+ * or released yet.
+ */
+uint64_t get_reserved_blocks( );
+
 /* Free the block with the given ID.
  * This functions returns 0 if the block was freed
  * or -1 if the block with this ID was not allocated
  */
 int free_block(int block);
 
+/* Free extent_size consecutive blocks, starting at block.
+ * This function returns 0 if the blocks were freed, or -1 if any
+ * of them was not allocated, in which case none is freed.
+ */
+int free_extent( int block, int extent_size );
+
+/* Mark extent_size consecutive blocks, starting at block, as used
+ * (used 1) or as free (used 0), whatever state each of them is in
+ * now. The replay of a journal uses this to bring the table up to
+ * date with the extents it restores, which the table may or may
+ * not have recorded before the program stopped.
+ * This function returns 0 on success, or -1 if the extent is not
+ * on the disk or memory ran out.
+ */
+int mark_extent( int block, int extent_size, int used );
+
+/* Return the length of the longest run of free blocks, which is
+ * the largest extent_size that allocate_block() can serve.
+ */
+int get_largest_free_extent( );
+
+/* Split the disk into count allocation groups of consecutive
+ * blocks, or one per processor if count is 0. Every thread that
+ * allocates prefers one group, and only takes blocks from the
+ * neighbouring groups when its own group has no run that fits,
+ * so threads allocate in different parts of the disk without
+ * waiting for each other. An extent never spans two groups.
+ * Groups are at least 4096 blocks, so small disks have fewer
+ * groups than asked for. The default is 1 group, which allocates
+ * first fit over the whole disk.
+ */
+void set_allocation_groups( int count );
+
+/* Return the number of allocation groups of the disk. */
+uint32_t get_num_allocation_groups( );
+
+/* Return the number of free blocks in the given allocation group,
+ * or -1 if the disk has no such group.
+ */
+int64_t get_free_blocks_in_group( uint32_t group );
+
+/* All functions above may be called from several threads at the
+ * same time. Allocation and freeing lock only the groups they
+ * use; the rest locks the whole table.
+ * The name and the mode of the table are set before threads use it.
+ */
+
 /* This debug function prints the table to stdout. */
 void debug_disk();
 
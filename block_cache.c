@@ -0,0 +1,774 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "block_cache.h"
+#include "block_image.h"
+#include "block_allocation.h"
+
+/* Marks the end of a list, or a frame or ghost that is not used. */
+#define NONE UINT32_MAX
+
+/* The most dirty blocks that are written with one pwritev. */
+#define WRITE_RUN_BLOCKS 256
+
+enum frame_queue
+{
+    QUEUE_FREE = 0, /* on the free list */
+    QUEUE_IN   = 1, /* in the FIFO queue of blocks that were used once */
+    QUEUE_MAIN = 2  /* in the CLOCK of blocks that were used again */
+};
+
+/* A frame holds one block of the image, at data + index * BLOCKSIZE.
+ * Frames of the FIFO queue and of the free list are linked through
+ * prev and next. All cached frames are in the hash table.
+ */
+struct frame
+{
+    uint32_t block;
+    uint32_t hash_next;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t pins;
+    uint8_t  queue;
+    uint8_t  dirty;
+    uint8_t  referenced;
+    uint8_t  stale; /* pinned when its block was forgotten */
+};
+
+/* A block that left the FIFO queue not long ago. The ghosts are a
+ * ring, and the oldest one is replaced by the next.
+ */
+struct ghost
+{
+    uint32_t block;
+    uint32_t hash_next;
+};
+
+/* We make the variables static to hide them from other C files.
+ * All of them are guarded by cache_lock.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t      cache_size  = BLOCK_CACHE_DEFAULT_BLOCKS;
+static uint32_t      num_frames  = 0; /* 0 until the first use */
+static struct frame* frames      = NULL;
+static char*         frame_data  = NULL;
+static uint32_t*     buckets     = NULL;
+static uint32_t      bucket_mask = 0;
+
+static uint32_t free_head = NONE;
+static uint32_t in_head   = NONE; /* oldest */
+static uint32_t in_tail   = NONE; /* newest */
+static uint32_t in_count  = 0;
+static uint32_t in_limit  = 0;
+static uint32_t main_count = 0;
+static uint32_t clock_hand = 0;
+
+static struct ghost* ghosts        = NULL;
+static uint32_t*     ghost_buckets = NULL;
+static uint32_t      num_ghosts    = 0;
+static uint32_t      ghost_next    = 0;
+
+/* Dirty blocks are written back when there are more than
+ * dirty_limit of them (0 for half the cache), or when the oldest
+ * one is flush_interval seconds old.
+ */
+static uint32_t dirty_limit    = 0;
+static int      flush_interval = BLOCK_CACHE_FLUSH_INTERVAL;
+static time_t   dirty_since    = 0;
+
+static struct block_cache_stats stats;
+
+static uint32_t hash_block( uint32_t block )
+{
+    return ( block * 2654435761u ) >> 7;
+}
+
+static char* frame_bytes( uint32_t f )
+{
+    return frame_data + (size_t)f * BLOCKSIZE;
+}
+
+/* Allocate the frames when the cache is used for the first time.
+ * Returns 0 on success, and -1 if there is no cache.
+ */
+static int create_frames( )
+{
+    if( num_frames > 0 )
+        return 0;
+    if( cache_size == 0 )
+        return -1;
+
+    uint32_t num_buckets = 1;
+    while( num_buckets < cache_size )
+        num_buckets *= 2;
+    uint32_t ghost_count = cache_size / 2 > 0 ? cache_size / 2 : 1;
+
+    frames        = calloc( cache_size, sizeof(struct frame) );
+    frame_data    = malloc( (size_t)cache_size * BLOCKSIZE );
+    buckets       = malloc( num_buckets * sizeof(uint32_t) );
+    ghosts        = malloc( ghost_count * sizeof(struct ghost) );
+    ghost_buckets = malloc( num_buckets * sizeof(uint32_t) );
+    if( !frames || !frame_data || !buckets || !ghosts || !ghost_buckets )
+    {
+        fprintf( stderr, "Failed to allocate a block cache of %u blocks\n", cache_size );
+        free( frames );
+        free( frame_data );
+        free( buckets );
+        free( ghosts );
+        free( ghost_buckets );
+        frames = NULL;
+        frame_data = NULL;
+        buckets = NULL;
+        ghosts = NULL;
+        ghost_buckets = NULL;
+        return -1;
+    }
+
+    for( uint32_t i = 0; i < num_buckets; i++ )
+    {
+        buckets[i] = NONE;
+        ghost_buckets[i] = NONE;
+    }
+    for( uint32_t f = 0; f < cache_size; f++ )
+    {
+        frames[f].queue = QUEUE_FREE;
+        frames[f].next = f + 1 < cache_size ? f + 1 : NONE;
+    }
+    for( uint32_t g = 0; g < ghost_count; g++ )
+        ghosts[g].block = NONE;
+
+    num_frames  = cache_size;
+    bucket_mask = num_buckets - 1;
+    free_head   = 0;
+    in_head     = NONE;
+    in_tail     = NONE;
+    in_count    = 0;
+    in_limit    = cache_size / 4 > 0 ? cache_size / 4 : 1;
+    main_count  = 0;
+    clock_hand  = 0;
+    num_ghosts  = ghost_count;
+    ghost_next  = 0;
+    return 0;
+}
+
+static void release_frames( )
+{
+    free( frames );
+    free( frame_data );
+    free( buckets );
+    free( ghosts );
+    free( ghost_buckets );
+    frames = NULL;
+    frame_data = NULL;
+    buckets = NULL;
+    ghosts = NULL;
+    ghost_buckets = NULL;
+    num_frames = 0;
+    num_ghosts = 0;
+    stats.cached = 0;
+    stats.dirty = 0;
+}
+
+static uint32_t find_frame( uint32_t block )
+{
+    uint32_t f = buckets[hash_block( block ) & bucket_mask];
+    while( f != NONE && frames[f].block != block )
+        f = frames[f].hash_next;
+    return f;
+}
+
+static void hash_insert( uint32_t f )
+{
+    uint32_t* head = &buckets[hash_block( frames[f].block ) & bucket_mask];
+    frames[f].hash_next = *head;
+    *head = f;
+}
+
+static void hash_remove( uint32_t f )
+{
+    uint32_t* link = &buckets[hash_block( frames[f].block ) & bucket_mask];
+    while( *link != f )
+        link = &frames[*link].hash_next;
+    *link = frames[f].hash_next;
+}
+
+/* Remember the block of a frame that leaves the FIFO queue. */
+static void ghost_add( uint32_t block )
+{
+    struct ghost* g = &ghosts[ghost_next];
+    if( g->block != NONE )
+    {
+        uint32_t* link = &ghost_buckets[hash_block( g->block ) & bucket_mask];
+        while( *link != ghost_next )
+            link = &ghosts[*link].hash_next;
+        *link = g->hash_next;
+    }
+    g->block = block;
+    uint32_t* head = &ghost_buckets[hash_block( block ) & bucket_mask];
+    g->hash_next = *head;
+    *head = ghost_next;
+    ghost_next = ( ghost_next + 1 ) % num_ghosts;
+}
+
+/* Forget the ghost of block, and return whether there was one. */
+static int ghost_take( uint32_t block )
+{
+    uint32_t* link = &ghost_buckets[hash_block( block ) & bucket_mask];
+    while( *link != NONE && ghosts[*link].block != block )
+        link = &ghosts[*link].hash_next;
+    if( *link == NONE )
+        return 0;
+    uint32_t g = *link;
+    *link = ghosts[g].hash_next;
+    ghosts[g].block = NONE;
+    return 1;
+}
+
+static void in_remove( uint32_t f )
+{
+    if( frames[f].prev != NONE ) frames[frames[f].prev].next = frames[f].next;
+    else                         in_head = frames[f].next;
+    if( frames[f].next != NONE ) frames[frames[f].next].prev = frames[f].prev;
+    else                         in_tail = frames[f].prev;
+    in_count--;
+}
+
+static void in_append( uint32_t f )
+{
+    frames[f].prev = in_tail;
+    frames[f].next = NONE;
+    if( in_tail != NONE ) frames[in_tail].next = f;
+    else                  in_head = f;
+    in_tail = f;
+    in_count++;
+}
+
+/* Write the dirty frames in list, which are ordered by block, to
+ * the image. Frames of consecutive blocks are one run, and every
+ * run is written with one pwritev.
+ * Returns 0 on success and -1 if a run could not be written; its
+ * frames stay dirty.
+ */
+static int write_runs( const uint32_t* list, uint32_t count )
+{
+    struct iovec iov[WRITE_RUN_BLOCKS];
+    int result = 0;
+    uint32_t i = 0;
+    while( i < count )
+    {
+        uint32_t first = frames[list[i]].block;
+        uint32_t n = 0;
+        while( i + n < count && n < WRITE_RUN_BLOCKS && frames[list[i + n]].block == first + n )
+        {
+            iov[n].iov_base = frame_bytes( list[i + n] );
+            iov[n].iov_len = BLOCKSIZE;
+            n++;
+        }
+        if( block_image_writev( iov, n, (uint64_t)first * BLOCKSIZE ) != (ssize_t)n * BLOCKSIZE )
+        {
+            fprintf( stderr, "Failed to write blocks %u to %u to the block image\n", first, first + n - 1 );
+            result = -1;
+        }
+        else
+        {
+            for( uint32_t k = 0; k < n; k++ )
+                frames[list[i + k]].dirty = 0;
+            stats.dirty -= n;
+            stats.writebacks += n;
+            stats.write_runs++;
+        }
+        i += n;
+    }
+    return result;
+}
+
+/* Write back a dirty frame that is being replaced, together with
+ * the dirty cached blocks right before and after it, which stay
+ * cached but clean.
+ */
+static int write_cluster( uint32_t f )
+{
+    uint32_t list[WRITE_RUN_BLOCKS];
+    uint32_t block = frames[f].block;
+    uint32_t before = 0;
+    while( before < WRITE_RUN_BLOCKS / 2 && block > before )
+    {
+        uint32_t g = find_frame( block - before - 1 );
+        if( g == NONE || !frames[g].dirty )
+            break;
+        before++;
+    }
+    uint32_t n = 0;
+    for( uint32_t b = block - before; n < WRITE_RUN_BLOCKS; b++ )
+    {
+        uint32_t g = b == block ? f : find_frame( b );
+        if( g == NONE || !frames[g].dirty )
+            break;
+        list[n++] = g;
+    }
+    return write_runs( list, n );
+}
+
+static int compare_blocks( const void* a, const void* b )
+{
+    uint32_t x = frames[*(const uint32_t*)a].block;
+    uint32_t y = frames[*(const uint32_t*)b].block;
+    return x < y ? -1 : x > y;
+}
+
+/* Take a cached frame out of its queue and the hash table, and put
+ * it on the free list.
+ */
+static void drop_frame( uint32_t f )
+{
+    hash_remove( f );
+    if( frames[f].queue == QUEUE_IN )
+        in_remove( f );
+    else
+        main_count--;
+    if( frames[f].dirty )
+        stats.dirty--;
+    frames[f].dirty = 0;
+    frames[f].queue = QUEUE_FREE;
+    frames[f].next = free_head;
+    free_head = f;
+    stats.cached--;
+}
+
+/* The oldest frame of the FIFO queue that is not pinned. */
+static uint32_t in_victim( )
+{
+    uint32_t f = in_head;
+    while( f != NONE && frames[f].pins > 0 )
+        f = frames[f].next;
+    return f;
+}
+
+/* Sweep the CLOCK over the frames of the main queue: a frame that
+ * was used since the last sweep loses its referenced bit, and the
+ * first one without it is the victim.
+ */
+static uint32_t clock_victim( )
+{
+    for( uint32_t step = 0; step < 2 * num_frames; step++ )
+    {
+        uint32_t f = clock_hand;
+        clock_hand = ( clock_hand + 1 ) % num_frames;
+        if( frames[f].queue != QUEUE_MAIN || frames[f].pins > 0 )
+            continue;
+        if( frames[f].referenced )
+        {
+            frames[f].referenced = 0;
+            continue;
+        }
+        return f;
+    }
+    return NONE;
+}
+
+/* Return a free frame, replacing a cached block if there is none.
+ * The frame is in no queue, so it cannot be replaced until
+ * cache_frame() is called for it. pending is the number of frames
+ * that were taken for the FIFO queue and are not in it yet.
+ * Returns NONE if all frames are pinned or a dirty block could not
+ * be written.
+ */
+static uint32_t take_frame( uint32_t pending )
+{
+    uint32_t f = NONE;
+    if( free_head == NONE )
+    {
+        /* 2Q: the FIFO queue gives up its frames while it is over
+         * its share, the main queue otherwise.
+         */
+        if( in_count + pending > in_limit || main_count == 0 )
+            f = in_victim( );
+        if( f == NONE )
+            f = clock_victim( );
+        if( f == NONE )
+            f = in_victim( );
+        if( f == NONE )
+            return NONE;
+        if( frames[f].dirty && write_cluster( f ) == -1 )
+            return NONE;
+        if( frames[f].queue == QUEUE_IN )
+            ghost_add( frames[f].block );
+        drop_frame( f );
+        stats.evictions++;
+    }
+    f = free_head;
+    free_head = frames[f].next;
+    return f;
+}
+
+/* Give a frame from take_frame() the block, and put it in the
+ * queue that 2Q chooses.
+ */
+static void cache_frame( uint32_t f, uint32_t block )
+{
+    frames[f].block = block;
+    frames[f].pins = 0;
+    frames[f].dirty = 0;
+    frames[f].referenced = 1;
+    frames[f].stale = 0;
+    hash_insert( f );
+    if( ghost_take( block ) )
+    {
+        frames[f].queue = QUEUE_MAIN;
+        main_count++;
+    }
+    else
+    {
+        frames[f].queue = QUEUE_IN;
+        in_append( f );
+    }
+    stats.cached++;
+}
+
+/* Note a use of a cached frame. Frames in the FIFO queue are not
+ * moved, so a block that is used a few times in a row still only
+ * counts as used once.
+ */
+static void use_frame( uint32_t f )
+{
+    frames[f].referenced = 1;
+    stats.hits++;
+}
+
+/* Read the block of a frame from the image again if the frame was
+ * forgotten while it was pinned, so that it no longer holds what
+ * was in the block before.
+ * Returns 0 on success and -1 if the block could not be read.
+ */
+static int refresh_frame( uint32_t f )
+{
+    if( !frames[f].stale )
+        return 0;
+    if( block_image_read( frame_bytes( f ), BLOCKSIZE, (uint64_t)frames[f].block * BLOCKSIZE ) != BLOCKSIZE )
+        return -1;
+    frames[f].stale = 0;
+    return 0;
+}
+
+static void mark_dirty( uint32_t f )
+{
+    if( !frames[f].dirty )
+    {
+        if( stats.dirty == 0 )
+            dirty_since = time( NULL );
+        frames[f].dirty = 1;
+        stats.dirty++;
+    }
+}
+
+/* Bring up to count blocks from first that are not cached into
+ * frames, and read the ones that are needed from the image with
+ * one preadv. With write set, only blocks that are partly
+ * overwritten are read, and the bytes of the write are
+ * [skip, skip + size) of the run.
+ * Returns the number of blocks that were cached, or -1 on error.
+ */
+static int load_blocks( uint32_t first, uint32_t count, int write, uint64_t skip, uint64_t size )
+{
+    uint32_t     claimed[BLOCK_CACHE_BATCH];
+    struct iovec iov[BLOCK_CACHE_BATCH];
+    uint32_t     n = 0;
+
+    /* A batch larger than the FIFO queue would push blocks out of
+     * the main queue.
+     */
+    uint32_t batch = in_limit < BLOCK_CACHE_BATCH ? in_limit : BLOCK_CACHE_BATCH;
+    while( n < count && n < batch && find_frame( first + n ) == NONE )
+    {
+        uint32_t f = take_frame( n );
+        if( f == NONE )
+            break;
+        claimed[n] = f;
+        iov[n].iov_base = frame_bytes( f );
+        iov[n].iov_len = BLOCKSIZE;
+        n++;
+    }
+
+    int error = n == 0;
+    if( !error && !write )
+    {
+        /* Blocks after the end of the image read as zeros. */
+        ssize_t got = block_image_readv( iov, n, (uint64_t)first * BLOCKSIZE );
+        if( got == -1 )
+            error = 1;
+        for( uint32_t i = 0; !error && i < n; i++ )
+        {
+            size_t start = (size_t)i * BLOCKSIZE;
+            if( (size_t)got < start + BLOCKSIZE )
+            {
+                size_t have = (size_t)got > start ? got - start : 0;
+                memset( frame_bytes( claimed[i] ) + have, 0, BLOCKSIZE - have );
+            }
+        }
+    }
+    for( uint32_t i = 0; !error && write && i < n; i++ )
+    {
+        uint64_t start = (uint64_t)i * BLOCKSIZE;
+        if( skip <= start && skip + size >= start + BLOCKSIZE )
+            continue;
+        ssize_t got = block_image_read( frame_bytes( claimed[i] ), BLOCKSIZE, (uint64_t)( first + i ) * BLOCKSIZE );
+        if( got == -1 )
+            error = 1;
+        else
+            memset( frame_bytes( claimed[i] ) + got, 0, BLOCKSIZE - got );
+    }
+
+    if( error )
+    {
+        for( uint32_t i = 0; i < n; i++ )
+        {
+            frames[claimed[i]].next = free_head;
+            free_head = claimed[i];
+        }
+        return -1;
+    }
+    for( uint32_t i = 0; i < n; i++ )
+        cache_frame( claimed[i], first + i );
+    stats.misses += n;
+    return n;
+}
+
+/* Write back the dirty frames among count blocks from first,
+ * sorted by block so that neighbours are written together. A range
+ * that is larger than the cache is checked frame by frame.
+ */
+static int flush_blocks( uint32_t first, uint32_t count )
+{
+    if( num_frames == 0 || stats.dirty == 0 )
+        return 0;
+
+    uint32_t* list = malloc( stats.dirty * sizeof(uint32_t) );
+    if( list == NULL )
+    {
+        fprintf( stderr, "Failed to allocate memory to write back %llu blocks\n",
+                 (unsigned long long)stats.dirty );
+        return -1;
+    }
+    uint32_t n = 0;
+    if( count <= num_frames )
+    {
+        for( uint32_t i = 0; i < count && n < stats.dirty; i++ )
+        {
+            uint32_t f = find_frame( first + i );
+            if( f != NONE && frames[f].dirty )
+                list[n++] = f;
+        }
+    }
+    else
+    {
+        for( uint32_t f = 0; f < num_frames && n < stats.dirty; f++ )
+        {
+            if( frames[f].queue != QUEUE_FREE && frames[f].dirty && frames[f].block - first < count )
+                list[n++] = f;
+        }
+        qsort( list, n, sizeof(uint32_t), compare_blocks );
+    }
+    int result = write_runs( list, n );
+    free( list );
+    return result;
+}
+
+/* Write back all dirty blocks when there are too many of them, or
+ * when the oldest one has waited long enough.
+ */
+static void write_back_if_due( )
+{
+    if( stats.dirty == 0 )
+        return;
+    uint32_t limit = dirty_limit > 0 ? dirty_limit : num_frames / 2;
+    if( stats.dirty > limit || ( flush_interval > 0 && time( NULL ) - dirty_since >= flush_interval ) )
+        flush_blocks( 0, UINT32_MAX );
+}
+
+/* Copy between buf and the image through the cache, block by
+ * block. Runs of blocks that are not cached are loaded together.
+ */
+static ssize_t cache_io( char* buf, size_t size, uint64_t offset, int write )
+{
+    size_t   done = 0;
+    uint64_t loaded_end = 0; /* blocks before it were just loaded, and are no hits */
+    while( done < size )
+    {
+        uint32_t block    = ( offset + done ) / BLOCKSIZE;
+        uint32_t in_block = ( offset + done ) % BLOCKSIZE;
+        size_t   count    = BLOCKSIZE - in_block < size - done ? BLOCKSIZE - in_block : size - done;
+
+        uint32_t f = find_frame( block );
+        if( f == NONE )
+        {
+            uint64_t left = in_block + ( size - done );
+            uint32_t blocks = ( left + BLOCKSIZE - 1 ) / BLOCKSIZE;
+            int loaded = load_blocks( block, blocks, write, in_block, size - done );
+            if( loaded == -1 )
+                return done > 0 ? (ssize_t)done : -1;
+            loaded_end = (uint64_t)block + loaded;
+            f = find_frame( block );
+        }
+        else if( block >= loaded_end )
+        {
+            use_frame( f );
+        }
+        if( refresh_frame( f ) == -1 )
+            return done > 0 ? (ssize_t)done : -1;
+
+        if( write )
+        {
+            memcpy( frame_bytes( f ) + in_block, buf + done, count );
+            mark_dirty( f );
+        }
+        else
+        {
+            memcpy( buf + done, frame_bytes( f ) + in_block, count );
+        }
+        done += count;
+    }
+    return done;
+}
+
+ssize_t block_cache_read( void* buf, size_t size, uint64_t offset )
+{
+    pthread_mutex_lock( &cache_lock );
+    if( block_image_fd( ) == -1 || create_frames( ) == -1 )
+    {
+        pthread_mutex_unlock( &cache_lock );
+        return block_image_read( buf, size, offset );
+    }
+    ssize_t n = cache_io( buf, size, offset, 0 );
+    write_back_if_due( );
+    pthread_mutex_unlock( &cache_lock );
+    return n;
+}
+
+ssize_t block_cache_write( const void* buf, size_t size, uint64_t offset )
+{
+    pthread_mutex_lock( &cache_lock );
+    if( block_image_fd( ) == -1 || create_frames( ) == -1 )
+    {
+        pthread_mutex_unlock( &cache_lock );
+        return block_image_write( buf, size, offset );
+    }
+    ssize_t n = cache_io( (char*)buf, size, offset, 1 );
+    write_back_if_due( );
+    pthread_mutex_unlock( &cache_lock );
+    return n;
+}
+
+int block_cache_pin( uint32_t block )
+{
+    pthread_mutex_lock( &cache_lock );
+    int result = -1;
+    if( block_image_fd( ) != -1 && create_frames( ) == 0 )
+    {
+        uint32_t f = find_frame( block );
+        if( f == NONE && load_blocks( block, 1, 0, 0, 0 ) == 1 )
+            f = find_frame( block );
+        else if( f != NONE )
+            use_frame( f );
+        if( f != NONE && refresh_frame( f ) == 0 )
+        {
+            frames[f].pins++;
+            result = 0;
+        }
+    }
+    pthread_mutex_unlock( &cache_lock );
+    return result;
+}
+
+void block_cache_unpin( uint32_t block )
+{
+    pthread_mutex_lock( &cache_lock );
+    uint32_t f = num_frames > 0 ? find_frame( block ) : NONE;
+    if( f != NONE && frames[f].pins > 0 )
+        frames[f].pins--;
+    pthread_mutex_unlock( &cache_lock );
+}
+
+int block_cache_flush( )
+{
+    pthread_mutex_lock( &cache_lock );
+    int result = flush_blocks( 0, UINT32_MAX );
+    pthread_mutex_unlock( &cache_lock );
+    return result;
+}
+
+int block_cache_flush_blocks( uint32_t first, uint32_t count )
+{
+    pthread_mutex_lock( &cache_lock );
+    int result = flush_blocks( first, count );
+    pthread_mutex_unlock( &cache_lock );
+    return result;
+}
+
+void block_cache_forget( uint32_t first, uint32_t count )
+{
+    pthread_mutex_lock( &cache_lock );
+    for( uint32_t i = 0; num_frames > 0 && stats.cached > 0 && i < count; i++ )
+    {
+        uint32_t f = find_frame( first + i );
+        if( f == NONE )
+            continue;
+        if( frames[f].pins > 0 )
+        {
+            /* The frame stays for its pins, but is read again
+             * before it is used.
+             */
+            if( frames[f].dirty )
+                stats.dirty--;
+            frames[f].dirty = 0;
+            frames[f].stale = 1;
+        }
+        else
+        {
+            drop_frame( f );
+        }
+    }
+    pthread_mutex_unlock( &cache_lock );
+}
+
+void block_cache_release( )
+{
+    pthread_mutex_lock( &cache_lock );
+    flush_blocks( 0, UINT32_MAX );
+    release_frames( );
+    pthread_mutex_unlock( &cache_lock );
+}
+
+void set_block_cache_size( uint32_t blocks )
+{
+    pthread_mutex_lock( &cache_lock );
+    flush_blocks( 0, UINT32_MAX );
+    release_frames( );
+    cache_size = blocks;
+    pthread_mutex_unlock( &cache_lock );
+}
+
+void get_block_cache_stats( struct block_cache_stats* out )
+{
+    pthread_mutex_lock( &cache_lock );
+    *out = stats;
+    pthread_mutex_unlock( &cache_lock );
+}
+
+void set_block_cache_dirty_limit( uint32_t blocks )
+{
+    pthread_mutex_lock( &cache_lock );
+    dirty_limit = blocks;
+    pthread_mutex_unlock( &cache_lock );
+}
+
+void set_block_cache_flush_interval( int seconds )
+{
+    pthread_mutex_lock( &cache_lock );
+    flush_interval = seconds > 0 ? seconds : 0;
+    pthread_mutex_unlock( &cache_lock );
+}
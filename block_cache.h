@@ -0,0 +1,121 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A fixed number of blocks of the block image, kept in memory.
+ *
+ * fs_read() and fs_write() go through the cache, which is keyed by
+ * the block numbers of the block allocation table. Blocks are
+ * replaced in 2Q order: a block that is read for the first time
+ * enters a small FIFO queue, and only a block that is used again
+ * after it left that queue, while its number is still remembered
+ * in a queue of ghosts, enters the main part of the cache, which
+ * is replaced in CLOCK order. A small set of files that are used
+ * again and again therefore stays in memory, and reading a large
+ * file once only replaces the FIFO queue.
+ *
+ * Written blocks are only marked dirty. Dirty blocks are written
+ * to the image in runs: the dirty blocks are sorted, and every run
+ * of consecutive block numbers, which is a run of contiguous
+ * blocks of a file, is written with one pwritev. This happens by
+ * block_cache_flush() (which fs_sync() calls), by
+ * close_block_image(), when there are more dirty blocks than the
+ * dirty limit, and when the oldest dirty block has waited for the
+ * flush interval. A dirty block that is replaced is written
+ * together with the dirty blocks next to it.
+ *
+ * The cache has one lock, and may be used by several threads.
+ */
+
+/* The number of blocks in the cache until set_block_cache_size()
+ * is called: 4 MiB.
+ */
+#define BLOCK_CACHE_DEFAULT_BLOCKS 1024
+
+/* The most blocks that are read from the image with one call when
+ * a run of blocks is missing from the cache.
+ */
+#define BLOCK_CACHE_BATCH 64
+
+/* Seconds that a dirty block may wait before all dirty blocks are
+ * written, see set_block_cache_flush_interval().
+ */
+#define BLOCK_CACHE_FLUSH_INTERVAL 5
+
+struct block_cache_stats
+{
+    uint64_t hits;       /* blocks that were found in the cache */
+    uint64_t misses;     /* blocks that were read from the image, or written without being cached */
+    uint64_t evictions;  /* blocks that were replaced */
+    uint64_t writebacks; /* dirty blocks that were written to the image */
+    uint64_t write_runs; /* pwritev calls that wrote them */
+    uint64_t cached;     /* blocks in the cache now */
+    uint64_t dirty;      /* of those, blocks that were not written to the image yet */
+};
+
+/* Set the number of blocks in the cache. Dirty blocks are written
+ * back and the cache is emptied first. With 0 there is no cache,
+ * and reads and writes go to the image directly.
+ */
+void set_block_cache_size( uint32_t blocks );
+
+/* Write all dirty blocks back when there are more than blocks of
+ * them. 0, the default, is half the cache.
+ */
+void set_block_cache_dirty_limit( uint32_t blocks );
+
+/* Write all dirty blocks back once the oldest of them has waited
+ * for seconds. The wait is checked by block_cache_read() and
+ * block_cache_write(). 0 waits until the cache is flushed.
+ */
+void set_block_cache_flush_interval( int seconds );
+
+/* Read size bytes at the given byte offset of the block image into
+ * buf, like block_image_read(), from the cache where possible.
+ * Returns the number of bytes read, or -1 on error.
+ */
+ssize_t block_cache_read( void* buf, size_t size, uint64_t offset );
+
+/* Write size bytes from buf at the given byte offset of the block
+ * image, like block_image_write(). The bytes are only written to
+ * the image later. Returns size, or -1 on error.
+ */
+ssize_t block_cache_write( const void* buf, size_t size, uint64_t offset );
+
+/* Read the block into the cache if it is not there yet, and keep
+ * it there until block_cache_unpin() is called as often as
+ * block_cache_pin(). Returns 0 on success and -1 on error.
+ */
+int block_cache_pin( uint32_t block );
+void block_cache_unpin( uint32_t block );
+
+/* Write all dirty blocks to the image.
+ * Returns 0 on success and -1 if a block could not be written.
+ */
+int block_cache_flush( );
+
+/* Write the dirty blocks among count blocks from first to the
+ * image, so that a mapping of the image shows them.
+ * Returns 0 on success and -1 if a block could not be written.
+ */
+int block_cache_flush_blocks( uint32_t first, uint32_t count );
+
+/* Drop count blocks from first from the cache without writing
+ * them, because they were freed or written around the cache.
+ * Pinned blocks stay, but are no longer dirty, and are read from
+ * the image again the next time they are used.
+ */
+void block_cache_forget( uint32_t first, uint32_t count );
+
+/* Write all dirty blocks to the image and release the memory of
+ * the cache. close_block_image() calls this.
+ */
+void block_cache_release( );
+
+/* Copy the counters of the cache to stats. */
+void get_block_cache_stats( struct block_cache_stats* stats );
+
+#endif // BLOCK_CACHE_H
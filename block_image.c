@@ -0,0 +1,287 @@
+/* For fallocate() and its hole punching. */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "block_image.h"
+#include "block_allocation.h"
+#include "block_cache.h"
+
+/* A read-only mapping of the image. When the image has grown past
+ * the current mapping, a larger one is made, and the old ones are
+ * kept until the image is closed, since views may point into them.
+ */
+struct image_mapping
+{
+    struct image_mapping* next;
+    char*                 base;
+    size_t                size;
+};
+
+/* The file descriptor of the image, -1 while it is not open.
+ * We make the variables static to hide them from other C files.
+ */
+static int image_fd = -1;
+
+/* The largest mapping first. Guarded by mapping_lock, since
+ * threads may ask for views at the same time.
+ */
+static struct image_mapping* mappings     = NULL;
+static pthread_mutex_t       mapping_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int set_block_image_name( const char* str )
+{
+    if( image_fd != -1 )
+    {
+        fprintf( stderr, "Cannot open %s as block image, an image is already open\n", str );
+        return -1;
+    }
+
+    int fd = open( str, O_RDWR | O_CREAT, 0644 );
+    if( fd == -1 )
+    {
+        fprintf( stderr, "Failed to open block image %s (%s)\n", str, strerror(errno) );
+        return -1;
+    }
+
+    /* Blocks that were never written are holes in the file, so the
+     * image costs no space until files are written.
+     */
+    struct stat st;
+    off_t size = (off_t)get_num_blocks( ) * BLOCKSIZE;
+    if( fstat( fd, &st ) == -1 || ( st.st_size < size && ftruncate( fd, size ) == -1 ) )
+    {
+        fprintf( stderr, "Failed to size block image %s (%s)\n", str, strerror(errno) );
+        close( fd );
+        return -1;
+    }
+
+    image_fd = fd;
+
+    static int registered = 0;
+    if( !registered )
+    {
+        atexit( &close_block_image );
+        registered = 1;
+    }
+    return 0;
+}
+
+void close_block_image( )
+{
+    /* Dirty blocks in the cache belong to this image. */
+    if( image_fd != -1 )
+        block_cache_release( );
+
+    pthread_mutex_lock( &mapping_lock );
+    while( mappings )
+    {
+        struct image_mapping* next = mappings->next;
+        munmap( mappings->base, mappings->size );
+        free( mappings );
+        mappings = next;
+    }
+    pthread_mutex_unlock( &mapping_lock );
+
+    if( image_fd != -1 )
+    {
+        close( image_fd );
+        image_fd = -1;
+    }
+}
+
+ssize_t block_image_read( void* buf, size_t size, uint64_t offset )
+{
+    if( image_fd == -1 )
+    {
+        fprintf( stderr, "The block image has not been opened\n" );
+        return -1;
+    }
+
+    /* Continue after short reads, until the end of the file. */
+    size_t done = 0;
+    while( done < size )
+    {
+        ssize_t n = pread( image_fd, (char*)buf + done, size - done, offset + done );
+        if( n == -1 && errno == EINTR )
+            continue;
+        if( n == -1 )
+            return -1;
+        if( n == 0 )
+            break;
+        done += n;
+    }
+    return done;
+}
+
+ssize_t block_image_write( const void* buf, size_t size, uint64_t offset )
+{
+    if( image_fd == -1 )
+    {
+        fprintf( stderr, "The block image has not been opened\n" );
+        return -1;
+    }
+
+    size_t done = 0;
+    while( done < size )
+    {
+        ssize_t n = pwrite( image_fd, (const char*)buf + done, size - done, offset + done );
+        if( n == -1 && errno == EINTR )
+            continue;
+        if( n == -1 )
+            return -1;
+        done += n;
+    }
+    return done;
+}
+
+ssize_t block_image_readv( const struct iovec* iov, int count, uint64_t offset )
+{
+    if( image_fd == -1 )
+    {
+        fprintf( stderr, "The block image has not been opened\n" );
+        return -1;
+    }
+
+    /* A short read is continued with block_image_read(), buffer by
+     * buffer, which stops at the end of the file.
+     */
+    ssize_t n;
+    do
+    {
+        n = preadv( image_fd, iov, count, offset );
+    } while( n == -1 && errno == EINTR );
+    if( n == -1 )
+        return -1;
+
+    size_t done = n;
+    size_t start = 0;
+    for( int i = 0; i < count; i++ )
+    {
+        size_t end = start + iov[i].iov_len;
+        if( done < end )
+        {
+            ssize_t more = block_image_read( (char*)iov[i].iov_base + ( done - start ),
+                                             end - done, offset + done );
+            if( more == -1 )
+                return -1;
+            done += more;
+            if( done < end )
+                break;
+        }
+        start = end;
+    }
+    return done;
+}
+
+ssize_t block_image_writev( const struct iovec* iov, int count, uint64_t offset )
+{
+    if( image_fd == -1 )
+    {
+        fprintf( stderr, "The block image has not been opened\n" );
+        return -1;
+    }
+
+    ssize_t n;
+    do
+    {
+        n = pwritev( image_fd, iov, count, offset );
+    } while( n == -1 && errno == EINTR );
+    if( n == -1 )
+        return -1;
+
+    /* A short write is continued buffer by buffer. */
+    size_t done = n;
+    size_t start = 0;
+    for( int i = 0; i < count; i++ )
+    {
+        size_t end = start + iov[i].iov_len;
+        if( done < end )
+        {
+            ssize_t more = block_image_write( (const char*)iov[i].iov_base + ( done - start ),
+                                              end - done, offset + done );
+            if( more == -1 )
+                return -1;
+            done += more;
+        }
+        start = end;
+    }
+    return done;
+}
+
+int block_image_discard( uint64_t offset, size_t size )
+{
+    if( image_fd == -1 )
+    {
+        fprintf( stderr, "The block image has not been opened\n" );
+        return -1;
+    }
+
+    if( fallocate( image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size ) == 0 )
+        return 0;
+
+    /* File systems that cannot punch holes get zeros written. */
+    static const char zeros[BLOCKSIZE];
+    for( size_t done = 0; done < size; done += sizeof(zeros) )
+    {
+        size_t n = size - done < sizeof(zeros) ? size - done : sizeof(zeros);
+        if( block_image_write( zeros, n, offset + done ) == -1 )
+            return -1;
+    }
+    return 0;
+}
+
+void block_image_prefetch( uint64_t offset, size_t size )
+{
+    if( image_fd != -1 )
+        posix_fadvise( image_fd, offset, size, POSIX_FADV_WILLNEED );
+}
+
+const char* block_image_view( uint64_t offset, size_t size )
+{
+    if( image_fd == -1 )
+        return NULL;
+
+    pthread_mutex_lock( &mapping_lock );
+    if( mappings == NULL || offset + size > mappings->size )
+    {
+        /* Map the whole file as it is now. */
+        struct stat st;
+        struct image_mapping* mapping = malloc( sizeof(struct image_mapping) );
+        if( mapping == NULL || fstat( image_fd, &st ) == -1 || (uint64_t)st.st_size < offset + size
+            || st.st_size == 0 )
+        {
+            free( mapping );
+            pthread_mutex_unlock( &mapping_lock );
+            return NULL;
+        }
+        mapping->size = st.st_size;
+        mapping->base = mmap( NULL, mapping->size, PROT_READ, MAP_SHARED, image_fd, 0 );
+        if( mapping->base == MAP_FAILED )
+        {
+            free( mapping );
+            pthread_mutex_unlock( &mapping_lock );
+            return NULL;
+        }
+        madvise( mapping->base, mapping->size, MADV_SEQUENTIAL );
+        mapping->next = mappings;
+        mappings = mapping;
+    }
+    const char* view = mappings->base + offset;
+    pthread_mutex_unlock( &mapping_lock );
+    return view;
+}
+
+int block_image_fd( )
+{
+    return image_fd;
+}
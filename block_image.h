@@ -0,0 +1,77 @@
+#ifndef BLOCK_IMAGE_H
+#define BLOCK_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The contents of the simulated disk.
+ *
+ * The block allocation table only records which blocks are used.
+ * The block image is a file that holds the bytes of the blocks:
+ * block n is stored at offset n * BLOCKSIZE. It is indexed by the
+ * same block numbers that allocate_block() hands out, and grows
+ * to get_num_blocks() blocks when it is opened. Blocks that were
+ * never written read as zeros.
+ */
+
+/* Open the block image file, and create it if it does not exist.
+ * This is necessary before fs_read() and fs_write() can be used.
+ * Returns 0 on success and -1 if the file cannot be opened.
+ */
+int set_block_image_name( const char* str );
+
+/* Close the block image. Pointers returned by block_image_view()
+ * are no longer valid afterwards.
+ */
+void close_block_image( );
+
+/* Read size bytes at the given byte offset of the image into buf.
+ * Returns the number of bytes read, which is less than size only
+ * at the end of the image, or -1 on error.
+ */
+ssize_t block_image_read( void* buf, size_t size, uint64_t offset );
+
+/* Write size bytes from buf at the given byte offset of the image.
+ * The image grows if the bytes end after it.
+ * Returns the number of bytes written, or -1 on error.
+ */
+ssize_t block_image_write( const void* buf, size_t size, uint64_t offset );
+
+/* Read the blocks at the given byte offset of the image into the
+ * count buffers of iov, in order, with one preadv call.
+ * Returns the number of bytes read, or -1 on error.
+ */
+struct iovec;
+ssize_t block_image_readv( const struct iovec* iov, int count, uint64_t offset );
+
+/* Write the count buffers of iov, in order, at the given byte
+ * offset of the image with one pwritev call.
+ * Returns the number of bytes written, or -1 on error.
+ */
+ssize_t block_image_writev( const struct iovec* iov, int count, uint64_t offset );
+
+/* Make size bytes at the given byte offset of the image read as
+ * zeros, by punching a hole into the file where the file system
+ * allows it, and by writing zeros otherwise.
+ * Returns 0 on success and -1 on error.
+ */
+int block_image_discard( uint64_t offset, size_t size );
+
+/* Tell the kernel that size bytes at the given byte offset of the
+ * image will be read soon, so that it reads them in the background.
+ */
+void block_image_prefetch( uint64_t offset, size_t size );
+
+/* Return a pointer to size bytes at the given byte offset of the
+ * image, in a read-only mapping of the file, or NULL if the bytes
+ * are not in the image or it cannot be mapped. Writes through
+ * block_image_write() are seen through the mapping. The pointer
+ * stays valid until close_block_image().
+ */
+const char* block_image_view( uint64_t offset, size_t size );
+
+/* Return the file descriptor of the image, or -1 if it is not open. */
+int block_image_fd( );
+
+#endif // BLOCK_IMAGE_H
@@ -0,0 +1,81 @@
+#include "inode.h"
+#include "block_allocation.h"
+#include "block_image.h"
+
+#include <stdio.h>
+
+#define FILE_SIZE 10000
+
+/* Read the whole file and print whether it holds only zeros, or
+ * else the first bytes that are not zero.
+ */
+static void print_contents( struct inode* file )
+{
+    char    buf[FILE_SIZE];
+    ssize_t n = fs_read( file, 0, buf, sizeof(buf) );
+    ssize_t i = 0;
+    while( i < n && buf[i] == 0 )
+        i++;
+    if( i == n ) printf("%s: read %zd bytes, all zeros\n", file->name, n );
+    else         printf("%s: read %zd bytes, byte %zd is '%.10s'\n", file->name, n, i, buf + i );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 4 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT IMG\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         "       IMG is the name of the block image\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char* img_name = argv[3];
+    char  buf[FILE_SIZE];
+
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+    remove( img_name );
+    if( set_block_image_name( img_name ) == -1 )
+        exit( -1 );
+
+    printf("===================================\n");
+    printf("= Write a file and read it back   =\n");
+    printf("===================================\n");
+    struct inode* root   = create_dir( NULL, "/" );
+    struct inode* f_old  = create_file( root, "secret", 0, FILE_SIZE );
+    memset( buf, 'x', sizeof(buf) );
+    printf("Wrote %zd bytes\n", fs_write( f_old, 0, buf, sizeof(buf) ) );
+    fs_write( f_old, 4096, "block two", 9 );
+    print_contents( f_old );
+
+    const void* view;
+    ssize_t n = fs_read_view( f_old, 4096, 20, &view );
+    printf("The view at 4096 shows %zd bytes: '%.9s'\n", n, (const char*)view );
+    fs_sync( );
+    debug_fs( root );
+
+    printf("===================================\n");
+    printf("= Delete it and create a new file =\n");
+    printf("= on the same blocks              =\n");
+    printf("===================================\n");
+    delete_file( root, f_old );
+    struct inode* f_new = create_file( root, "fresh", 0, FILE_SIZE );
+    debug_fs( root );
+    print_contents( f_new );
+    n = fs_read_view( f_new, 4096, 20, &view );
+    printf("The view at 4096 shows %zd bytes, %s\n", n,
+           memcmp( view, "\0\0\0\0\0\0\0\0\0", 9 ) == 0 ? "zeros" : "old bytes" );
+
+    fs_write( f_new, 8000, "new bytes", 9 );
+    print_contents( f_new );
+
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+    close_block_image( );
+}
@@ -0,0 +1,95 @@
+#include "inode.h"
+#include "block_allocation.h"
+#include "block_image.h"
+#include "block_cache.h"
+
+#include <stdio.h>
+
+#define FILE_BLOCKS 16
+
+/* Print the counters of the block cache. */
+static void print_stats( const char* when )
+{
+    struct block_cache_stats stats;
+    get_block_cache_stats( &stats );
+    printf("%s: hits %llu misses %llu evictions %llu writebacks %llu in %llu runs, cached %llu dirty %llu\n",
+           when,
+           (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+           (unsigned long long)stats.evictions, (unsigned long long)stats.writebacks,
+           (unsigned long long)stats.write_runs, (unsigned long long)stats.cached,
+           (unsigned long long)stats.dirty );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 4 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT IMG\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         "       IMG is the name of the block image\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char* img_name = argv[3];
+    static char buf[FILE_BLOCKS * BLOCKSIZE];
+
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+    remove( img_name );
+    if( set_block_image_name( img_name ) == -1 )
+        exit( -1 );
+    set_block_cache_size( 8 );
+
+    printf("===================================\n");
+    printf("= Write a file of %d blocks through\n", FILE_BLOCKS );
+    printf("= a cache of 8 blocks\n");
+    printf("===================================\n");
+    struct inode* root = create_dir( NULL, "/" );
+    struct inode* file = create_file( root, "data", 0, sizeof(buf) );
+    for( int b=0; b<FILE_BLOCKS; b++ )
+        memset( buf + b * BLOCKSIZE, 'a' + b, BLOCKSIZE );
+    fs_write( file, 0, buf, sizeof(buf) );
+    print_stats( "After the write" );
+    fs_sync( );
+    print_stats( "After fs_sync" );
+
+    printf("===================================\n");
+    printf("= Read the first 4 blocks twice   =\n");
+    printf("===================================\n");
+    fs_read( file, 0, buf, 4 * BLOCKSIZE );
+    print_stats( "After the first read" );
+    fs_read( file, 0, buf, 4 * BLOCKSIZE );
+    print_stats( "After the second read" );
+
+    printf("===================================\n");
+    printf("= Pin the first block and read    =\n");
+    printf("= the whole file                  =\n");
+    printf("===================================\n");
+    uint32_t first = ((struct Extent*)file->entries)[0].blockno;
+    printf("Pinning %s\n", block_cache_pin( first ) == 0 ? "succeeded" : "failed" );
+    fs_read( file, 0, buf, sizeof(buf) );
+    print_stats( "After reading the file" );
+    fs_read( file, 0, buf, 1 );
+    print_stats( "After reading the pinned block" );
+
+    printf("===================================\n");
+    printf("= Write the pinned block around   =\n");
+    printf("= the cache                       =\n");
+    printf("===================================\n");
+    memset( buf, 'z', BLOCKSIZE );
+    block_image_write( buf, BLOCKSIZE, (uint64_t)first * BLOCKSIZE );
+    block_cache_forget( first, 1 );
+    fs_read( file, 0, buf, 1 );
+    printf("The pinned block now starts with '%c'\n", buf[0] );
+    block_cache_unpin( first );
+    print_stats( "After unpinning" );
+
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+    close_block_image( );
+}
@@ -0,0 +1,94 @@
+#include "inode.h"
+#include "block_allocation.h"
+
+#include <stdio.h>
+
+/* Print the files of dir with their blocks, or the blocks they
+ * reserved when they are still pending.
+ */
+static void print_files( struct inode* dir )
+{
+    for( uint32_t i=0; i<dir->num_entries; i++ )
+    {
+        struct inode* file = (struct inode*)dir->entries[i];
+        if( file->is_directory )
+            continue;
+        printf("  %s/%s:", dir->name, file->name );
+        if( file->num_entries == 0 )
+            printf(" %u blocks reserved", file->reserved );
+        for( uint32_t e=0; e<file->num_entries; e++ )
+        {
+            struct Extent* extent = (struct Extent*)file->entries + e;
+            printf(" blocks %u-%u", extent->blockno, extent->blockno + extent->extent - 1 );
+        }
+        printf("\n");
+    }
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 3 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char  name[32];
+
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+    set_delayed_allocation( 1 );
+
+    printf("===================================\n");
+    printf("= Create files in two directories =\n");
+    printf("= in turns                        =\n");
+    printf("===================================\n");
+    struct inode* root  = create_dir( NULL, "/" );
+    struct inode* dir_a = create_dir( root, "a" );
+    struct inode* dir_b = create_dir( root, "b" );
+    for( int i=0; i<4; i++ )
+    {
+        snprintf( name, sizeof(name), "a-%d", i );
+        create_file( dir_a, name, 0, ( i + 1 ) * BLOCKSIZE );
+        snprintf( name, sizeof(name), "b-%d", i );
+        create_file( dir_b, name, 0, 2 * BLOCKSIZE );
+    }
+    print_files( dir_a );
+    print_files( dir_b );
+    printf("Reserved blocks: %llu\n", (unsigned long long)get_reserved_blocks( ) );
+
+    printf("===================================\n");
+    printf("= Delete a pending file           =\n");
+    printf("===================================\n");
+    delete_file( dir_b, find_inode_by_name( dir_b, "b-3" ) );
+    printf("Reserved blocks: %llu\n", (unsigned long long)get_reserved_blocks( ) );
+
+    printf("===================================\n");
+    printf("= Place the blocks                =\n");
+    printf("===================================\n");
+    printf("place_delayed_blocks returned %d\n", place_delayed_blocks( root ) );
+    print_files( dir_a );
+    print_files( dir_b );
+    printf("Reserved blocks: %llu\n", (unsigned long long)get_reserved_blocks( ) );
+    debug_fs( root );
+
+    printf("===================================\n");
+    printf("= More files are placed by        =\n");
+    printf("= save_inodes                     =\n");
+    printf("===================================\n");
+    create_file( dir_a, "a-4", 0, 3 * BLOCKSIZE );
+    create_file( dir_b, "b-4", 0, 3 * BLOCKSIZE );
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+    root = load_inodes( mft_name );
+    print_files( find_inode_by_name( root, "a" ) );
+    print_files( find_inode_by_name( root, "b" ) );
+    printf("Reserved blocks: %llu\n", (unsigned long long)get_reserved_blocks( ) );
+    fs_shutdown( root );
+}
@@ -0,0 +1,156 @@
+#include "dir_index.h"
+#include "inode.h"
+#include "fs_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Marks a slot whose entry was removed, so that probing continues past it
+#define TOMBSTONE ((struct inode*) 1)
+
+struct dir_slot
+{
+    uint32_t      hash;
+    struct inode* node;
+};
+
+struct dir_index
+{
+    uint32_t         capacity; // always a power of two
+    uint32_t         count;    // live entries
+    uint32_t         used;     // live entries and tombstones
+    struct dir_slot* slots;
+};
+
+/*
+FNV-1a hash of a name.
+*/
+static uint32_t hash_name(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*) name; *p; p++){
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+Puts node into the first free slot of its probe sequence. The table must have room.
+*/
+static void place(struct dir_index* index, uint32_t hash, struct inode* node)
+{
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = hash & mask;
+    while (index->slots[i].node && index->slots[i].node != TOMBSTONE){
+        i = (i + 1) & mask;
+    }
+    if (!index->slots[i].node){
+        index->used++;
+    }
+    index->slots[i].hash = hash;
+    index->slots[i].node = node;
+    index->count++;
+}
+
+/*
+Moves all live entries into a new table of the given capacity, dropping the tombstones.
+*/
+static int rehash(struct fs_pool* pool, struct dir_index* index, uint32_t capacity)
+{
+    struct dir_slot* old = index->slots;
+    uint32_t old_capacity = index->capacity;
+
+    struct dir_slot* slots = fs_pool_alloc(pool, capacity * sizeof(struct dir_slot));
+    if (!slots){
+        return -1;
+    }
+    memset(slots, 0, capacity * sizeof(struct dir_slot));
+    index->slots = slots;
+    index->capacity = capacity;
+    index->count = 0;
+    index->used = 0;
+
+    for (uint32_t i = 0; i < old_capacity; i++){
+        if (old[i].node && old[i].node != TOMBSTONE){
+            place(index, old[i].hash, old[i].node);
+        }
+    }
+    fs_pool_free(pool, old, old_capacity * sizeof(struct dir_slot));
+    return 0;
+}
+
+struct dir_index* dir_index_build(struct fs_pool* pool, const uintptr_t* entries, uint32_t num_entries)
+{
+    struct dir_index* index = fs_pool_alloc(pool, sizeof(struct dir_index));
+    if (!index){
+        return NULL;
+    }
+    memset(index, 0, sizeof(struct dir_index));
+
+    // Keep the table at most half full
+    uint32_t capacity = 2 * DIR_INDEX_THRESHOLD;
+    while (capacity < 2 * (uint64_t) num_entries){
+        capacity *= 2;
+    }
+    if (rehash(pool, index, capacity) == -1){
+        fs_pool_free(pool, index, sizeof(struct dir_index));
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < num_entries; i++){
+        struct inode* child = (struct inode*) entries[i];
+        place(index, hash_name(child->name), child);
+    }
+    return index;
+}
+
+void dir_index_free(struct fs_pool* pool, struct dir_index* index)
+{
+    if (!index){
+        return;
+    }
+    fs_pool_free(pool, index->slots, index->capacity * sizeof(struct dir_slot));
+    fs_pool_free(pool, index, sizeof(struct dir_index));
+}
+
+struct inode* dir_index_find(const struct dir_index* index, const char* name)
+{
+    uint32_t hash = hash_name(name);
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = hash & mask; index->slots[i].node; i = (i + 1) & mask){
+        const struct dir_slot* slot = &index->slots[i];
+        if (slot->node != TOMBSTONE && slot->hash == hash && strcmp(slot->node->name, name) == 0){
+            return slot->node;
+        }
+    }
+    return NULL;
+}
+
+int dir_index_insert(struct fs_pool* pool, struct dir_index* index, struct inode* node)
+{
+    if (2 * (uint64_t)(index->used + 1) > index->capacity){
+        // Grow only if the live entries need it, otherwise just clear the tombstones
+        uint32_t capacity = index->capacity;
+        if (4 * (uint64_t)(index->count + 1) > capacity){
+            capacity *= 2;
+        }
+        if (rehash(pool, index, capacity) == -1){
+            return -1;
+        }
+    }
+    place(index, hash_name(node->name), node);
+    return 0;
+}
+
+void dir_index_remove(struct dir_index* index, struct inode* node)
+{
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = hash_name(node->name) & mask; index->slots[i].node; i = (i + 1) & mask){
+        if (index->slots[i].node == node){
+            index->slots[i].node = TOMBSTONE;
+            index->count--;
+            return;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include <stdint.h>
+
+struct inode;
+struct fs_pool;
+
+/* A hash index over the names of the entries of one directory.
+ *
+ * It is an open-addressing table with linear probing. Every slot
+ * keeps the hash of the name next to the inode pointer, so a probe
+ * only dereferences a child inode when the hashes match.
+ *
+ * Directories get an index automatically once they have
+ * DIR_INDEX_THRESHOLD entries; smaller directories are searched
+ * linearly. The memory of an index comes from the pool of the
+ * tree the directory belongs to.
+ */
+#define DIR_INDEX_THRESHOLD 16
+
+struct dir_index;
+
+/* Build an index for the num_entries inode pointers in entries.
+ * Returns NULL if memory could not be allocated.
+ */
+struct dir_index* dir_index_build(struct fs_pool* pool, const uintptr_t* entries, uint32_t num_entries);
+
+/* Free the index. NULL is allowed. */
+void dir_index_free(struct fs_pool* pool, struct dir_index* index);
+
+/* Return the entry with the given name, or NULL. */
+struct inode* dir_index_find(const struct dir_index* index, const char* name);
+
+/* Add node to the index. Its name must not be in the index yet.
+ * Returns 0 on success and -1 if memory could not be allocated.
+ */
+int dir_index_insert(struct fs_pool* pool, struct dir_index* index, struct inode* node);
+
+/* Remove node from the index, if it is there. */
+void dir_index_remove(struct dir_index* index, struct inode* node);
+
+#endif
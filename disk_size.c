@@ -0,0 +1,107 @@
+#include "block_allocation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* The name of the block allocation table can only be set once in a
+ * process, so every step opens the table in a child process.
+ */
+typedef void (*step_fn)( const char* bat_name, uint32_t blocks );
+
+static void run_step( step_fn step, const char* bat_name, uint32_t blocks )
+{
+    fflush( stdout );
+    pid_t pid = fork( );
+    if( pid == 0 )
+    {
+        step( bat_name, blocks );
+        exit( 0 );
+    }
+    if( pid == -1 || waitpid( pid, NULL, 0 ) != pid )
+    {
+        fprintf( stderr, "Failed to run a step in a child process\n" );
+        exit( -1 );
+    }
+}
+
+/* Format a disk of the given size, or of the default size for 0,
+ * and fill all but the last 10 blocks.
+ */
+static void format_and_fill( const char* bat_name, uint32_t blocks )
+{
+    set_block_allocation_table_name( bat_name );
+    if( blocks == 0 ) format_disk( );
+    else              format_disk_blocks( blocks );
+    blocks = get_num_blocks( );
+    printf("Formatted a disk of %u blocks\n", blocks );
+    printf("allocate_block(%u) returned %d\n", blocks - 10, allocate_block( blocks - 10 ) );
+    printf("allocate_block(11) returned %d\n", allocate_block( 11 ) );
+
+    struct stat st;
+    if( stat( bat_name, &st ) == 0 )
+        printf("The table file has %lld bytes\n", (long long)st.st_size );
+}
+
+/* Open the disk again, which takes its size from the header. */
+static void reopen( const char* bat_name, uint32_t blocks )
+{
+    (void)blocks;
+    set_block_allocation_table_name( bat_name );
+    printf("The disk has %u blocks\n", get_num_blocks( ) );
+    printf("allocate_block(10) returned %d\n", allocate_block( 10 ) );
+    printf("allocate_block(1) returned %d\n", allocate_block( 1 ) );
+    if( get_num_blocks( ) <= 300 )
+        debug_disk( );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 2 )
+    {
+        fprintf( stderr, "Usage: %s BAT\n"
+                         "       where\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* bat_name = argv[1];
+
+    printf("===================================\n");
+    printf("= The default size                =\n");
+    printf("===================================\n");
+    run_step( format_and_fill, bat_name, 0 );
+    run_step( reopen, bat_name, 0 );
+
+    printf("===================================\n");
+    printf("= A disk of 250 blocks            =\n");
+    printf("===================================\n");
+    run_step( format_and_fill, bat_name, 250 );
+    run_step( reopen, bat_name, 0 );
+
+    printf("===================================\n");
+    printf("= A disk of 1000000 blocks        =\n");
+    printf("===================================\n");
+    run_step( format_and_fill, bat_name, 1000000 );
+    run_step( reopen, bat_name, 0 );
+
+    printf("===================================\n");
+    printf("= A header with another block     =\n");
+    printf("= size                            =\n");
+    printf("===================================\n");
+    FILE* f = fopen( bat_name, "w" );
+    if( !f )
+    {
+        perror( bat_name );
+        exit( -1 );
+    }
+    uint32_t header[4] = { 0x31544142 /* "BAT1" */, 2, 64, 512 };
+    uint64_t bitmap    = 0;
+    fwrite( header, sizeof(header), 1, f );
+    fwrite( &bitmap, sizeof(bitmap), 1, f );
+    fclose( f );
+    run_step( reopen, bat_name, 0 );
+}
@@ -0,0 +1,120 @@
+#include "extent_tree.h"
+#include "block_allocation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Print the runs below node i in the order of their first block. */
+static void print_subtree( const struct extent_tree* tree, uint32_t i )
+{
+    if( i == 0 )
+        return;
+    print_subtree( tree, tree->nodes[i].left );
+    printf(" [%u+%u]", tree->nodes[i].start, tree->nodes[i].length );
+    print_subtree( tree, tree->nodes[i].right );
+}
+
+static void print_runs( const char* what, const struct extent_tree* tree )
+{
+    printf("%-22s %u runs, longest %u:", what, tree->num_runs, extent_tree_longest( tree ) );
+    if( tree->num_runs <= 8 )
+        print_subtree( tree, tree->root );
+    printf("\n");
+}
+
+/* Return the depth of the deepest node below node i. */
+static uint32_t depth( const struct extent_tree* tree, uint32_t i )
+{
+    if( i == 0 )
+        return 0;
+    uint32_t l = depth( tree, tree->nodes[i].left );
+    uint32_t r = depth( tree, tree->nodes[i].right );
+    return 1 + ( l > r ? l : r );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 2 )
+    {
+        fprintf( stderr, "Usage: %s BAT\n"
+                         "       where\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* bat_name = argv[1];
+    struct extent_tree tree;
+    extent_tree_init( &tree );
+
+    printf("===================================\n");
+    printf("= Insert runs that merge          =\n");
+    printf("===================================\n");
+    extent_tree_insert( &tree, 10, 5 );
+    extent_tree_insert( &tree, 30, 5 );
+    extent_tree_insert( &tree, 20, 5 );
+    print_runs( "Three runs:", &tree );
+    extent_tree_insert( &tree, 15, 5 );
+    print_runs( "Insert [15+5]:", &tree );
+    extent_tree_insert( &tree, 25, 5 );
+    print_runs( "Insert [25+5]:", &tree );
+
+    printf("===================================\n");
+    printf("= Remove parts of runs            =\n");
+    printf("===================================\n");
+    printf("Remove [12+3]: %d\n", extent_tree_remove( &tree, 12, 3 ) );
+    print_runs( "After it:", &tree );
+    printf("Remove [10+2]: %d\n", extent_tree_remove( &tree, 10, 2 ) );
+    printf("Remove [30+5]: %d\n", extent_tree_remove( &tree, 30, 5 ) );
+    print_runs( "After them:", &tree );
+    printf("Remove [14+2]: %d\n", extent_tree_remove( &tree, 14, 2 ) );
+    printf("Remove [34+2]: %d\n", extent_tree_remove( &tree, 34, 2 ) );
+    print_runs( "Unchanged:", &tree );
+
+    printf("===================================\n");
+    printf("= First fit                       =\n");
+    printf("===================================\n");
+    extent_tree_insert( &tree, 50, 3 );
+    extent_tree_insert( &tree, 100, 40 );
+    print_runs( "Runs:", &tree );
+    printf("First fit of 3: %lld\n", (long long)extent_tree_first_fit( &tree, 3 ) );
+    printf("First fit of 20: %lld\n", (long long)extent_tree_first_fit( &tree, 20 ) );
+    printf("First fit of 30: %lld\n", (long long)extent_tree_first_fit( &tree, 30 ) );
+    print_runs( "Runs:", &tree );
+
+    printf("===================================\n");
+    printf("= Many runs                       =\n");
+    printf("===================================\n");
+    extent_tree_clear( &tree );
+    for( uint32_t b=1000; b<21000; b+=2 )
+        extent_tree_insert( &tree, b, 1 );
+    print_runs( "Every second block:", &tree );
+    printf("The tree is %s\n", depth( &tree, tree.root ) <= 60 ? "balanced" : "too deep" );
+    for( uint32_t b=1001; b<21000; b+=2 )
+        extent_tree_insert( &tree, b, 1 );
+    print_runs( "The blocks between:", &tree );
+    extent_tree_clear( &tree );
+
+    printf("===================================\n");
+    printf("= A fragmented disk               =\n");
+    printf("===================================\n");
+    int size;
+    set_block_allocation_table_name( bat_name );
+    format_disk_blocks( 40 );
+    for( int b=0; b<40; b++ )
+        allocate_block( 1 );
+    for( int b=1; b<40; b+=3 )
+        free_block( b );
+    free_block( 11 );
+    debug_disk( );
+    printf("The longest free run has %d blocks\n", get_largest_free_extent( ) );
+    printf("allocate_block(3) returned %d\n", allocate_block( 3 ) );
+    int block = allocate_largest_block( 3, &size );
+    printf("allocate_largest_block(3) returned %d with %d blocks\n", block, size );
+    block = allocate_largest_block( 3, &size );
+    printf("allocate_largest_block(3) returned %d with %d blocks\n", block, size );
+    free_block( 2 );
+    free_block( 3 );
+    printf("allocate_block(3) returned %d\n", allocate_block( 3 ) );
+    debug_disk( );
+}
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extent_tree.h"
+
+static inline uint32_t max_u32( uint32_t a, uint32_t b )
+{
+    return a > b ? a : b;
+}
+
+/* The treap priority of a node is a hash of its first block, which
+ * keeps the tree balanced in expectation without a random number
+ * generator.
+ */
+static uint32_t priority_of( uint32_t start )
+{
+    start ^= start >> 16;
+    start *= 0x7feb352dU;
+    start ^= start >> 15;
+    start *= 0x846ca68bU;
+    start ^= start >> 16;
+    return start;
+}
+
+static void update( struct extent_node* n, uint32_t i )
+{
+    n[i].max_length = max_u32( n[i].length,
+                               max_u32( n[n[i].left].max_length, n[n[i].right].max_length ) );
+}
+
+/* Split the subtree at i into the runs that start before key (l)
+ * and the runs that start at key or later (r).
+ */
+static void split( struct extent_node* n, uint32_t i, uint32_t key, uint32_t* l, uint32_t* r )
+{
+    if( i == 0 )
+    {
+        *l = *r = 0;
+        return;
+    }
+
+    if( n[i].start < key )
+    {
+        split( n, n[i].right, key, &n[i].right, r );
+        *l = i;
+    }
+    else
+    {
+        split( n, n[i].left, key, l, &n[i].left );
+        *r = i;
+    }
+    update( n, i );
+}
+
+/* Join two subtrees where every run in l starts before every run
+ * in r.
+ */
+static uint32_t merge( struct extent_node* n, uint32_t l, uint32_t r )
+{
+    if( l == 0 ) return r;
+    if( r == 0 ) return l;
+
+    if( n[l].priority > n[r].priority )
+    {
+        n[l].right = merge( n, n[l].right, r );
+        update( n, l );
+        return l;
+    }
+    n[r].left = merge( n, l, n[r].left );
+    update( n, r );
+    return r;
+}
+
+/* Make sure that count more nodes can be created without failing.
+ */
+static int reserve( struct extent_tree* tree, uint32_t count )
+{
+    if( tree->num_nodes + count <= tree->capacity )
+        return 0;
+
+    uint32_t capacity = tree->capacity ? tree->capacity : 64;
+    while( tree->num_nodes + count > capacity )
+        capacity *= 2;
+
+    struct extent_node* nodes = realloc( tree->nodes, capacity * sizeof(struct extent_node) );
+    if( nodes == NULL )
+    {
+        fprintf( stderr, "Failed to allocate %u nodes for the free extent index\n", capacity );
+        return -1;
+    }
+
+    if( tree->num_nodes == 0 )
+    {
+        /* Node 0 is the sentinel for empty subtrees. */
+        memset( &nodes[0], 0, sizeof(struct extent_node) );
+        tree->num_nodes = 1;
+    }
+    tree->nodes    = nodes;
+    tree->capacity = capacity;
+    return 0;
+}
+
+static void insert_node( struct extent_tree* tree, uint32_t start, uint32_t length )
+{
+    uint32_t i = tree->free_list;
+    if( i )
+        tree->free_list = tree->nodes[i].left;
+    else
+        i = tree->num_nodes++;
+
+    struct extent_node* n = tree->nodes;
+    n[i].start      = start;
+    n[i].length     = length;
+    n[i].max_length = length;
+    n[i].priority   = priority_of( start );
+    n[i].left       = 0;
+    n[i].right      = 0;
+
+    uint32_t l, r;
+    split( n, tree->root, start, &l, &r );
+    tree->root = merge( n, merge( n, l, i ), r );
+    tree->num_runs++;
+}
+
+static void erase_node( struct extent_tree* tree, uint32_t start )
+{
+    struct extent_node* n = tree->nodes;
+    uint32_t l, m, r;
+    split( n, tree->root, start, &l, &r );
+    split( n, r, start + 1, &m, &r );
+    if( m )
+    {
+        n[m].left       = tree->free_list;
+        tree->free_list = m;
+        tree->num_runs--;
+    }
+    tree->root = merge( n, l, r );
+}
+
+/* Return the node of the run with the largest start <= block, or 0.
+ */
+static uint32_t find_at_or_before( const struct extent_tree* tree, uint32_t block )
+{
+    const struct extent_node* n = tree->nodes;
+    uint32_t i    = tree->root;
+    uint32_t best = 0;
+    while( i )
+    {
+        if( n[i].start <= block )
+        {
+            best = i;
+            i    = n[i].right;
+        }
+        else
+        {
+            i = n[i].left;
+        }
+    }
+    return best;
+}
+
+void extent_tree_init( struct extent_tree* tree )
+{
+    memset( tree, 0, sizeof(struct extent_tree) );
+}
+
+void extent_tree_clear( struct extent_tree* tree )
+{
+    free( tree->nodes );
+    extent_tree_init( tree );
+}
+
+int extent_tree_insert( struct extent_tree* tree, uint32_t start, uint32_t length )
+{
+    if( length == 0 ) return 0;
+
+    if( reserve( tree, 1 ) == -1 )
+        return -1;
+
+    struct extent_node* n = tree->nodes;
+
+    /* Merge with the run that ends where this one begins. */
+    uint32_t prev = start > 0 ? find_at_or_before( tree, start - 1 ) : 0;
+    if( prev && n[prev].start + n[prev].length == start )
+    {
+        start   = n[prev].start;
+        length += n[prev].length;
+        erase_node( tree, start );
+    }
+
+    /* Merge with the run that begins where this one ends. */
+    uint32_t next = find_at_or_before( tree, start + length );
+    if( next && n[next].start == start + length )
+    {
+        length += n[next].length;
+        erase_node( tree, n[next].start );
+    }
+
+    insert_node( tree, start, length );
+    return 0;
+}
+
+int extent_tree_remove( struct extent_tree* tree, uint32_t start, uint32_t length )
+{
+    uint32_t i = find_at_or_before( tree, start );
+    if( i == 0 || (uint64_t)start + length > (uint64_t)tree->nodes[i].start + tree->nodes[i].length )
+        return -1;
+
+    /* Cutting a run in two needs one node more than it frees. */
+    if( reserve( tree, 1 ) == -1 )
+        return -1;
+
+    uint32_t run_start = tree->nodes[i].start;
+    uint32_t run_end   = run_start + tree->nodes[i].length;
+    uint32_t end       = start + length;
+
+    erase_node( tree, run_start );
+    if( start > run_start )
+        insert_node( tree, run_start, start - run_start );
+    if( end < run_end )
+        insert_node( tree, end, run_end - end );
+    return 0;
+}
+
+int64_t extent_tree_first_fit( struct extent_tree* tree, uint32_t length )
+{
+    const struct extent_node* n = tree->nodes;
+    uint32_t i = tree->root;
+    if( i == 0 || n[i].max_length < length )
+        return -1;
+
+    /* Go left whenever the left subtree has a run that is long
+     * enough, since its runs come first on the disk.
+     */
+    while( 1 )
+    {
+        if( n[n[i].left].max_length >= length )
+            i = n[i].left;
+        else if( n[i].length >= length )
+            break;
+        else
+            i = n[i].right;
+    }
+
+    uint32_t start = n[i].start;
+    if( extent_tree_remove( tree, start, length ) == -1 )
+        return -1;
+    return start;
+}
+
+uint32_t extent_tree_longest( const struct extent_tree* tree )
+{
+    if( tree->root == 0 ) return 0;
+    return tree->nodes[tree->root].max_length;
+}
@@ -0,0 +1,73 @@
+#ifndef EXTENT_TREE_H
+#define EXTENT_TREE_H
+
+#include <stdint.h>
+
+/* An index of the free runs of blocks on the simulated disk.
+ *
+ * The runs are kept in a balanced search tree (a treap) ordered
+ * by their first block. Every node also knows the longest run in
+ * its subtree, so the lowest run that can hold a given number of
+ * blocks is found in O(log n), for any number of blocks.
+ *
+ * The runs in the tree never overlap and never touch: a run that
+ * is added next to another one is merged with it.
+ *
+ * The nodes live in one array that grows by doubling, and refer
+ * to each other by index. Index 0 is an empty sentinel node.
+ */
+struct extent_node
+{
+    uint32_t start;
+    uint32_t length;
+    uint32_t max_length; /* longest run in this subtree */
+    uint32_t priority;
+    uint32_t left;
+    uint32_t right;
+};
+
+struct extent_tree
+{
+    struct extent_node* nodes;
+    uint32_t            capacity;
+    uint32_t            num_nodes; /* slots used, including free ones */
+    uint32_t            free_list;
+    uint32_t            root;
+    uint32_t            num_runs;
+};
+
+/* Prepare an empty tree. No memory is allocated until the first
+ * run is added.
+ */
+void extent_tree_init( struct extent_tree* tree );
+
+/* Release the memory of the tree. It is empty afterwards and can
+ * be used again.
+ */
+void extent_tree_clear( struct extent_tree* tree );
+
+/* Add the free run [start, start+length) to the tree and merge it
+ * with the runs that end at start or begin at start+length.
+ * The run must not overlap a run that is already in the tree.
+ * Returns 0 on success and -1 if memory could not be allocated.
+ */
+int extent_tree_insert( struct extent_tree* tree, uint32_t start, uint32_t length );
+
+/* Remove [start, start+length) from the tree. The range must lie
+ * inside a single run, which is cut into the parts before and
+ * after the range.
+ * Returns 0 on success and -1 if the range is not free.
+ */
+int extent_tree_remove( struct extent_tree* tree, uint32_t start, uint32_t length );
+
+/* Find the run with the lowest start that has at least length
+ * blocks, and remove length blocks from its beginning.
+ * Returns the first of these blocks, or -1 if no run is long
+ * enough.
+ */
+int64_t extent_tree_first_fit( struct extent_tree* tree, uint32_t length );
+
+/* Return the length of the longest free run in the tree. */
+uint32_t extent_tree_longest( const struct extent_tree* tree );
+
+#endif // EXTENT_TREE_H
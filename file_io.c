@@ -0,0 +1,427 @@
+#include "inode.h"
+#include "block_allocation.h"
+#include "block_image.h"
+#include "block_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+void debug(const char* function_name, const char* message, const char* optional_string);
+void log_file_change(struct inode* node);
+
+// The most blocks that an open file reads ahead, see set_readahead_window
+static uint32_t readahead_max = READAHEAD_MAX_BLOCKS;
+
+// Counts calls to fs_write, so that open files notice that what they read ahead may be old
+static atomic_uint_fast64_t write_generation = 0;
+
+// What fs_read_view shows for the holes of sparse files
+static const char zeros[16 * BLOCKSIZE];
+
+enum transfer_mode
+{
+    TRANSFER_READ,   // from the block cache
+    TRANSFER_WRITE,  // to the block cache
+    TRANSFER_DIRECT  // from the image, past the block cache
+};
+
+/*
+An open file, see fs_open. The buffer holds the bytes of the file from buffer_start to buffer_end, which
+were read ahead of the reader.
+*/
+struct fs_file
+{
+    struct inode* node;
+    uint64_t next;          // where a sequential read continues
+    uint32_t window;        // blocks to read ahead, 0 while the reads are random
+    char*    buffer;
+    size_t   capacity;      // of buffer in bytes
+    uint64_t buffer_start;
+    uint64_t buffer_end;
+    uint64_t generation;    // of write_generation when the buffer was filled
+};
+
+/*
+Finds the extent of a file that holds a byte offset.
+
+@param node the file
+@param offset byte offset in the file
+@param first receives the byte offset in the file where the extent starts, or where the hole after the
+last extent starts
+@return the position of the extent in node->entries, or node->num_entries if no extent holds offset
+*/
+static uint32_t find_extent(const struct inode* node, uint64_t offset, uint64_t* first)
+{
+    const struct Extent* extents = (const struct Extent*) node->entries;
+    uint64_t start = 0;
+    uint32_t i;
+    for (i = 0; i < node->num_entries; i++){
+        uint64_t size = (uint64_t) extents[i].extent * BLOCKSIZE;
+        if (offset < start + size)
+            break;
+        start += size;
+    }
+    *first = start;
+    return i;
+}
+
+/*
+Measures the run of blocks on the disk that starts with extent i: extents that follow each other in the file
+and also on the disk are one run, and can be read or written with one call. A hole is a run of its own.
+
+@param node the file
+@param i position of the first extent of the run
+@param end receives the position of the first extent after the run
+@return the number of bytes in the run
+*/
+static uint64_t run_size(const struct inode* node, uint32_t i, uint32_t* end)
+{
+    const struct Extent* extents = (const struct Extent*) node->entries;
+    uint64_t blocks = extents[i].extent;
+    uint32_t j = i + 1;
+    while (j < node->num_entries && extents[i].blockno != EXTENT_HOLE && extents[j].blockno != EXTENT_HOLE
+           && extents[j].blockno == extents[i].blockno + blocks){
+        blocks += extents[j].extent;
+        j++;
+    }
+    *end = j;
+    return blocks * BLOCKSIZE;
+}
+
+/*
+Checks the arguments of fs_read, fs_write and fs_read_view, and limits len to the end of the file. A file
+that delayed allocation left without blocks gets them first.
+
+@return the number of bytes that can be transferred, or -1 if node is not a file or has no blocks
+*/
+static ssize_t clip_to_file(struct inode* node, uint64_t offset, size_t len, const char* function_name)
+{
+    if (!node || node->is_directory){
+        debug(function_name, "not a file", node ? node->name : "");
+        return -1;
+    }
+    if (place_file_blocks(node) == -1){
+        debug(function_name, "failed to place the blocks of", node->name);
+        return -1;
+    }
+    if (offset >= node->filesize)
+        return 0;
+    if (len > node->filesize - offset)
+        len = node->filesize - offset;
+    return len;
+}
+
+/*
+Returns 1 if any of len bytes of the file from offset lie in a hole.
+*/
+static int in_hole(const struct inode* node, uint64_t offset, size_t len)
+{
+    uint64_t first;
+    uint32_t i = find_extent(node, offset, &first);
+    const struct Extent* extents = (const struct Extent*) node->entries;
+    for (; i < node->num_entries && first < offset + len; i++){
+        if (extents[i].blockno == EXTENT_HOLE)
+            return 1;
+        first += (uint64_t) extents[i].extent * BLOCKSIZE;
+    }
+    return first < offset + len;
+}
+
+/*
+Copies len bytes between buf and the file, starting at byte offset of the file, one run of blocks that are
+contiguous on the disk at a time. Holes read as zeros; writes stop at a hole, which fs_write fills first. Reads and writes go through the block cache, which reads the blocks it is
+missing from a run together. Direct reads are one pread per run, after the cached blocks of the run that are
+dirty were written to the image. The bytes of an inline file are copied in memory.
+
+@return the number of bytes transferred, or -1 if the first transfer failed
+*/
+static ssize_t transfer(const struct inode* node, uint64_t offset, char* buf, size_t len, enum transfer_mode mode)
+{
+    if (node->is_inline){
+        char* bytes = (char*) node->entries + offset;
+        if (mode == TRANSFER_WRITE)
+            memcpy(bytes, buf, len);
+        else
+            memcpy(buf, bytes, len);
+        return len;
+    }
+
+    uint64_t first;
+    uint32_t i = find_extent(node, offset, &first);
+    const struct Extent* extents = (const struct Extent*) node->entries;
+
+    size_t done = 0;
+    while (done < len){
+        uint32_t end = node->num_entries;
+        uint64_t skip = offset + done - first;
+        uint64_t size = i < node->num_entries ? run_size(node, i, &end) : skip + len - done;
+        size_t count = size - skip < len - done ? size - skip : len - done;
+
+        if (i == node->num_entries || extents[i].blockno == EXTENT_HOLE){
+            if (mode == TRANSFER_WRITE)
+                break;
+            memset(buf + done, 0, count);
+            done += count;
+            first += size;
+            i = end;
+            continue;
+        }
+
+        uint64_t image_offset = (uint64_t) extents[i].blockno * BLOCKSIZE + skip;
+        ssize_t n;
+        if (mode == TRANSFER_WRITE){
+            n = block_cache_write(buf + done, count, image_offset);
+        } else if (mode == TRANSFER_READ){
+            n = block_cache_read(buf + done, count, image_offset);
+        } else {
+            uint32_t first_block = image_offset / BLOCKSIZE;
+            uint32_t last_block = (image_offset + count - 1) / BLOCKSIZE;
+            n = block_cache_flush_blocks(first_block, last_block - first_block + 1) == -1
+                ? -1 : block_image_read(buf + done, count, image_offset);
+        }
+        if (n == -1){
+            debug(__func__, mode == TRANSFER_WRITE ? "failed to write blocks of" : "failed to read blocks of",
+                  node->name);
+            return done > 0 ? (ssize_t) done : -1;
+        }
+        done += n;
+        if ((size_t) n < count)
+            break;
+        first += size;
+        i = end;
+    }
+    return done;
+}
+
+/*
+Asks the kernel to read len bytes of the file from offset in the background, one request per run of blocks.
+*/
+static void prefetch(const struct inode* node, uint64_t offset, uint64_t len)
+{
+    if (offset >= node->filesize)
+        return;
+    if (len > node->filesize - offset)
+        len = node->filesize - offset;
+
+    uint64_t first;
+    uint32_t i = find_extent(node, offset, &first);
+    const struct Extent* extents = (const struct Extent*) node->entries;
+    uint64_t done = 0;
+    while (done < len && i < node->num_entries){
+        uint32_t end;
+        uint64_t size = run_size(node, i, &end);
+        uint64_t skip = offset + done - first;
+        uint64_t count = size - skip < len - done ? size - skip : len - done;
+        if (extents[i].blockno != EXTENT_HOLE)
+            block_image_prefetch((uint64_t) extents[i].blockno * BLOCKSIZE + skip, count);
+        done += count;
+        first += size;
+        i = end;
+    }
+}
+
+ssize_t fs_read(struct inode* node, uint64_t offset, void* buf, size_t len)
+{
+    ssize_t count = clip_to_file(node, offset, len, __func__);
+    if (count <= 0)
+        return count;
+    return transfer(node, offset, buf, count, TRANSFER_READ);
+}
+
+ssize_t fs_write(struct inode* node, uint64_t offset, const void* buf, size_t len)
+{
+    if (node && node->is_readonly){
+        debug(__func__, "file is read-only", node->name);
+        return -1;
+    }
+    ssize_t count = clip_to_file(node, offset, len, __func__);
+    if (count <= 0)
+        return count;
+    atomic_fetch_add(&write_generation, 1);
+
+    // Holes get their blocks before they are written
+    if (!node->is_inline && in_hole(node, offset, count) && fs_fallocate(node, offset, count) == -1){
+        debug(__func__, "failed to allocate blocks for a hole of", node->name);
+        return -1;
+    }
+
+    // The bytes of an inline file are in its record, so its directory must stay loaded until saved,
+    // and the journal gets them all again
+    if (!node->is_inline)
+        return transfer(node, offset, (char*) buf, count, TRANSFER_WRITE);
+    if (!node->dirty)
+        node->dirty = 1;
+    ssize_t n = transfer(node, offset, (char*) buf, count, TRANSFER_WRITE);
+    if (n > 0)
+        log_file_change(node);
+    return n;
+}
+
+ssize_t fs_read_view(struct inode* node, uint64_t offset, size_t len, const void** data)
+{
+    ssize_t count = clip_to_file(node, offset, len, __func__);
+    if (count <= 0)
+        return count;
+
+    if (node->is_inline){
+        *data = (const char*) node->entries + offset;
+        return count;
+    }
+
+    uint64_t first;
+    uint32_t i = find_extent(node, offset, &first);
+    const struct Extent* extents = (const struct Extent*) node->entries;
+    if (i == node->num_entries || extents[i].blockno == EXTENT_HOLE){
+        // A hole is shown as zeros, up to its end
+        uint64_t size = i < node->num_entries ? (uint64_t) extents[i].extent * BLOCKSIZE - (offset - first) : (uint64_t) count;
+        if ((uint64_t) count > size)
+            count = size;
+        if ((size_t) count > sizeof(zeros))
+            count = sizeof(zeros);
+        *data = zeros;
+        return count;
+    }
+    uint32_t end;
+    uint64_t size = run_size(node, i, &end) - (offset - first);
+    if ((uint64_t) count > size)
+        count = size;
+
+    // The mapping only shows what was written to the image
+    uint64_t image_offset = (uint64_t) extents[i].blockno * BLOCKSIZE + (offset - first);
+    uint32_t first_block = image_offset / BLOCKSIZE;
+    uint32_t last_block = (image_offset + count - 1) / BLOCKSIZE;
+    if (block_cache_flush_blocks(first_block, last_block - first_block + 1) == -1){
+        debug(__func__, "failed to write cached blocks of", node->name);
+        return -1;
+    }
+    const char* view = block_image_view(image_offset, count);
+    if (!view){
+        debug(__func__, "failed to map blocks of", node->name);
+        return -1;
+    }
+    *data = view;
+    return count;
+}
+
+int fs_sync(void)
+{
+    return block_cache_flush();
+}
+
+void set_readahead_window(uint32_t max_blocks)
+{
+    readahead_max = max_blocks;
+}
+
+struct fs_file* fs_open(struct inode* node)
+{
+    if (!node || node->is_directory){
+        debug(__func__, "not a file", node ? node->name : "");
+        return NULL;
+    }
+    if (place_file_blocks(node) == -1){
+        debug(__func__, "failed to place the blocks of", node->name);
+        return NULL;
+    }
+    struct fs_file* file = calloc(1, sizeof(struct fs_file));
+    if (!file){
+        debug(__func__, "failed to allocate memory for open file", node->name);
+        return NULL;
+    }
+    file->node = node;
+    return file;
+}
+
+void fs_close(struct fs_file* file)
+{
+    if (!file)
+        return;
+    free(file->buffer);
+    free(file);
+}
+
+/*
+Reads the next window of the file, from offset on, into the buffer of the file. The window grows with every
+sequential read, and the kernel is asked to fetch the window after it in the background.
+
+@return 0 on success, -1 if nothing could be read
+*/
+static int read_ahead(struct fs_file* file, uint64_t offset)
+{
+    const struct inode* node = file->node;
+    file->window = file->window == 0 ? READAHEAD_MIN_BLOCKS : file->window * 2;
+    if (file->window > readahead_max)
+        file->window = readahead_max;
+
+    size_t size = (size_t) file->window * BLOCKSIZE;
+    if (file->capacity < size){
+        char* grown = realloc(file->buffer, size);
+        if (!grown){
+            debug(__func__, "failed to allocate readahead buffer for", node->name);
+            return -1;
+        }
+        file->buffer = grown;
+        file->capacity = size;
+    }
+
+    // Whole blocks, so that the next window starts on a block again
+    uint64_t start = offset - offset % BLOCKSIZE;
+    uint64_t len = node->filesize - start < size ? node->filesize - start : size;
+    file->generation = atomic_load(&write_generation);
+    ssize_t n = transfer(node, start, file->buffer, len, TRANSFER_DIRECT);
+    if (n <= 0 || start + n <= offset){
+        file->buffer_start = file->buffer_end = 0;
+        return -1;
+    }
+    file->buffer_start = start;
+    file->buffer_end = start + n;
+    prefetch(node, file->buffer_end, size);
+    return 0;
+}
+
+ssize_t fs_file_read(struct fs_file* file, uint64_t offset, void* buf, size_t len)
+{
+    if (!file)
+        return -1;
+    struct inode* node = file->node;
+    ssize_t count = clip_to_file(node, offset, len, __func__);
+    if (count <= 0)
+        return count;
+
+    if (file->generation != atomic_load(&write_generation))
+        file->buffer_start = file->buffer_end = 0;
+
+    // A read that does not continue the last one ends the readahead, and goes through the block cache
+    int sequential = offset == file->next || (offset >= file->buffer_start && offset < file->buffer_end);
+    file->next = offset + count;
+    if (!sequential || readahead_max == 0 || node->is_inline){
+        file->window = 0;
+        return transfer(node, offset, buf, count, TRANSFER_READ);
+    }
+
+    char* out = buf;
+    size_t done = 0;
+    while (done < (size_t) count){
+        uint64_t pos = offset + done;
+        if (pos >= file->buffer_start && pos < file->buffer_end){
+            size_t n = file->buffer_end - pos < count - done ? file->buffer_end - pos : count - done;
+            memcpy(out + done, file->buffer + (pos - file->buffer_start), n);
+            done += n;
+        } else if (count - done >= (size_t) readahead_max * BLOCKSIZE){
+            // Too large to copy through the buffer: read it in place, and fetch what follows
+            ssize_t n = transfer(node, pos, out + done, count - done, TRANSFER_DIRECT);
+            if (n <= 0)
+                break;
+            done += n;
+            file->window = readahead_max;
+            prefetch(node, pos + n, (uint64_t) readahead_max * BLOCKSIZE);
+        } else if (read_ahead(file, pos) == -1){
+            break;
+        }
+    }
+    if (done == 0)
+        return -1;
+    file->next = offset + done;
+    return done;
+}
@@ -0,0 +1,419 @@
+#include "fs_pool.h"
+#include "inode.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Blocks are 16 << class bytes; the smallest one holds the free list link
+#define MIN_BLOCK_SHIFT 4
+#define NUM_CLASSES     40
+
+// Chunk sizes start small for small trees and double up to a limit
+#define FIRST_INODE_CHUNK 64
+#define MAX_INODE_CHUNK   65536
+#define FIRST_BYTE_CHUNK  4096
+#define MAX_BYTE_CHUNK    (16 * 1024 * 1024)
+
+struct fs_chunk
+{
+    struct fs_chunk* next;
+    // Keep the data after the header aligned to 16 bytes
+    uint64_t         padding;
+};
+
+// Memory handed to the pool with fs_pool_attach
+struct fs_region
+{
+    struct fs_region* next;
+    char*             base;
+    size_t            size;
+    int               mapped;
+};
+
+struct fs_pool
+{
+    struct inode*    root;
+    struct fs_chunk* chunks;         // all chunks of both kinds
+
+    struct inode*    free_inodes;
+    struct inode*    next_inode;     // bump pointer in the current inode chunk
+    size_t           inodes_left;
+    size_t           inode_chunk;    // number of inodes in the next chunk
+
+    void*            free_blocks[NUM_CLASSES];
+    char*            next_byte;      // bump pointer in the current byte chunk
+    size_t           bytes_left;
+    size_t           byte_chunk;     // size of the next byte chunk
+
+    void*            table;          // how inodes are found in the regions, see inode.c
+    struct fs_region* regions;       // master file tables the tree was loaded from
+
+    int              shared;         // set by fs_pool_share, then lock guards everything above
+    pthread_mutex_t  lock;
+    pthread_rwlock_t tree_lock;      // see fs_pool_lock
+};
+
+/*
+Returns 1 if ptr points into the attached region. Such memory is not managed by the size classes.
+*/
+static int in_region(const struct fs_pool* pool, const void* ptr)
+{
+    const char* p = ptr;
+    for (const struct fs_region* r = pool->regions; r; r = r->next){
+        if (p >= r->base && p < r->base + r->size){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+Allocates a chunk of size bytes and links it into the pool.
+
+@return the first byte after the chunk header, or NULL
+*/
+static void* new_chunk(struct fs_pool* pool, size_t size)
+{
+    struct fs_chunk* chunk = malloc(sizeof(struct fs_chunk) + size);
+    if (!chunk){
+        return NULL;
+    }
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    return chunk + 1;
+}
+
+/*
+Returns the size class of a block of size bytes.
+*/
+static int class_of(size_t size)
+{
+    int c = 0;
+    while (((size_t) 1 << (c + MIN_BLOCK_SHIFT)) < size){
+        c++;
+    }
+    return c;
+}
+
+struct fs_pool* fs_pool_create(void)
+{
+    struct fs_pool* pool = calloc(1, sizeof(struct fs_pool));
+    if (!pool){
+        return NULL;
+    }
+    pool->inode_chunk = FIRST_INODE_CHUNK;
+    pool->byte_chunk = FIRST_BYTE_CHUNK;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_rwlock_init(&pool->tree_lock, NULL);
+    return pool;
+}
+
+/*
+Takes the lock of a shared pool. Pools that belong to one thread are not locked.
+*/
+static void lock(struct fs_pool* pool)
+{
+    if (pool->shared){
+        pthread_mutex_lock(&pool->lock);
+    }
+}
+
+static void unlock(struct fs_pool* pool)
+{
+    if (pool->shared){
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void fs_pool_destroy(struct fs_pool* pool)
+{
+    if (!pool){
+        return;
+    }
+    struct fs_chunk* chunk = pool->chunks;
+    while (chunk){
+        struct fs_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    struct fs_region* region = pool->regions;
+    while (region){
+        struct fs_region* next = region->next;
+        if (region->mapped){
+            munmap(region->base, region->size);
+        }else{
+            free(region->base);
+        }
+        free(region);
+        region = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_rwlock_destroy(&pool->tree_lock);
+    free(pool);
+}
+
+int fs_pool_attach(struct fs_pool* pool, void* base, size_t size, int mapped)
+{
+    struct fs_region* region = malloc(sizeof(struct fs_region));
+    if (!region){
+        return -1;
+    }
+    region->base = base;
+    region->size = size;
+    region->mapped = mapped;
+    lock(pool);
+    region->next = pool->regions;
+    pool->regions = region;
+    unlock(pool);
+    return 0;
+}
+
+void fs_pool_detach(struct fs_pool* pool, void* base)
+{
+    lock(pool);
+    struct fs_region** link = &pool->regions;
+    while (*link && (*link)->base != base){
+        link = &(*link)->next;
+    }
+    struct fs_region* region = *link;
+    if (region){
+        *link = region->next;
+    }
+    unlock(pool);
+    if (!region){
+        return;
+    }
+    if (region->mapped){
+        munmap(region->base, region->size);
+    }else{
+        free(region->base);
+    }
+    free(region);
+}
+
+void fs_pool_merge(struct fs_pool* pool, struct fs_pool* other)
+{
+    if (!other){
+        return;
+    }
+    lock(pool);
+    // The free lists and the rest of the current chunks of other are dropped, they are small
+    if (other->chunks){
+        struct fs_chunk* last = other->chunks;
+        while (last->next){
+            last = last->next;
+        }
+        last->next = pool->chunks;
+        pool->chunks = other->chunks;
+    }
+    if (other->regions){
+        struct fs_region* last = other->regions;
+        while (last->next){
+            last = last->next;
+        }
+        last->next = pool->regions;
+        pool->regions = other->regions;
+    }
+    unlock(pool);
+    pthread_mutex_destroy(&other->lock);
+    pthread_rwlock_destroy(&other->tree_lock);
+    free(other);
+}
+
+void fs_pool_share(struct fs_pool* pool)
+{
+    pool->shared = 1;
+}
+
+void fs_pool_lock(struct fs_pool* pool, int exclusive)
+{
+    if (exclusive){
+        pthread_rwlock_wrlock(&pool->tree_lock);
+    }else{
+        pthread_rwlock_rdlock(&pool->tree_lock);
+    }
+}
+
+void fs_pool_unlock(struct fs_pool* pool)
+{
+    pthread_rwlock_unlock(&pool->tree_lock);
+}
+
+void fs_pool_set_root(struct fs_pool* pool, struct inode* root)
+{
+    pool->root = root;
+}
+
+struct inode* fs_pool_root(const struct fs_pool* pool)
+{
+    return pool->root;
+}
+
+void fs_pool_set_table(struct fs_pool* pool, void* table)
+{
+    pool->table = table;
+}
+
+void* fs_pool_table(const struct fs_pool* pool)
+{
+    return pool->table;
+}
+
+static struct inode* take_inode(struct fs_pool* pool)
+{
+    if (pool->free_inodes){
+        struct inode* node = pool->free_inodes;
+        memcpy(&pool->free_inodes, node, sizeof(struct inode*));
+        return node;
+    }
+
+    if (pool->inodes_left == 0){
+        struct inode* nodes = new_chunk(pool, pool->inode_chunk * sizeof(struct inode));
+        if (!nodes){
+            return NULL;
+        }
+        pool->next_inode = nodes;
+        pool->inodes_left = pool->inode_chunk;
+        if (pool->inode_chunk < MAX_INODE_CHUNK){
+            pool->inode_chunk *= 2;
+        }
+    }
+    pool->inodes_left--;
+    return pool->next_inode++;
+}
+
+struct inode* fs_pool_inode(struct fs_pool* pool)
+{
+    lock(pool);
+    struct inode* node = take_inode(pool);
+    unlock(pool);
+    return node;
+}
+
+void fs_pool_release_inode(struct fs_pool* pool, struct inode* node)
+{
+    // The first bytes of a free inode link to the next free one
+    lock(pool);
+    memcpy(node, &pool->free_inodes, sizeof(struct inode*));
+    pool->free_inodes = node;
+    unlock(pool);
+}
+
+/*
+The bodies of fs_pool_alloc, fs_pool_realloc and fs_pool_free, called with the lock held.
+*/
+static void* alloc_block(struct fs_pool* pool, size_t size)
+{
+    if (size == 0){
+        return NULL;
+    }
+    int c = class_of(size);
+    if (c >= NUM_CLASSES){
+        return NULL;
+    }
+
+    if (pool->free_blocks[c]){
+        void* block = pool->free_blocks[c];
+        memcpy(&pool->free_blocks[c], block, sizeof(void*));
+        return block;
+    }
+
+    size_t block_size = (size_t) 1 << (c + MIN_BLOCK_SHIFT);
+    if (pool->bytes_left < block_size){
+        // The rest of the current chunk is left unused
+        size_t chunk_size = pool->byte_chunk;
+        while (chunk_size < block_size){
+            chunk_size *= 2;
+        }
+        char* bytes = new_chunk(pool, chunk_size);
+        if (!bytes){
+            return NULL;
+        }
+        pool->next_byte = bytes;
+        pool->bytes_left = chunk_size;
+        if (pool->byte_chunk < MAX_BYTE_CHUNK){
+            pool->byte_chunk *= 2;
+        }
+    }
+    void* block = pool->next_byte;
+    pool->next_byte += block_size;
+    pool->bytes_left -= block_size;
+    return block;
+}
+
+static void free_block(struct fs_pool* pool, void* ptr, size_t size)
+{
+    if (!ptr || size == 0 || in_region(pool, ptr)){
+        return;
+    }
+    int c = class_of(size);
+    memcpy(ptr, &pool->free_blocks[c], sizeof(void*));
+    pool->free_blocks[c] = ptr;
+}
+
+static void* realloc_block(struct fs_pool* pool, void* ptr, size_t old_size, size_t new_size)
+{
+    if (!ptr){
+        return alloc_block(pool, new_size);
+    }
+    if (new_size == 0){
+        free_block(pool, ptr, old_size);
+        return NULL;
+    }
+    if (in_region(pool, ptr)){
+        // Loaded arrays cannot grow in place, so the first resize moves them into the pool
+        void* block = alloc_block(pool, new_size);
+        if (block){
+            memcpy(block, ptr, old_size < new_size ? old_size : new_size);
+        }
+        return block ? block : (new_size < old_size ? ptr : NULL);
+    }
+    if (class_of(old_size) == class_of(new_size)){
+        return ptr;
+    }
+
+    void* block = alloc_block(pool, new_size);
+    if (!block){
+        // A block that shrinks may as well stay where it is
+        return new_size < old_size ? ptr : NULL;
+    }
+    memcpy(block, ptr, old_size < new_size ? old_size : new_size);
+    free_block(pool, ptr, old_size);
+    return block;
+}
+
+void* fs_pool_alloc(struct fs_pool* pool, size_t size)
+{
+    lock(pool);
+    void* block = alloc_block(pool, size);
+    unlock(pool);
+    return block;
+}
+
+void* fs_pool_realloc(struct fs_pool* pool, void* ptr, size_t old_size, size_t new_size)
+{
+    lock(pool);
+    void* block = realloc_block(pool, ptr, old_size, new_size);
+    unlock(pool);
+    return block;
+}
+
+void fs_pool_free(struct fs_pool* pool, void* ptr, size_t size)
+{
+    lock(pool);
+    free_block(pool, ptr, size);
+    unlock(pool);
+}
+
+char* fs_pool_strdup(struct fs_pool* pool, const char* str)
+{
+    size_t size = strlen(str) + 1;
+    char* copy = fs_pool_alloc(pool, size);
+    if (copy){
+        memcpy(copy, str, size);
+    }
+    return copy;
+}
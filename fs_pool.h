@@ -0,0 +1,121 @@
+#ifndef FS_POOL_H
+#define FS_POOL_H
+
+#include <stddef.h>
+
+struct inode;
+
+/* The memory of one file system tree.
+ *
+ * Every tree of inodes (one per create_dir(NULL, ...) or
+ * load_inodes) owns a pool, and all memory of the tree comes from
+ * it:
+ *  - the inodes themselves, from a slab of large chunks, so that
+ *    nodes that are created together sit next to each other
+ *  - names, entry arrays and directory indexes, from an arena of
+ *    large chunks, in power of two size classes
+ *
+ * Freed inodes and blocks go to a free list of their size and are
+ * used again. The chunks grow by doubling, so loading a tree makes
+ * only a handful of allocations, and fs_pool_destroy releases the
+ * whole tree without visiting the inodes.
+ *
+ * A pool can also own the bytes of the master file tables the tree
+ * was loaded from. Names and entry arrays may point into them;
+ * freeing such memory does nothing, and resizing it copies it into
+ * the pool.
+ */
+struct fs_pool;
+
+/* Create an empty pool. Returns NULL if memory could not be
+ * allocated.
+ */
+struct fs_pool* fs_pool_create( void );
+
+/* Release all memory of the pool, and with it every inode, name
+ * and entry array that came from it. NULL is allowed.
+ */
+void fs_pool_destroy( struct fs_pool* pool );
+
+/* Hand the size bytes at base to the pool. If mapped is 1 they
+ * are an mmap of a file and are unmapped with the pool, otherwise
+ * they come from malloc and are freed with the pool. A pool can
+ * own any number of such regions.
+ * Returns 0 on success and -1 if memory could not be allocated,
+ * in which case the caller still owns the bytes.
+ */
+int fs_pool_attach( struct fs_pool* pool, void* base, size_t size, int mapped );
+
+/* Unmap or free the region at base that was handed to the pool
+ * with fs_pool_attach, before the pool is destroyed. Nothing may
+ * point into it any more. Unknown bases are ignored.
+ */
+void fs_pool_detach( struct fs_pool* pool, void* base );
+
+/* Move all memory of other into pool and release other. Inodes
+ * and blocks that came from other belong to pool from then on.
+ * This lets threads fill pools of their own, without locking,
+ * and hand the result to one tree. NULL is allowed for other.
+ */
+void fs_pool_merge( struct fs_pool* pool, struct fs_pool* other );
+
+/* Let several threads use the pool at the same time. From then
+ * on every function below that allocates or frees takes a lock.
+ * Pools are not shared by default, since a tree that only one
+ * thread uses should not pay for the lock.
+ */
+void fs_pool_share( struct fs_pool* pool );
+
+/* Take the reader-writer lock of the tree that owns the pool, for
+ * reading or with exclusive 1 for writing. The pool itself does
+ * not use this lock; see set_thread_safe in inode.h for what it
+ * guards.
+ */
+void fs_pool_lock( struct fs_pool* pool, int exclusive );
+
+/* Release the lock taken with fs_pool_lock. */
+void fs_pool_unlock( struct fs_pool* pool );
+
+/* Remember how the inodes of a lazily loaded tree are found in
+ * the attached regions. The pool does not look at table; it should
+ * come from fs_pool_alloc so that it is released with the pool.
+ */
+void fs_pool_set_table( struct fs_pool* pool, void* table );
+
+/* Return what fs_pool_set_table remembered, or NULL. */
+void* fs_pool_table( const struct fs_pool* pool );
+
+/* Remember the root inode of the tree that owns the pool. */
+void fs_pool_set_root( struct fs_pool* pool, struct inode* root );
+
+/* Return the root inode of the tree that owns the pool. */
+struct inode* fs_pool_root( const struct fs_pool* pool );
+
+/* Return an uninitialized inode, or NULL if memory could not be
+ * allocated.
+ */
+struct inode* fs_pool_inode( struct fs_pool* pool );
+
+/* Give an inode back to the pool. */
+void fs_pool_release_inode( struct fs_pool* pool, struct inode* node );
+
+/* Return size bytes, aligned for any entry type, or NULL if size
+ * is 0 or memory could not be allocated.
+ */
+void* fs_pool_alloc( struct fs_pool* pool, size_t size );
+
+/* Resize a block from fs_pool_alloc that currently has old_size
+ * bytes, like realloc. A block only moves when its size class
+ * changes, and a block that shrinks stays where it is if memory
+ * is short. With new_size 0 the block is released and NULL is
+ * returned. On failure NULL is returned and the block is unchanged.
+ */
+void* fs_pool_realloc( struct fs_pool* pool, void* ptr, size_t old_size, size_t new_size );
+
+/* Give a block of size bytes back to the pool. NULL is allowed. */
+void fs_pool_free( struct fs_pool* pool, void* ptr, size_t size );
+
+/* Copy the string str into the pool. */
+char* fs_pool_strdup( struct fs_pool* pool, const char* str );
+
+#endif
@@ -0,0 +1,128 @@
+#include "inode.h"
+#include "block_allocation.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define THRESHOLD 1000
+
+/* Print the bytes of a file below root, up to the first zero. */
+static void print_contents( struct inode* root, const char* path )
+{
+    char buf[THRESHOLD + 1];
+    struct inode* file = lookup_path( root, path );
+    if( !file )
+    {
+        printf("%s is missing\n", path );
+        return;
+    }
+    ssize_t n = fs_read( file, 0, buf, THRESHOLD );
+    buf[n < 0 ? 0 : n] = 0;
+    printf("%s (%s, %zd bytes): '%s'\n", path, file->is_inline ? "inline" : "blocks", n, buf );
+}
+
+/* Create a filesystem with inline files and save it, then write to
+ * the inline files with the journal on. The process then stops
+ * without saving the tree, as if it had crashed.
+ */
+static void write_and_crash( char* mft_name, char* bat_name )
+{
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+    set_inline_threshold( THRESHOLD );
+    set_journaling( 1 );
+
+    printf("===================================\n");
+    printf("= Create and save small files     =\n");
+    printf("===================================\n");
+    struct inode* root     = create_dir( NULL, "/" );
+    create_file( root, "kernel", 1, 20000 );
+    struct inode* dir_etc  = create_dir( root, "etc" );
+    struct inode* f_motd   = create_file( dir_etc, "motd", 0, 12 );
+    struct inode* f_hostnm = create_file( dir_etc, "hostname", 0, 8 );
+    fs_write( f_motd, 0, "hello", 5 );
+    save_inodes( mft_name, root );
+    debug_fs( root );
+    print_contents( root, "/etc/motd" );
+
+    printf("===================================\n");
+    printf("= Write to them without saving    =\n");
+    printf("===================================\n");
+    fs_write( f_motd, 5, " world", 6 );
+    fs_write( f_hostnm, 0, "mini-fs", 7 );
+    struct inode* f_issue = create_file( dir_etc, "issue", 0, 10 );
+    fs_write( f_issue, 0, "welcome", 7 );
+    print_contents( root, "/etc/motd" );
+    print_contents( root, "/etc/hostname" );
+    print_contents( root, "/etc/issue" );
+
+    printf("===================================\n");
+    printf("= Crash                           =\n");
+    printf("===================================\n");
+    fflush( stdout );
+    _exit( 0 );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 3 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char  v1_name[1024];
+
+    fflush( stdout );
+    pid_t pid = fork( );
+    if( pid == 0 )
+        write_and_crash( mft_name, bat_name );
+    if( pid == -1 || waitpid( pid, NULL, 0 ) != pid )
+    {
+        fprintf( stderr, "Failed to run the crashing process\n" );
+        exit( -1 );
+    }
+
+    printf("===================================\n");
+    printf("= Load the table and replay the   =\n");
+    printf("= journal                         =\n");
+    printf("===================================\n");
+    set_block_allocation_table_name( bat_name );
+    set_inline_threshold( THRESHOLD );
+    set_journaling( 1 );
+    struct inode* root = load_inodes( mft_name );
+    print_contents( root, "/etc/motd" );
+    print_contents( root, "/etc/hostname" );
+    print_contents( root, "/etc/issue" );
+    debug_fs( root );
+
+    printf("===================================\n");
+    printf("= Save and load them again        =\n");
+    printf("===================================\n");
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+    root = load_inodes( mft_name );
+    print_contents( root, "/etc/motd" );
+    print_contents( root, "/etc/hostname" );
+    print_contents( root, "/etc/issue" );
+    debug_disk();
+
+    printf("===================================\n");
+    printf("= A version 1 table has no room   =\n");
+    printf("= for them                        =\n");
+    printf("===================================\n");
+    snprintf( v1_name, sizeof(v1_name), "%s.v1", mft_name );
+    remove( v1_name );
+    set_master_file_table_version( 1 );
+    save_inodes( v1_name, root );
+    printf("The version 1 table was %s\n", access( v1_name, F_OK ) == 0 ? "written" : "not written" );
+    remove( v1_name );
+    fs_shutdown( root );
+}
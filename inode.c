@@ -1,16 +1,130 @@
 #include "inode.h"
 #include "block_allocation.h"
+#include "block_cache.h"
+#include "block_image.h"
+#include "dir_index.h"
+#include "path_cache.h"
+#include "fs_pool.h"
+#include "mft.h"
+#include "journal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // Switch this to 0 to avoid cluttering terminal with print statements
 #define DEBUG_MODE 0
 
-// MAX ID must be incremented AFTER use 
-static int MAX_ID = 0;
+// The next id to hand out, see take_id
+static atomic_int MAX_ID = 0;
+
+// Whether trees may be used by several threads at once, see set_thread_safe
+static int thread_safe = 0;
+
+// Format that save_inodes writes, see set_master_file_table_version
+static int mft_version = MFT_VERSION;
+
+// Whether load_inodes leaves directories unloaded until they are used, see set_lazy_loading
+static int lazy_loading = 0;
+
+// Threads that load_inodes uses, 0 for one per processor, see set_load_threads
+static int load_threads = 0;
+
+// Below this many inodes per thread, starting the threads costs more than they save
+#define MIN_INODES_PER_THREAD 16384
+#define MAX_LOAD_THREADS      64
+
+// Memory that each loaded tree may use for its inodes, 0 for no limit, see set_inode_cache_budget
+static size_t cache_budget = 0;
+
+// The counters of get_inode_cache_stats. Directories are loaded and inodes created under different
+// locks in thread-safe mode, so they are atomic.
+static struct {
+    atomic_uint_least64_t hits;
+    atomic_uint_least64_t misses;
+    atomic_uint_least64_t evictions;
+    atomic_uint_least64_t evicted_inodes;
+    atomic_uint_least64_t resident;
+} cache_stats;
+
+// Whether trees log their changes to a journal next to their table, see set_journaling
+static int journaling = 0;
+static size_t journal_threshold = 4 * 1024 * 1024;
+
+// Files of at most this many bytes keep them in the inode, see set_inline_threshold
+static size_t inline_threshold = 0;
+
+// Whether create_file gives new files no blocks, see set_sparse_files
+static int sparse_files = 0;
+
+// Whether create_file only reserves the blocks of a file, see set_delayed_allocation
+static int delayed_allocation = 0;
+
+// Files that have reserved blocks and no extents yet, and the lock under which they get their extents
+static atomic_int pending_files = 0;
+static pthread_mutex_t placement_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Non-zero while the tree is walked by code that does not expect directories to be released
+static atomic_int evictions_paused = 0;
+
+// An inode that is not among the loaded directories of its tree
+#define NO_CLOCK_SLOT UINT32_MAX
+
+// A record of either format. The name and the entries still point into the table.
+struct mft_view {
+    uint32_t id;
+    uint32_t name_length;
+    uint32_t filesize;
+    uint32_t num_entries;
+    char is_directory;
+    char is_readonly;
+    char is_inline;     // entries are the filesize bytes of the file
+    char *name;
+    char *entries;      // 8 bytes per entry
+};
+
+// How the inodes of a loaded tree are found in its table, kept in the pool for lazy loading.
+// The loaded directories of the tree form the ring that the CLOCK hand of the inode cache sweeps.
+struct mft_source {
+    char *bytes;
+    size_t size;
+    const struct mft_header *header;    // for version 2 tables, NULL for legacy ones
+    uint64_t *offsets;                  // legacy: offset + 1 of the record of every id, 0 if none
+    uint32_t num_offsets;
+    uint32_t offsets_capacity;
+
+    struct journal *journal;            // changes since the table was written, or NULL
+    char *journal_table;                // the table that the journal belongs to
+
+    struct inode **clock;               // loaded directories with entries
+    uint32_t clock_size;
+    uint32_t clock_capacity;
+    uint32_t clock_hand;
+    atomic_uint_least64_t resident;     // inodes of the tree in memory
+
+    atomic_int compact_due;             // the journal is full, see finish_change
+};
+
+// The reader-writer lock of a directory in thread-safe mode
+struct dir_lock {
+    pthread_rwlock_t rwlock;
+};
+
+static int load_subtree(struct inode *node);
+static int load_entries(struct inode *dir);
+static void save_tree(const char *master_file_table, struct inode *root);
+static int find_record(const struct mft_source *src, uint64_t id, struct mft_view *v);
+static uintptr_t *entries_from_record(struct fs_pool *pool, const struct mft_view *v);
+static int rebind_table(struct inode *root, const char *master_file_table);
+static int attach_journal(struct mft_source *src, struct fs_pool *pool, const char *master_file_table,
+                          int truncate);
 
 /* 
  * Prints a debug message with the function name.
@@ -27,18 +141,400 @@ void debug(const char* function_name, const char* message, const char* optional_
 
 
 /*
-Frees the blocks allocated to a node, determined by the number of entries pointed to by the node.
+Gives back the blocks that delayed allocation reserved for a file that never got its extents.
+*/
+static void forget_reservation(struct inode* node)
+{
+    if (atomic_load(&pending_files) == 0){
+        return;
+    }
+    pthread_mutex_lock(&placement_lock);
+    if (node->reserved > 0){
+        release_reserved_blocks(node->reserved);
+        node->reserved = 0;
+        atomic_fetch_sub(&pending_files, 1);
+    }
+    pthread_mutex_unlock(&placement_lock);
+}
+
+/*
+Frees the blocks allocated to a file node, one whole extent at a time, and clears them in the block
+image if one is open.
 
 @param node reference to which blocks must be freed
+@return 0 on success, -1 if any extent could not be freed or cleared
 */
-void free_all_file_blocks(struct inode* node)
+int free_all_file_blocks(struct inode* node)
 {
-    if (!node || !node->entries)
-        return;
+    if (!node)
+        return 0;
+    forget_reservation(node);
+    if (!node->entries || node->is_inline)
+        return 0;
 
+    int result = 0;
+    struct Extent* extents = (struct Extent*) node->entries;
     for (uint32_t i = 0; i < node->num_entries; i++) {
-        free_block(node->entries[i]);
+        if (extents[i].blockno == EXTENT_HOLE)
+            continue;
+        // Cached data of the file must not be written over the next owner of the blocks
+        block_cache_forget(extents[i].blockno, extents[i].extent);
+        // and the next owner must not read what the file left in the image
+        if (block_image_fd() != -1
+            && block_image_discard((uint64_t) extents[i].blockno * BLOCKSIZE,
+                                   (size_t) extents[i].extent * BLOCKSIZE) == -1){
+            debug(__func__, "failed to clear the blocks of", node->name);
+            result = -1;
+        }
+        if (free_extent(extents[i].blockno, extents[i].extent) == -1)
+            result = -1;
+    }
+    return result;
+}
+
+/*
+Adds an extent at the end of the extents of a file. The array grows in the size classes of the pool, so
+adding one extent at a time does not copy it every time.
+
+@return 0 on success, -1 if memory could not be allocated
+*/
+static int append_extent(struct inode* node, int block, int extent_size)
+{
+    struct Extent* grown = fs_pool_realloc(node->pool, node->entries,
+                                           node->num_entries * sizeof(struct Extent),
+                                           (node->num_entries + 1) * sizeof(struct Extent));
+    if (!grown){
+        debug(__func__, "failed to allocate memory for extents", "");
+        return -1;
+    }
+    node->entries = (uintptr_t*) grown;
+    grown[node->num_entries].blockno = block;
+    grown[node->num_entries].extent = extent_size;
+    node->num_entries++;
+    return 0;
+}
+
+/*
+Allocates blocks for a file as a list of extents. As long as the rest of the file does not fit in one run
+of free blocks, the longest run is taken, so the file is split into as few extents as possible.
+
+node->entries and node->num_entries always describe the extents allocated so far, so that free_node
+can give them back if this fails.
+
+@param node the file node that receives the extents
+@param blocks_needed number of blocks to allocate
+@return 0 on success, -1 if the disk does not have enough free blocks
+*/
+static int allocate_file_extents(struct inode* node, int blocks_needed)
+{
+    while (blocks_needed > 0){
+        // One call, so that another thread cannot take the run between finding and allocating it
+        int extent_size;
+        int block = allocate_largest_block(blocks_needed, &extent_size);
+        if (block == -1){
+            debug(__func__, "no free blocks left for file", node->name);
+            return -1;
+        }
+        if (append_extent(node, block, extent_size) == -1){
+            free_extent(block, extent_size);
+            return -1;
+        }
+        blocks_needed -= extent_size;
+    }
+    return 0;
+}
+
+/*
+Gives a pending file the blocks that were reserved for it, see set_delayed_allocation. The reservation
+is taken like allocate_file_extents takes free blocks, so the file gets one extent if a run is long enough.
+Called with placement_lock held.
+
+@return 0 on success, -1 if memory ran out; the blocks that are still reserved stay with the file
+*/
+static int place_reserved(struct inode* node)
+{
+    while (node->reserved > 0){
+        int extent_size;
+        int block = allocate_reserved_block(node->reserved, &extent_size);
+        if (block == -1){
+            debug(__func__, "reserved blocks could not be allocated for file", node->name);
+            return -1;
+        }
+        node->reserved -= extent_size;
+        if (append_extent(node, block, extent_size) == -1){
+            // The blocks go back to the reservation of the file, unless another thread took them
+            free_extent(block, extent_size);
+            if (reserve_blocks(extent_size) == 0)
+                node->reserved += extent_size;
+            return -1;
+        }
+    }
+    atomic_fetch_sub(&pending_files, 1);
+    return 0;
+}
+
+int place_file_blocks(struct inode* node)
+{
+    if (!node || atomic_load(&pending_files) == 0){
+        return 0;
+    }
+    pthread_mutex_lock(&placement_lock);
+    int result = node->reserved > 0 ? place_reserved(node) : 0;
+    pthread_mutex_unlock(&placement_lock);
+    return result;
+}
+
+/*
+Places the pending files below dir, depth first, so that the files of one directory are placed one after
+the other. Directories that are not loaded have no pending files, since changed directories stay loaded.
+
+@return 0 on success, -1 if any file could not get its blocks
+*/
+static int place_pending(struct inode* dir)
+{
+    int result = 0;
+    for (uint32_t i = 0; i < dir->num_entries && atomic_load(&pending_files) > 0; i++){
+        struct inode* child = (struct inode*) dir->entries[i];
+        if (child->is_directory){
+            if (!child->unloaded && place_pending(child) == -1)
+                result = -1;
+        } else if (child->reserved > 0 && place_reserved(child) == -1){
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/*
+Gives back the reservations of the pending files below dir, before the tree is released.
+*/
+static void forget_pending(struct inode* dir)
+{
+    for (uint32_t i = 0; i < dir->num_entries && atomic_load(&pending_files) > 0; i++){
+        struct inode* child = (struct inode*) dir->entries[i];
+        if (child->is_directory){
+            if (!child->unloaded)
+                forget_pending(child);
+        } else {
+            forget_reservation(child);
+        }
+    }
+}
+
+/*
+Gives a new file zeroed bytes in its inode instead of blocks, see set_inline_threshold.
+
+@return 0 on success, -1 if memory could not be allocated
+*/
+static int store_inline(struct inode* node)
+{
+    node->entries = fs_pool_alloc(node->pool, node->filesize);
+    if (!node->entries){
+        debug(__func__, "failed to allocate memory for the bytes of file", node->name);
+        return -1;
+    }
+    memset(node->entries, 0, node->filesize);
+    node->is_inline = 1;
+    return 0;
+}
+
+/*
+Reserves the blocks of a new file instead of allocating them, see set_delayed_allocation.
+
+@return 0 on success, -1 if the disk does not have enough free blocks that are not reserved
+*/
+static int reserve_file_blocks(struct inode* node, int blocks_needed)
+{
+    if (blocks_needed == 0){
+        return 0;
+    }
+    if (reserve_blocks(blocks_needed) == -1){
+        debug(__func__, "not enough free blocks to reserve for file", node->name);
+        return -1;
+    }
+    node->reserved = blocks_needed;
+    atomic_fetch_add(&pending_files, 1);
+    return 0;
+}
+
+/*
+Returns the number of bytes in the entry array of node when it has num_entries entries. The entries of
+an inline file are its bytes.
+*/
+static size_t entries_size(const struct inode* node, uint32_t num_entries)
+{
+    if (node->is_inline){
+        return node->filesize;
+    }
+    return num_entries * (node->is_directory ? sizeof(uintptr_t) : sizeof(struct Extent));
+}
+
+/*
+Resizes the entry array of a directory to num_entries entries. The old entries are kept.
+
+@return 0 on success, -1 if memory could not be allocated
+*/
+static int resize_entries(struct inode* dir, uint32_t num_entries)
+{
+    uintptr_t* entries = fs_pool_realloc(dir->pool, dir->entries,
+                                         entries_size(dir, dir->num_entries),
+                                         entries_size(dir, num_entries));
+    if (!entries && num_entries > 0){
+        return -1;
+    }
+    dir->entries = entries;
+    return 0;
+}
+
+/*
+Returns a new id. Ids are taken atomically, so that threads that create inodes at the same time never
+get the same one.
+*/
+static uint32_t take_id(void)
+{
+    return atomic_fetch_add(&MAX_ID, 1);
+}
+
+/*
+Makes sure that the ids that are taken from now on are larger than id.
+*/
+static void reserve_ids(uint32_t id)
+{
+    int next = atomic_load(&MAX_ID);
+    while ((uint32_t) next <= id && !atomic_compare_exchange_weak(&MAX_ID, &next, (int) (id + 1))){
+    }
+}
+
+/*
+Takes the lock of the tree of node in thread-safe mode: shared for calls that change or search a few
+directories, which lock those themselves, and exclusive for calls that walk the whole tree.
+*/
+static void lock_tree(struct inode* node, int exclusive)
+{
+    if (thread_safe){
+        fs_pool_lock(node->pool, exclusive);
+    }
+}
+
+static void unlock_tree(struct inode* node)
+{
+    if (thread_safe){
+        fs_pool_unlock(node->pool);
+    }
+}
+
+/*
+Takes the lock of a directory in thread-safe mode, exclusive to change its entries or index.
+*/
+static void lock_dir(struct inode* dir, int exclusive)
+{
+    if (dir->lock){
+        if (exclusive){
+            pthread_rwlock_wrlock(&dir->lock->rwlock);
+        }else{
+            pthread_rwlock_rdlock(&dir->lock->rwlock);
+        }
+    }
+}
+
+static void unlock_dir(struct inode* dir)
+{
+    if (dir->lock){
+        pthread_rwlock_unlock(&dir->lock->rwlock);
+    }
+}
+
+/*
+Adds a loaded directory to the ring of its tree. Trees in thread-safe mode have no ring, since they are
+not evicted.
+
+@return 0 on success, -1 if memory could not be allocated
+*/
+static int clock_add(struct mft_source* src, struct inode* dir)
+{
+    if (thread_safe || dir->clock_slot != NO_CLOCK_SLOT){
+        return 0;
+    }
+    if (src->clock_size == src->clock_capacity){
+        uint32_t capacity = src->clock_capacity ? src->clock_capacity * 2 : 64;
+        struct inode** grown = fs_pool_realloc(dir->pool, src->clock,
+                                               src->clock_capacity * sizeof(struct inode*),
+                                               capacity * sizeof(struct inode*));
+        if (!grown){
+            return -1;
+        }
+        src->clock = grown;
+        src->clock_capacity = capacity;
+    }
+    dir->clock_slot = src->clock_size;
+    src->clock[src->clock_size++] = dir;
+    return 0;
+}
+
+/*
+Removes an inode from the ring of its tree, if it is in it. The last directory takes its slot.
+*/
+static void clock_remove(struct mft_source* src, struct inode* node)
+{
+    uint32_t slot = node->clock_slot;
+    if (slot == NO_CLOCK_SLOT){
+        return;
+    }
+    struct inode* last = src->clock[--src->clock_size];
+    src->clock[slot] = last;
+    last->clock_slot = slot;
+    node->clock_slot = NO_CLOCK_SLOT;
+    if (src->clock_hand >= src->clock_size){
+        src->clock_hand = 0;
+    }
+}
+
+/*
+Gives the memory of a single inode back to its pool. The entries must have been dealt with already.
+
+@param node the inode to release
+*/
+static void release_node(struct inode* node)
+{
+    struct fs_pool* pool = node->pool;
+    if (!node->is_directory){
+        forget_reservation(node);
+    }
+    struct mft_source* src = fs_pool_table(pool);
+    if (src){
+        clock_remove(src, node);
+        src->resident--;
+        cache_stats.resident--;
+    }
+    path_cache_forget(node);
+    if (node->lock){
+        pthread_rwlock_destroy(&node->lock->rwlock);
+        fs_pool_free(pool, node->lock, sizeof(struct dir_lock));
+    }
+    dir_index_free(pool, node->index);
+    fs_pool_free(pool, node->entries, entries_size(node, node->num_entries));
+    fs_pool_free(pool, node->name, strlen(node->name) + 1);
+    fs_pool_release_inode(pool, node);
+}
+
+/*
+Releases all memory of the tree below root at once, by destroying the pool of the tree.
+
+@param root the root inode of the tree
+*/
+static void release_tree(struct inode* root)
+{
+    // The cached entries link into the inodes, so they must go first
+    path_cache_clear();
+    if (root->is_directory && !root->unloaded){
+        forget_pending(root);
     }
+    struct mft_source* src = fs_pool_table(root->pool);
+    if (src){
+        cache_stats.resident -= src->resident;
+        journal_close(src->journal);
+    }
+    fs_pool_destroy(root->pool);
 }
 
 /*
@@ -55,15 +551,220 @@ void free_node(struct inode* node){
         return;
     }
     if (node->is_directory){
+        // The files below need their blocks freed, so the children must be known. The entries
+        // point to freed inodes while this runs, so the cache must not look at them.
+        evictions_paused++;
+        load_entries(node);
         for (uint32_t i = 0; i < node->num_entries; i++){
             free_node((struct inode*) node->entries[i]);
         }
+        evictions_paused--;
     }else{
         free_all_file_blocks(node);
     }
-    free(node->entries);
-    free(node->name);
-    free(node);
+
+    if (fs_pool_root(node->pool) == node){
+        release_tree(node);
+    }else{
+        release_node(node);
+    }
+}
+
+/*
+Adds a new entry of parent to the hash index of parent, if it has one. If the index cannot grow,
+it is dropped, and find_inode_by_name builds it again later.
+
+@param parent directory that got a new entry
+@param node the new entry
+*/
+static void index_add_entry(struct inode* parent, struct inode* node)
+{
+    if (parent->index && dir_index_insert(parent->pool, parent->index, node) == -1){
+        debug(__func__, "dropping directory index of", parent->name);
+        dir_index_free(parent->pool, parent->index);
+        parent->index = NULL;
+    }
+}
+
+/*
+Removes an entry of parent from the hash index of parent, if it has one.
+
+@param parent directory that loses an entry
+@param node the entry that is removed
+*/
+static void index_remove_entry(struct inode* parent, struct inode* node)
+{
+    if (parent->index){
+        dir_index_remove(parent->index, node);
+    }
+}
+
+/*
+Appends a redo record of a change of parent to the journal of the tree, if it has one. When the journal
+has grown past its threshold, or the record could not be written, the tree is saved to its table, which
+starts an empty journal. In thread-safe mode the caller holds the lock of parent, so the save waits for
+finish_change.
+
+@param parent directory that changed
+@param op what happened
+@param node the inode that was created or is being deleted; it is no longer an entry of parent
+*/
+static void log_change(struct inode* parent, enum journal_op op, const struct inode* node)
+{
+    struct mft_source* src = fs_pool_table(parent->pool);
+    if (!src || !src->journal){
+        return;
+    }
+
+    struct journal_record record;
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.is_readonly = node->is_readonly;
+    record.id = node->id;
+    record.parent_id = parent->id;
+    const char* name = NULL;
+    const void* entries = NULL;
+    if (op == JOURNAL_CREATE_FILE || op == JOURNAL_CREATE_DIR){
+        name = node->name;
+        record.filesize = node->filesize;
+        if (node->is_inline){
+            record.flags = JOURNAL_INLINE;
+        } else if (node->reserved > 0){
+            record.flags = JOURNAL_RESERVED;
+        } else if (!node->is_directory){
+            record.num_entries = node->num_entries;
+            entries = node->entries;
+        }
+    }
+
+    int failed = journal_append(src->journal, &record, name, entries) == -1;
+    if (failed){
+        debug(__func__, "failed to append to the journal, saving the whole table", strerror(errno));
+    }
+    if (failed || journal_size(src->journal) > journal_threshold){
+        if (thread_safe){
+            atomic_store(&src->compact_due, 1);
+            return;
+        }
+        // The caller still uses parent and the new inode, so a budget must not release them
+        parent->pins++;
+        save_tree(src->journal_table, fs_pool_root(parent->pool));
+        parent->pins--;
+    }
+}
+
+/*
+Saves a tree in thread-safe mode whose journal log_change found full, once the change that filled it
+released its locks.
+*/
+static void finish_change(struct fs_pool* pool)
+{
+    struct mft_source* src = fs_pool_table(pool);
+    if (!src || !atomic_exchange(&src->compact_due, 0)){
+        return;
+    }
+    struct inode* root = fs_pool_root(pool);
+    lock_tree(root, 1);
+    if (src->journal_table){
+        save_tree(src->journal_table, root);
+    }
+    unlock_tree(root);
+}
+
+/*
+Appends a redo record of the data of a file to the journal of its tree, if it has one: the bytes of an
+inline file, or the extents of a file that got new blocks. A full journal is compacted as in log_change.
+The caller holds no lock of the tree.
+
+@param node the file that changed
+*/
+void log_file_change(struct inode* node)
+{
+    struct mft_source* src = fs_pool_table(node->pool);
+    if (!src || !src->journal){
+        return;
+    }
+
+    struct journal_record record;
+    memset(&record, 0, sizeof(record));
+    record.op = JOURNAL_CHANGE_FILE;
+    record.is_readonly = node->is_readonly;
+    record.id = node->id;
+    record.filesize = node->filesize;
+    record.num_entries = node->num_entries;
+    const void* entries = node->entries;
+
+    // The bytes of an inline file go in whole extents, the last one padded with zeros
+    struct Extent padded[INLINE_DATA_MAX / sizeof(struct Extent)];
+    if (node->is_inline){
+        record.flags = JOURNAL_INLINE;
+        record.num_entries = (node->filesize + sizeof(struct Extent) - 1) / sizeof(struct Extent);
+        memset(padded, 0, record.num_entries * sizeof(struct Extent));
+        memcpy(padded, node->entries, node->filesize);
+        entries = padded;
+    }
+
+    int failed = journal_append(src->journal, &record, NULL, entries) == -1;
+    if (failed){
+        debug(__func__, "failed to append to the journal, saving the whole table", strerror(errno));
+    }
+    if (failed || journal_size(src->journal) > journal_threshold){
+        // The caller still uses node, so a budget must not release it
+        node->pins++;
+        if (thread_safe){
+            atomic_store(&src->compact_due, 1);
+            finish_change(node->pool);
+        }else{
+            save_tree(src->journal_table, fs_pool_root(node->pool));
+        }
+        node->pins--;
+    }
+}
+
+/*
+Adds node as the last entry of parent. Both are changed since the table was written.
+
+@return 0 on success, -1 if memory could not be allocated
+*/
+static int add_entry(struct inode* parent, struct inode* node)
+{
+    if (resize_entries(parent, parent->num_entries + 1) == -1){
+        return -1;
+    }
+    parent->entries[parent->num_entries++] = (uintptr_t) node;
+    index_add_entry(parent, node);
+    parent->dirty = 1;
+    node->dirty = 1;
+    return 0;
+}
+
+/*
+Returns the position of node among the entries of parent, or -1 if it is not one of them.
+*/
+static int entry_position(const struct inode* parent, const struct inode* node)
+{
+    for (uint32_t i = 0; i < parent->num_entries; i++){
+        if ((uintptr_t) node == parent->entries[i]){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+Removes the entry at position i from parent. The inode of the entry is not freed.
+*/
+static void remove_entry(struct inode* parent, uint32_t i)
+{
+    index_remove_entry(parent, (struct inode*) parent->entries[i]);
+    parent->dirty = 1;
+    for (; i + 1 < parent->num_entries; i++){
+        parent->entries[i] = parent->entries[i + 1];
+    }
+
+    // Shrinking never fails, at worst the array keeps its size class
+    resize_entries(parent, parent->num_entries - 1);
+    --parent->num_entries;
 }
 
 /*
@@ -71,7 +772,9 @@ void free_node(struct inode* node){
 Returns a reference to a new inode.
 
 All properties are read or calculated by data from an Master File Table.
+The inode comes from the pool, and so must name and entries.
 
+@param pool the memory pool of the tree the inode belongs to
 @param id
 @param name
 @param is_directory
@@ -82,6 +785,7 @@ All properties are read or calculated by data from an Master File Table.
 
 */
 struct inode* create_inode(
+    struct fs_pool* pool,
     uint32_t id,
     char* name,
     char is_directory,
@@ -91,7 +795,7 @@ struct inode* create_inode(
     uintptr_t* entries
 ){
     // Create the inode to be inserted
-    struct inode* node = malloc(sizeof(struct inode));
+    struct inode* node = fs_pool_inode(pool);
     if (!node) {
         debug(__func__, "failed to allocate memory for new node", "");
         //free(node);
@@ -102,40 +806,107 @@ struct inode* create_inode(
     node->name = name;
     node->is_directory = is_directory;
     node->is_readonly = is_readonly;
+    node->is_inline = 0;
     node->filesize = filesize;
     node->num_entries = num_entries;
     node->entries = entries;
-    char node_info[100];
-    snprintf(node_info, sizeof(node_info), 
-             "Node(id=%u, name=%s, dir=%d, readonly=%d, size=%u, entries=%u)", 
-             id, name, is_directory, is_readonly, filesize, num_entries);
-    debug(__func__, "created node: ", node_info);
-    return node;
-}
+    node->index = NULL;
+    node->cached = NULL;
+    node->pool = pool;
+    node->unloaded = 0;
+    node->dirty = 0;
+    node->referenced = 0;
+    node->pins = 0;
+    node->reserved = 0;
+    node->clock_slot = NO_CLOCK_SLOT;
+    node->lock = NULL;
+    if (thread_safe && is_directory){
+        node->lock = fs_pool_alloc(pool, sizeof(struct dir_lock));
+        if (!node->lock){
+            debug(__func__, "failed to allocate memory for directory lock", "");
+            fs_pool_release_inode(pool, node);
+            return NULL;
+        }
+        pthread_rwlock_init(&node->lock->rwlock, NULL);
+    }
+
+    struct mft_source* src = fs_pool_table(pool);
+    if (src){
+        src->resident++;
+        cache_stats.resident++;
+    }
+    // Only format the description when it is printed, it costs more than the rest of this function
+    if (DEBUG_MODE){
+        char node_info[100];
+        snprintf(node_info, sizeof(node_info), 
+                 "Node(id=%u, name=%s, dir=%d, readonly=%d, size=%u, entries=%u)", 
+                 id, name, is_directory, is_readonly, filesize, num_entries);
+        debug(__func__, "created node: ", node_info);
+    }
+    return node;
+}
 
 
-struct inode* create_file( struct inode* parent, const char* name, char readonly, int size_in_bytes )
+/*
+Loads dir and builds its hash index if it is large enough for one. Both change dir, so in thread-safe
+mode the caller holds the lock of dir for writing.
+
+@return 0 on success, -1 if the directory could not be loaded
+*/
+static int prepare_directory(struct inode* dir)
 {
-    debug(__func__, "attempting to create file:", name);
+    int result = load_entries(dir);
 
-    if (!parent){
-        debug(__func__, "parent pointer was NULL", "");
-        return NULL;
+    // Large directories are searched through their hash index
+    if (!dir->index && dir->num_entries >= DIR_INDEX_THRESHOLD){
+        dir->index = dir_index_build(dir->pool, dir->entries, dir->num_entries);
     }
+    return result;
+}
 
-    if (!parent->is_directory){
-        debug(__func__, "parent pointer is not a dir", "");
+/*
+Returns 1 if prepare_directory has nothing left to do for dir, so that a read lock is enough to search it.
+*/
+static int directory_is_prepared(const struct inode* dir)
+{
+    return !dir->unloaded && (dir->index || dir->num_entries < DIR_INDEX_THRESHOLD);
+}
+
+/*
+Searches the entries of a prepared directory for name.
+*/
+static struct inode* search_directory(const struct inode* parent, const char* name)
+{
+    if (parent->index){
+        return dir_index_find(parent->index, name);
+    }
+    for (uint32_t i = 0; i < parent->num_entries; i++){
+        struct inode* child = (struct inode*) parent->entries[i];
+        if (strcmp(child->name, name) == 0){
+            return child;
+        }
+    }
+    return NULL;
+}
+
+/*
+The body of create_file, called with parent locked for writing.
+*/
+static struct inode* add_file(struct inode* parent, const char* name, char readonly, int size_in_bytes)
+{
+    if (prepare_directory(parent) == -1){
+        debug(__func__, "failed to load parent directory", parent->name);
         return NULL;
     }
 
     // Check if there already exists a file with the new name in the current directory
-    if (find_inode_by_name(parent, name)){
+    if (search_directory(parent, name)){
         debug(__func__, "entry with (name) already exists", name);
         return NULL;
     }
 
     // Duplicate name to adjust the data type to match constructor of an inode
-    char* new_file_name = strdup(name);
+    char* new_file_name = fs_pool_strdup(parent->pool, name);
     if (!new_file_name){
         debug(__func__, "failed to allocate memory for file name", "");
         //free(new_file_name);
@@ -144,73 +915,133 @@ struct inode* create_file( struct inode* parent, const char* name, char readonly
 
     struct inode* node;
 
-    // Allocate memory for entries
-
     // Calculcate the number of blocks needed to store the file
-    int blocks_needed = (size_in_bytes + 4095) / 4096;
-
-    
-    node = create_inode(MAX_ID, new_file_name,0,readonly,size_in_bytes,blocks_needed,NULL);
-    ++MAX_ID;
+    int blocks_needed = (size_in_bytes + BLOCKSIZE - 1) / BLOCKSIZE;
 
-    // Allocate memory for entries
-    node->entries = malloc(sizeof(uintptr_t) * blocks_needed);
-    if (!node->entries){
-        debug(__func__, "failed to allocate memory for new file","");
-        free_node(node);
+    node = create_inode(parent->pool, take_id(), new_file_name,0,readonly,size_in_bytes,0,NULL);
+    if (!node){
+        fs_pool_free(parent->pool, new_file_name, strlen(new_file_name) + 1);
         return NULL;
     }
 
-    for (int i = 0; i < blocks_needed; i++){
-        int block = allocate_block(1);
-        if (block == -1){
-            debug(__func__, "failed to allocate memory for block", "");
-            free_block(1);
-            free_node(node);
-            return NULL;
-        }
-        node->entries[i] = block;
+    // The entries of a file are its extents, which delayed allocation only reserves, or the bytes of
+    // a small file
+    int failed;
+    if (size_in_bytes > 0 && (size_t) size_in_bytes <= inline_threshold){
+        failed = store_inline(node) == -1;
+    } else if (sparse_files){
+        failed = 0;
+    } else if (delayed_allocation){
+        failed = reserve_file_blocks(node, blocks_needed) == -1;
+    } else {
+        failed = allocate_file_extents(node, blocks_needed) == -1;
+    }
+    if (failed){
+        debug(__func__, "failed to allocate blocks for new file", name);
+        free_node(node);
+        return NULL;
     }
 
     // Reallocate space for this file in parent dir entries
-    parent->entries = realloc(parent->entries, sizeof(uintptr_t) * (parent->num_entries + 1));
-    if(!parent->entries){
+    if (add_entry(parent, node) == -1){
         debug(__func__, "failed to reallocate memory in parent directory", "");
+        free_node(node);
+        return NULL;
+    }
+    log_change(parent, JOURNAL_CREATE_FILE, node);
+    return node;
+}
+
+struct inode* create_file( struct inode* parent, const char* name, char readonly, int size_in_bytes )
+{
+    debug(__func__, "attempting to create file:", name);
+
+    if (!parent){
+        debug(__func__, "parent pointer was NULL", "");
+        return NULL;
+    }
+
+    if (!parent->is_directory){
+        debug(__func__, "parent pointer is not a dir", "");
         return NULL;
     }
-    parent->num_entries++;
 
-    parent->entries[parent->num_entries - 1] = (uintptr_t) node;
+    struct fs_pool* pool = parent->pool;
+    lock_tree(parent, 0);
+    lock_dir(parent, 1);
+    struct inode* node = add_file(parent, name, readonly, size_in_bytes);
+    unlock_dir(parent);
+    unlock_tree(parent);
+    finish_change(pool);
 
-    debug(__func__, "created file: ", name);
+    if (node){
+        debug(__func__, "created file: ", name);
+    }
     return node;
 }
 
-struct inode* create_dir( struct inode* parent, const char* name )
+/*
+The body of create_dir below a parent, called with parent locked for writing.
+*/
+static struct inode* add_dir(struct inode* parent, const char* name)
 {
-    debug(__func__, "attempting directory creation: ", name);
+    if (prepare_directory(parent) == -1){
+        debug(__func__, "failed to load parent directory", parent->name);
+        return NULL;
+    }
 
-    struct inode* node;
+    // Check if there already exists a directory or file with the new name in the current directory
+    if (search_directory(parent, name)){
+        debug(__func__, "entry with (name) already exists", name);
+        return NULL;
+    }
 
     // Duplicate name to adjust the data type to match constructor of an inode
-    char* new_dir_name = strdup(name);
+    char* new_dir_name = fs_pool_strdup(parent->pool, name);
     if (!new_dir_name){
         debug(__func__, "failed to allocate memory for directory name", "");
-        //free(new_dir_name);
         return NULL;
     }
 
-    // Check if directory is root
+    // Create the new node
+    struct inode* node = create_inode(parent->pool, take_id(),new_dir_name,1,0,0,0,NULL);
+    if (!node){
+        fs_pool_free(parent->pool, new_dir_name, strlen(new_dir_name) + 1);
+        debug(__func__, "memory allocation for new_node failed", "");
+        return NULL;
+    }
+
+    // Add a pointer to the new dir from parent dir. If memory reallocation fails, no dir was added.
+    if (add_entry(parent, node) == -1){
+        release_node(node);
+        debug(__func__, "memory allocation for new_entries failed", "");
+        return NULL;
+    }
+    log_change(parent, JOURNAL_CREATE_DIR, node);
+    return node;
+}
+
+struct inode* create_dir( struct inode* parent, const char* name )
+{
+    debug(__func__, "attempting directory creation: ", name);
+
+    struct inode* node;
+
+    // Check if directory is root, a root starts a new tree with its own memory pool
     if (!parent){
         debug(__func__, "parent pointer was NULL", "");
-        node = create_inode(MAX_ID, new_dir_name, 1,0,0,0,NULL);
-        MAX_ID++;
+        struct fs_pool* pool = fs_pool_create();
+        if (pool && thread_safe){
+            fs_pool_share(pool);
+        }
+        char* root_name = pool ? fs_pool_strdup(pool, name) : NULL;
+        node = root_name ? create_inode(pool, take_id(), root_name, 1,0,0,0,NULL) : NULL;
         if (!node){
-            //free(node);
             debug(__func__, "failed to create root node", "");
-            --MAX_ID;
+            fs_pool_destroy(pool);
             return NULL;
         }
+        fs_pool_set_root(pool, node);
         return node;
     } 
 
@@ -219,409 +1050,1851 @@ struct inode* create_dir( struct inode* parent, const char* name )
         return NULL;  
     }
 
-    // Check if there already exists a directory or file with the new name in the current directory
-    if (find_inode_by_name(parent, name)){
-        debug(__func__, "entry with (name) already exists", name);
+    struct fs_pool* pool = parent->pool;
+    lock_tree(parent, 0);
+    lock_dir(parent, 1);
+    node = add_dir(parent, name);
+    unlock_dir(parent);
+    unlock_tree(parent);
+    finish_change(pool);
+
+    if (node){
+        debug(__func__, "created directory: ", name);
+    }
+    return node;
+
+}
+
+/*
+The body of find_inode_by_name, called with the tree of parent locked. Only parent is locked here, for
+writing if it must be loaded or indexed first.
+*/
+static struct inode* find_in_directory(struct inode* parent, const char* name)
+{
+    lock_dir(parent, 0);
+    if (parent->lock && !directory_is_prepared(parent)){
+        unlock_dir(parent);
+        lock_dir(parent, 1);
+    }
+
+    // In a lazily loaded tree the children are created on the first lookup
+    prepare_directory(parent);
+    struct inode* node = search_directory(parent, name);
+    unlock_dir(parent);
+    return node;
+}
+
+struct inode *find_inode_by_name(struct inode *parent, const char *name)
+{
+
+    if (!parent)
+    {
+        return NULL;
+    }
+    if (!(parent->is_directory))
+    {
         return NULL;
     }
 
-    // Allocate memory for new directory
-    // Calculated as: size of current dir + size of new dir + 1
-    
-    // Check whether num_entries has been initialized
-    // Update the number of entries to reflect a new dir added
-    ++parent->num_entries;
-    uintptr_t* new_entries = realloc(parent->entries, sizeof(uintptr_t) * parent->num_entries);
-    //TODO: Must free the realloc if it fails
-    
-    if (!new_entries){
-        // If memory reallocation fails, the count should not be increased because no dir was added
-        --parent->num_entries;
-        debug(__func__, "memory allocation for new_entries failed", "");
+    lock_tree(parent, 0);
+    struct inode *node = find_in_directory(parent, name);
+    unlock_tree(parent);
+    return node;
+}
+
+/*
+Looks up one path component below dir, through the path cache first.
+
+@param dir directory to search
+@param name start of the component, not NUL terminated
+@param len length of the component
+@param generation of the path cache when the lookup started
+@return the inode of the component, or NULL if dir has no such entry
+*/
+static struct inode* lookup_component(struct inode* dir, const char* name, uint32_t len,
+                                      uint64_t generation)
+{
+    struct inode* node = path_cache_find(dir, name, len);
+    if (node){
+        return node;
+    }
+
+    // find_in_directory needs a NUL terminated name
+    char buffer[64];
+    char* copy = buffer;
+    if (len >= sizeof(buffer)){
+        copy = malloc(len + 1);
+        if (!copy){
+            debug(__func__, "failed to allocate memory for path component", "");
+            return NULL;
+        }
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+
+    node = find_in_directory(dir, copy);
+    if (copy != buffer){
+        free(copy);
+    }
+    if (node){
+        path_cache_insert(dir, name, len, node, generation);
+    }
+    return node;
+}
+
+/*
+The body of lookup_path, called with the tree of root locked.
+*/
+static struct inode* resolve_path(struct inode* root, const char* path, uint32_t len)
+{
+    // Entries that are found after an inode was freed may name that inode, so they are not cached
+    uint64_t generation = path_cache_generation();
+
+    // A path that was resolved before is one probe
+    struct inode* node = path_cache_find(root, path, len);
+    if (node){
+        return node;
+    }
+
+    // Otherwise start below the longest prefix that is cached
+    struct inode* dir = root;
+    uint32_t pos = 0;
+    for (uint32_t i = len - 1; i > 0; i--){
+        if (path[i] == '/' && path[i - 1] != '/'){
+            node = path_cache_find(root, path, i);
+            if (node){
+                dir = node;
+                pos = i;
+                break;
+            }
+        }
+    }
+
+    while (pos < len){
+        while (path[pos] == '/'){
+            pos++;
+        }
+        uint32_t end = pos;
+        while (end < len && path[end] != '/'){
+            end++;
+        }
+
+        if (!dir->is_directory){
+            return NULL;
+        }
+        node = lookup_component(dir, path + pos, end - pos, generation);
+        if (!node){
+            return NULL;
+        }
+        if (end < len && node->is_directory){
+            path_cache_insert(root, path, end, node, generation);
+        }
+        dir = node;
+        pos = end;
+    }
+
+    path_cache_insert(root, path, len, dir, generation);
+    return dir;
+}
+
+struct inode* lookup_path(struct inode* root, const char* path)
+{
+    if (!root || !path){
+        return NULL;
+    }
+
+    // Leading and trailing slashes do not change the result
+    while (*path == '/'){
+        path++;
+    }
+    size_t length = strlen(path);
+    while (length > 0 && path[length - 1] == '/'){
+        length--;
+    }
+    if (length == 0){
+        return root;
+    }
+    if (length > UINT32_MAX){
         return NULL;
     }
-    parent->entries = new_entries;
 
+    lock_tree(root, 0);
+    struct inode* node = resolve_path(root, path, (uint32_t) length);
+    unlock_tree(root);
+    return node;
+}
+
+/*
+The body of delete_file, called with parent locked for writing.
+*/
+static int remove_file(struct inode* parent, struct inode* node)
+{
+    int file_index = entry_position(parent, node);
+    if (file_index == -1) {
+        debug(__func__, "aborting file deletion: file not found in parent directory", "");
+        return -1;
+    }
+
+    remove_entry(parent, file_index);
+    log_change(parent, JOURNAL_DELETE_FILE, node);
+
+    // Frees the extents of the file together with the node
+    free_node(node);
+    return 0;
+}
+
+int delete_file(struct inode* parent, struct inode* node)
+{
     
-    // Create the new node
-    node = create_inode(MAX_ID,new_dir_name,1,0,0,0,NULL);
+    if (!parent) {
+        debug(__func__, "aborting file deletion: parent pointer was null", "");
+        return -1;
+    }
+    if (!node) {
+        debug(__func__, "aborting file deletion: file is null", "");
+        return -1;
+    }
+    if (node->is_directory) {
+        debug(__func__, "aborting file deletion: node is a directory", node->name);
+        return -1;
+    }
+    if (!parent->is_directory) {
+        debug(__func__, "aborting file deletion: parent is not a directory", "");
+        return -1;
+    }
+
+    struct fs_pool* pool = parent->pool;
+    lock_tree(parent, 0);
+    lock_dir(parent, 1);
+    int result = remove_file(parent, node);
+    unlock_dir(parent);
+    unlock_tree(parent);
+    finish_change(pool);
+
+    if (result == 0){
+        debug(__func__, "file deleted successfully", "");
+    }
+    return result;
+}
+
+/*
+The body of delete_dir below a parent, called with parent locked for writing. The directories below are
+locked on the way down, parents before children, as every other call that locks two directories does.
+*/
+static int remove_dir(struct inode* parent, struct inode* node)
+{
+    int dir_index = entry_position(parent, node);
+    if (dir_index == -1) {
+        debug(__func__, "aborting dir deletion: directory not found in parent", "");
+        return -1;
+    }
+
+    lock_dir(node, 1);
+    load_entries(node);
+
+    // Delete the last entry until none are left, calling remove_dir recursively for subdirectories.
+    // Every deletion shifts the entries, so a plain index loop would skip every other one.
+    while (node->num_entries > 0){
+        struct inode* child = (struct inode*) node->entries[node->num_entries - 1];
+        int result = child->is_directory ? remove_dir(node, child) : remove_file(node, child);
+        if (result == -1){
+            debug(__func__, "aborting dir deletion: failed to delete entry", child->name);
+            unlock_dir(node);
+            return -1;
+        }
+    }
+    unlock_dir(node);
+
+    remove_entry(parent, dir_index);
+    log_change(parent, JOURNAL_DELETE_DIR, node);
+
+    release_node(node);
+    return 0;
+}
+
+int delete_dir( struct inode* parent, struct inode* node )
+{
     
-    // Increment the max id 
-    ++MAX_ID;
     if (!node){
-        free(new_dir_name);
-        --parent->num_entries;
-        --MAX_ID;
-        debug(__func__, "memory allocation for new_node failed", "");
-        return NULL;
+        debug(__func__, "aborting dir deletion: node was null", "");
+        return -1;
+    }
+    // Check if the dir is root, in that case delete it
+    if (!parent){
+        free_node(node);
+        debug(__func__, "freeing root directory", "");
+        return 0;
+    }
+
+    if (!node->is_directory) {
+        debug(__func__, "aborting dir deletion: node is a directory", node->name);
+        return -1;
+    }
+    if (!parent->is_directory) {
+        debug(__func__, "aborting dir deletion: parent is not a directory", "");
+        return -1;
+    }
+
+    struct fs_pool* pool = parent->pool;
+    lock_tree(parent, 0);
+    lock_dir(parent, 1);
+    int result = remove_dir(parent, node);
+    unlock_dir(parent);
+    unlock_tree(parent);
+    finish_change(pool);
+    return result;
+}
+
+
+/*
+Function genreted by ChatGPT to dump the content of a binary file, used for debugging.
+
+@param filename the name of the file to be dumped
+*/
+void hexdump(const char* filename) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        perror("Feil ved åpning av fil for hexdump");
+        return;
+    }
+
+    printf("\n=== Hexdump av %s ===\n", filename);
+    unsigned char buffer[16];  // Leser 16 bytes av gangen
+    size_t bytesRead;
+    size_t offset = 0; // For å vise posisjon i filen
+
+    while ((bytesRead = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        printf("%08zx  ", offset); // Utskrift av offset i hex
+
+        // Skriv ut hex-verdier
+        for (size_t i = 0; i < bytesRead; i++) {
+            printf("%02x ", buffer[i]);
+            if (i == 7) printf(" "); // Ekstra mellomrom midt i linjen
+        }
+
+        // Fyll inn mellomrom hvis det er færre enn 16 bytes lest
+        for (size_t i = bytesRead; i < 16; i++) {
+            printf("   ");
+            if (i == 7) printf(" ");
+        }
+
+        // Skriv ut ASCII-tegnene ved siden av
+        printf(" |");
+        for (size_t i = 0; i < bytesRead; i++) {
+            printf("%c", (buffer[i] >= 32 && buffer[i] <= 126) ? buffer[i] : '.');
+        }
+        printf("|\n");
+
+        offset += bytesRead;
+    }
+
+    fclose(file);
+}
+
+
+void set_master_file_table_version(int version)
+{
+    mft_version = version == 1 ? 1 : MFT_VERSION;
+}
+
+void set_lazy_loading(int enable)
+{
+    lazy_loading = enable;
+}
+
+void set_load_threads(int threads)
+{
+    load_threads = threads > 0 ? threads : 0;
+}
+
+void set_journaling(int enable)
+{
+    journaling = enable;
+}
+
+void set_journal_threshold(size_t bytes)
+{
+    journal_threshold = bytes;
+}
+
+void set_inode_cache_budget(size_t bytes)
+{
+    cache_budget = bytes;
+}
+
+void pin_inode(struct inode* node)
+{
+    if (node)
+        node->pins++;
+}
+
+void unpin_inode(struct inode* node)
+{
+    if (node && node->pins > 0)
+        node->pins--;
+}
+
+void get_inode_cache_stats(struct inode_cache_stats* stats)
+{
+    stats->hits = atomic_load(&cache_stats.hits);
+    stats->misses = atomic_load(&cache_stats.misses);
+    stats->evictions = atomic_load(&cache_stats.evictions);
+    stats->evicted_inodes = atomic_load(&cache_stats.evicted_inodes);
+    stats->resident = atomic_load(&cache_stats.resident);
+}
+
+void set_thread_safe(int enable)
+{
+    thread_safe = enable;
+    path_cache_set_thread_safe(enable);
+}
+
+void set_inline_threshold(size_t bytes)
+{
+    inline_threshold = bytes < INLINE_DATA_MAX ? bytes : INLINE_DATA_MAX;
+}
+
+void set_sparse_files(int enable)
+{
+    sparse_files = enable;
+}
+
+void set_delayed_allocation(int enable)
+{
+    delayed_allocation = enable;
+}
+
+int place_delayed_blocks(struct inode* root)
+{
+    if (!root || !root->is_directory){
+        return place_file_blocks(root);
+    }
+    if (atomic_load(&pending_files) == 0){
+        return 0;
+    }
+    lock_tree(root, 1);
+    pthread_mutex_lock(&placement_lock);
+    int result = root->unloaded ? 0 : place_pending(root);
+    pthread_mutex_unlock(&placement_lock);
+    unlock_tree(root);
+    return result;
+}
+
+// A list of extents that fs_fallocate builds in malloc'd memory
+struct extent_list
+{
+    struct Extent* extents;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+/*
+Adds length blocks at blockno, or a hole of length blocks, to the end of a list. An extent that continues
+the last one, on the disk or as a hole, makes it longer instead.
+
+@return 0 on success, -1 if memory could not be allocated
+*/
+static int push_extent(struct extent_list* list, uint32_t blockno, uint64_t length)
+{
+    if (length == 0){
+        return 0;
+    }
+    struct Extent* last = list->count ? &list->extents[list->count - 1] : NULL;
+    if (last && (last->blockno == EXTENT_HOLE ? blockno == EXTENT_HOLE
+                                              : blockno != EXTENT_HOLE && blockno == last->blockno + last->extent)){
+        last->extent += length;
+        return 0;
+    }
+    if (list->count == list->capacity){
+        uint32_t capacity = list->capacity ? 2 * list->capacity : 8;
+        struct Extent* grown = realloc(list->extents, capacity * sizeof(struct Extent));
+        if (!grown){
+            debug(__func__, "failed to allocate memory for extents", "");
+            return -1;
+        }
+        list->extents = grown;
+        list->capacity = capacity;
+    }
+    list->extents[list->count].blockno = blockno;
+    list->extents[list->count].extent = length;
+    list->count++;
+    return 0;
+}
+
+/*
+Allocates length blocks for a hole as a few long extents, the longest free runs first, and adds them to
+both lists.
+
+@return 0 on success, -1 if the disk does not have enough free blocks or memory ran out
+*/
+static int fill_hole(struct extent_list* list, struct extent_list* added, uint64_t length)
+{
+    while (length > 0){
+        int extent_size;
+        int block = allocate_largest_block(length, &extent_size);
+        if (block == -1){
+            debug(__func__, "no free blocks left for the hole", "");
+            return -1;
+        }
+        if (push_extent(added, block, extent_size) == -1){
+            free_extent(block, extent_size);
+            return -1;
+        }
+        if (push_extent(list, block, extent_size) == -1){
+            return -1;
+        }
+        length -= extent_size;
+    }
+    return 0;
+}
+
+/*
+Replaces the extents of a file with those in list. The new blocks in added read as zeros, so that the
+parts of them that are not written read like the hole they were.
+
+@return 0 on success, -1 if memory could not be allocated or the image could not be cleared
+*/
+static int replace_extents(struct inode* node, const struct extent_list* list, const struct extent_list* added)
+{
+    for (uint32_t i = 0; i < added->count; i++){
+        block_cache_forget(added->extents[i].blockno, added->extents[i].extent);
+        if (block_image_fd() != -1
+            && block_image_discard((uint64_t) added->extents[i].blockno * BLOCKSIZE,
+                                   (size_t) added->extents[i].extent * BLOCKSIZE) == -1){
+            debug(__func__, "failed to clear new blocks of", node->name);
+            return -1;
+        }
+    }
+
+    // The hole at the end of the file needs no extent
+    uint32_t count = list->count;
+    if (count > 0 && list->extents[count - 1].blockno == EXTENT_HOLE){
+        count--;
+    }
+    struct Extent* extents = fs_pool_alloc(node->pool, count * sizeof(struct Extent));
+    if (!extents && count > 0){
+        debug(__func__, "failed to allocate memory for extents", "");
+        return -1;
+    }
+    memcpy(extents, list->extents, count * sizeof(struct Extent));
+    fs_pool_free(node->pool, node->entries, node->num_entries * sizeof(struct Extent));
+    node->entries = (uintptr_t*) extents;
+    node->num_entries = count;
+    node->dirty = 1;
+    return 0;
+}
+
+int fs_fallocate(struct inode* node, uint64_t offset, uint64_t len)
+{
+    if (!node || node->is_directory){
+        debug(__func__, "not a file", node ? node->name : "");
+        return -1;
+    }
+    if (node->is_readonly){
+        debug(__func__, "file is read-only", node->name);
+        return -1;
+    }
+    if (place_file_blocks(node) == -1){
+        return -1;
+    }
+    // Inline files have all their bytes already
+    if (node->is_inline || offset >= node->filesize || len == 0){
+        return 0;
+    }
+    uint64_t file_blocks = ((uint64_t) node->filesize + BLOCKSIZE - 1) / BLOCKSIZE;
+    uint64_t first = offset / BLOCKSIZE;
+    uint64_t end = len > node->filesize - offset ? file_blocks : (offset + len + BLOCKSIZE - 1) / BLOCKSIZE;
+
+    pthread_mutex_lock(&placement_lock);
+    const struct Extent* extents = (const struct Extent*) node->entries;
+    struct extent_list list = { NULL, 0, 0 };
+    struct extent_list added = { NULL, 0, 0 };
+    uint64_t start = 0;
+    int result = 0;
+
+    // The extents of the file, and the hole after them, with the holes in the range split around
+    // their new blocks
+    for (uint32_t i = 0; i <= node->num_entries && result == 0; i++){
+        uint32_t blockno = i < node->num_entries ? extents[i].blockno : EXTENT_HOLE;
+        uint64_t length = i < node->num_entries ? extents[i].extent
+                                                : start < file_blocks ? file_blocks - start : 0;
+        if (blockno != EXTENT_HOLE || start + length <= first || start >= end){
+            result = push_extent(&list, blockno, length);
+        } else {
+            uint64_t from = start > first ? start : first;
+            uint64_t to = start + length < end ? start + length : end;
+            if (push_extent(&list, EXTENT_HOLE, from - start) == -1
+                || fill_hole(&list, &added, to - from) == -1
+                || push_extent(&list, EXTENT_HOLE, start + length - to) == -1){
+                result = -1;
+            }
+        }
+        start += length;
+    }
+
+    if (result == 0 && added.count > 0){
+        result = replace_extents(node, &list, &added);
+    }
+    if (result == -1){
+        for (uint32_t i = 0; i < added.count; i++)
+            free_extent(added.extents[i].blockno, added.extents[i].extent);
+    }
+    pthread_mutex_unlock(&placement_lock);
+    if (result == 0 && added.count > 0){
+        log_file_change(node);
+    }
+    free(list.extents);
+    free(added.extents);
+    return result;
+}
+
+/*
+Returns 1 if nothing below the loaded directory dir was changed or pinned, so that its children can
+be created from the table again later.
+*/
+static int subtree_is_clean(const struct inode* dir)
+{
+    for (uint32_t i = 0; i < dir->num_entries; i++){
+        const struct inode* child = (const struct inode*) dir->entries[i];
+        if (child->dirty || child->pins > 0)
+            return 0;
+        if (child->is_directory && !child->unloaded && !subtree_is_clean(child))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+Releases the inodes below node and node itself.
+*/
+static void release_subtree(struct inode* node)
+{
+    if (node->is_directory && !node->unloaded){
+        for (uint32_t i = 0; i < node->num_entries; i++)
+            release_subtree((struct inode*) node->entries[i]);
+    }
+    release_node(node);
+    cache_stats.evicted_inodes++;
+}
+
+/*
+Releases the children of a clean directory and turns its entries back into the ids of the children,
+as if it had never been loaded.
+*/
+static void evict_directory(struct mft_source* src, struct inode* dir)
+{
+    // The entries go back to those of the record, so that the pointers free their memory
+    struct mft_view v;
+    uintptr_t* entries = NULL;
+    if (find_record(src, dir->id, &v) == 0 && v.num_entries == dir->num_entries){
+        entries = entries_from_record(dir->pool, &v);
+    }
+
+    for (uint32_t i = 0; i < dir->num_entries; i++){
+        struct inode* child = (struct inode*) dir->entries[i];
+        uint32_t id = child->id;
+        release_subtree(child);
+        dir->entries[i] = id;
+    }
+    if (entries){
+        fs_pool_free(dir->pool, dir->entries, entries_size(dir, dir->num_entries));
+        dir->entries = entries;
+    }
+    dir_index_free(dir->pool, dir->index);
+    dir->index = NULL;
+    dir->unloaded = 1;
+    clock_remove(src, dir);
+    cache_stats.evictions++;
+}
+
+/*
+Evicts directories in CLOCK order until the tree is within the budget. A directory that was used since
+the hand last passed it gets another round; one that is changed or pinned, or has such an inode below
+it, is skipped. Trees in thread-safe mode are never evicted, since other threads may use any inode.
+*/
+static void evict_to_budget(struct mft_source* src)
+{
+    if (cache_budget == 0 || evictions_paused || thread_safe)
+        return;
+
+    // Every directory gets at most two looks per eviction, the first one may only clear its bit
+    uint64_t looked = 0;
+    while (src->resident * sizeof(struct inode) > cache_budget && src->clock_size > 0
+           && looked < 2 * (uint64_t) src->clock_size){
+        if (src->clock_hand >= src->clock_size)
+            src->clock_hand = 0;
+        struct inode* dir = src->clock[src->clock_hand];
+
+        if (dir->referenced){
+            dir->referenced = 0;
+        }else if (!dir->dirty && dir->pins == 0 && dir->num_entries > 0 && subtree_is_clean(dir)){
+            // The last directory of the ring moves into this slot, so the hand stays
+            evict_directory(src, dir);
+            looked = 0;
+            continue;
+        }
+        src->clock_hand++;
+        looked++;
+    }
+}
+
+/*
+Tells whether a file below node keeps its bytes inline, which the legacy MFT has no room for.
+
+@return 1 if one does, 0 otherwise
+ */
+static int has_inline_files(const struct inode* node){
+    if (!node->is_directory)
+        return node->is_inline;
+    for (uint32_t i = 0; i < node->num_entries; i++){
+        if (has_inline_files((struct inode*) node->entries[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+Helper function to recursively compute how many bytes the inodes below node take in the legacy MFT.
+
+@param node reference to the node whose record and subtree are measured
+@return size of the records in bytes
+ */
+static size_t _mft_size_rec(const struct inode* node){
+    // id, name length, is_directory, is_readonly and num_entries
+    size_t size = 3 * sizeof(uint32_t) + 2 * sizeof(char) + strlen(node->name) + 1;
+
+    if (node->is_directory){
+        // Directory entries are stored as 64-bit inode IDs
+        size += node->num_entries * sizeof(uint64_t);
+        for (uint32_t i = 0; i < node->num_entries; i++){
+            size += _mft_size_rec((struct inode*) node->entries[i]);
+        }
+    }else{
+        // Only files have a size in the MFT, as load_inodes expects
+        size += sizeof(uint32_t) + node->num_entries * sizeof(struct Extent);
+    }
+    return size;
+}
+
+/*
+Helper function to recursively serialize inode properties into a buffer in order, in the legacy format.
+
+@param out position in the buffer where the record of node starts
+@param node reference to node which contents should be written to the MFT
+@return position after the records of node and its subtree
+ */
+static char* _save_inodes_rec(char* out, const struct inode* node){
+    uint32_t name_length = strlen(node->name) + 1;
+
+    memcpy(out, &node->id, sizeof(uint32_t));          out += sizeof(uint32_t);
+    memcpy(out, &name_length, sizeof(uint32_t));       out += sizeof(uint32_t);
+    memcpy(out, node->name, name_length);              out += name_length;
+    *out++ = node->is_directory;
+    *out++ = node->is_readonly;
+    if (!node->is_directory){
+        memcpy(out, &node->filesize, sizeof(uint32_t)); out += sizeof(uint32_t);
+    }
+    memcpy(out, &node->num_entries, sizeof(uint32_t)); out += sizeof(uint32_t);
+
+    if (!node->is_directory){
+        // File entries are extents, 32-bit block number followed by 32-bit length
+        if (node->num_entries > 0)
+            memcpy(out, node->entries, node->num_entries * sizeof(struct Extent));
+        return out + node->num_entries * sizeof(struct Extent);
+    }
+
+    for (uint32_t i = 0; i < node->num_entries; i++){
+        uint64_t child_id = ((struct inode*) node->entries[i])->id;
+        memcpy(out, &child_id, sizeof(uint64_t));
+        out += sizeof(uint64_t);
+    }
+    for (uint32_t i = 0; i < node->num_entries; i++){
+        out = _save_inodes_rec(out, (struct inode*) node->entries[i]);
+    }
+    return out;
+}
+
+/*
+Writes the whole buffer to fd, continuing after short writes.
+
+@return 0 on success, -1 on error
+*/
+static int write_all(int fd, const char* buffer, size_t size){
+    while (size > 0){
+        ssize_t written = write(fd, buffer, size);
+        if (written == -1){
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/*
+Writes size bytes to a new file next to master_file_table and renames it over the table. A tree that
+was loaded from the old table keeps its mapping of the old file, even while this writes.
+
+@return 0 on success, -1 on error
+*/
+static int replace_file(const char *master_file_table, const char *buffer, size_t size)
+{
+    size_t length = strlen(master_file_table);
+    char *temporary = malloc(length + sizeof(".tmp"));
+    if (!temporary){
+        debug(__func__, "failed to allocate memory for file name", "");
+        return -1;
+    }
+    memcpy(temporary, master_file_table, length);
+    memcpy(temporary + length, ".tmp", sizeof(".tmp"));
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1){
+        debug(__func__, "failed to open MFT file", strerror(errno));
+        free(temporary);
+        return -1;
+    }
+    int result = write_all(fd, buffer, size);
+    if (result == -1){
+        debug(__func__, "failed to write MFT file", strerror(errno));
+    }
+    close(fd);
+    if (result == 0 && rename(temporary, master_file_table) == -1){
+        debug(__func__, "failed to replace MFT file", strerror(errno));
+        result = -1;
+    }
+    if (result == -1){
+        unlink(temporary);
+    }
+    free(temporary);
+    return result;
+}
+
+/*
+The body of save_inodes, called with the tree locked for writing.
+*/
+static void save_tree(const char *master_file_table, struct inode *root)
+{
+    if (DEBUG_MODE) hexdump(master_file_table);
+    debug(__func__, "attempting to save to file:", master_file_table);
+    if (!root){
+        debug(__func__, "failed to write to file: node was null", "");
+    }
+
+    // Everything is written, so a lazily loaded tree must be loaded in full first, and stay loaded
+    // until the table is built
+    evictions_paused++;
+    if (root && load_subtree(root) == -1){
+        debug(__func__, "failed to load the whole tree", "");
+    }
+
+    // The table records extents, so pending files get theirs now
+    if (root && root->is_directory && atomic_load(&pending_files) > 0){
+        pthread_mutex_lock(&placement_lock);
+        if (place_pending(root) == -1)
+            debug(__func__, "files without blocks are saved without extents", "");
+        pthread_mutex_unlock(&placement_lock);
+    }
+
+    // A sizing pass first, so the table is built in one buffer of the exact size
+    size_t size = 0;
+    char* buffer = NULL;
+    if (root && mft_version == MFT_VERSION){
+        buffer = mft_serialize(root, &size);
+    }else if (root && has_inline_files(root)){
+        debug(__func__, "version 1 tables cannot hold inline files, not writing", master_file_table);
+        evictions_paused--;
+        return;
+    }else{
+        size = root ? _mft_size_rec(root) : 0;
+        buffer = malloc(size ? size : 1);
+        if (buffer && root)
+            _save_inodes_rec(buffer, root);
+    }
+    if (!buffer){
+        debug(__func__, "failed to allocate memory for MFT buffer", "");
+        evictions_paused--;
+        return;
+    }
+
+    int result = replace_file(master_file_table, buffer, size);
+    free(buffer);
+    evictions_paused--;
+    if (result == -1){
+        return;
+    }
+    debug(__func__, "finish write to file:", master_file_table);
+    if (DEBUG_MODE) hexdump(master_file_table);
+
+    // The new table holds every change, so the tree can be loaded from it from now on, and its
+    // journal starts empty
+    if (!root || fs_pool_root(root->pool) != root
+        || !(fs_pool_table(root->pool) || cache_budget || journaling)){
+        return;
+    }
+    if (rebind_table(root, master_file_table) == -1){
+        debug(__func__, "changed directories stay in memory, failed to use the new table", "");
+        return;
+    }
+    // The journal no longer repeats the blocks of the tree, so the block allocation table must have them
+    if (journaling && sync_block_allocation_table() == -1){
+        debug(__func__, "failed to write the block allocation table, the journal is kept", "");
+        return;
+    }
+    if (journaling && attach_journal(fs_pool_table(root->pool), root->pool, master_file_table, 1) == -1){
+        debug(__func__, "failed to start the journal of", master_file_table);
+    }
+}
+
+void save_inodes(const char *master_file_table, struct inode *root)
+{
+    if (!root){
+        save_tree(master_file_table, root);
+        return;
+    }
+    lock_tree(root, 1);
+    save_tree(master_file_table, root);
+    unlock_tree(root);
+}
+
+/*
+Reads the legacy record that starts at *pos and moves *pos past it.
+
+@return 0 on success, -1 if the table ends inside the record
+*/
+static int read_legacy_record(char *bytes, size_t size, size_t *pos, struct mft_view *v) {
+    size_t p = *pos;
+
+    if (size - p < 2 * sizeof(uint32_t))
+        return -1;
+    memcpy(&v->id, bytes + p, sizeof(uint32_t));
+    memcpy(&v->name_length, bytes + p + sizeof(uint32_t), sizeof(uint32_t));
+    p += 2 * sizeof(uint32_t);
+
+    if (size - p < (size_t) v->name_length + 2)
+        return -1;
+    v->name = bytes + p;
+    p += v->name_length;
+    v->is_directory = bytes[p++];
+    v->is_readonly = bytes[p++];
+    v->is_inline = 0;
+
+    if (size - p < (v->is_directory ? 1 : 2) * sizeof(uint32_t))
+        return -1;
+    v->filesize = 0;
+    if (!v->is_directory) {
+        memcpy(&v->filesize, bytes + p, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+    }
+    memcpy(&v->num_entries, bytes + p, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+
+    // Both 64-bit child ids and extents take 8 bytes per entry
+    if ((size - p) / sizeof(uint64_t) < v->num_entries)
+        return -1;
+    v->entries = bytes + p;
+    *pos = p + (size_t) v->num_entries * sizeof(uint64_t);
+    return 0;
+}
+
+/*
+Finds the record of the inode with the given id.
+
+@return 0 on success, -1 if the table has no such inode or its record is damaged
+*/
+static int find_record(const struct mft_source *src, uint64_t id, struct mft_view *v) {
+    if (src->header) {
+        const struct mft_header *h = src->header;
+        struct mft_record *record = id <= UINT32_MAX ? mft_find(src->bytes, h, id) : NULL;
+        if (!record || mft_record_check(src->bytes, h, record) == -1)
+            return -1;
+        v->id = record->id;
+        v->name_length = record->name_length;
+        v->filesize = record->filesize;
+        v->num_entries = record->num_entries;
+        v->is_directory = record->is_directory;
+        v->is_readonly = record->is_readonly;
+        v->is_inline = record->is_inline && !record->is_directory && record->filesize > 0;
+        v->name = src->bytes + h->strings_offset + record->name_offset;
+        v->entries = src->bytes + h->entries_offset + record->entries_offset;
+        return 0;
+    }
+
+    if (id >= src->num_offsets || src->offsets[id] == 0)
+        return -1;
+    size_t pos = src->offsets[id] - 1;
+    return read_legacy_record(src->bytes, src->size, &pos, v);
+}
+
+/*
+Returns the entries of a record, in place where the alignment allows it and copied into the pool
+otherwise. The entries of a directory are the 64-bit ids of its children.
+
+@return the entries, or NULL if the record has none or memory could not be allocated
+*/
+static uintptr_t *entries_from_record(struct fs_pool *pool, const struct mft_view *v) {
+    uintptr_t *entries = NULL;
+    if (v->is_inline) {
+        // Copied, since fs_write changes them
+        entries = fs_pool_alloc(pool, v->filesize);
+        if (!entries) {
+            debug(__func__, "failed to allocate memory for inline bytes", "");
+            return NULL;
+        }
+        memcpy(entries, v->entries, v->filesize);
+    } else if (v->num_entries > 0) {
+        size_t align = v->is_directory ? _Alignof(uintptr_t) : _Alignof(struct Extent);
+        int in_place = (uintptr_t) v->entries % align == 0
+                       && (!v->is_directory || sizeof(uintptr_t) == sizeof(uint64_t));
+        if (in_place) {
+            entries = (uintptr_t *) v->entries;
+        } else if (v->is_directory) {
+            entries = fs_pool_alloc(pool, v->num_entries * sizeof(uintptr_t));
+            if (!entries) {
+                debug(__func__, "failed to allocate memory for entries", "");
+                return NULL;
+            }
+            for (uint32_t i = 0; i < v->num_entries; i++) {
+                uint64_t child_id;
+                memcpy(&child_id, v->entries + i * sizeof(uint64_t), sizeof(uint64_t));
+                entries[i] = (uintptr_t) child_id;
+            }
+        } else {
+            entries = fs_pool_alloc(pool, v->num_entries * sizeof(struct Extent));
+            if (!entries) {
+                debug(__func__, "failed to allocate memory for entries", "");
+                return NULL;
+            }
+            memcpy(entries, v->entries, v->num_entries * sizeof(struct Extent));
+        }
+    }
+    return entries;
+}
+
+/*
+Creates the inode of a record. Names and entries are used in place where the alignment allows it,
+and copied into the pool otherwise. The entries of a directory are still the 64-bit ids of its
+children, and the directory is marked as unloaded until load_directory turns them into pointers.
+
+@return the new inode, or NULL if memory could not be allocated
+*/
+static struct inode *inode_from_record(struct fs_pool *pool, const struct mft_view *v) {
+    char *name = v->name;
+
+    // Names are used in place when they carry their '\0', as they should
+    if (v->name_length == 0 || name[v->name_length - 1] != '\0') {
+        name = fs_pool_alloc(pool, (size_t) v->name_length + 1);
+        if (!name) {
+            debug(__func__, "failed to allocate memory for name", "");
+            return NULL;
+        }
+        memcpy(name, v->name, v->name_length);
+        name[v->name_length] = '\0';
+    }
+
+    uintptr_t *entries = entries_from_record(pool, v);
+    if (!entries && (v->num_entries > 0 || v->is_inline))
+        return NULL;
+
+    debug(__func__, "loading inode", name);
+    struct inode *node = create_inode(pool, v->id, name, v->is_directory, v->is_readonly,
+                                      v->filesize, v->num_entries, entries);
+    if (node && v->is_directory && v->num_entries > 0)
+        node->unloaded = 1;
+    if (node && v->is_inline)
+        node->is_inline = 1;
+    return node;
+}
+
+/*
+The body of load_directory, called with dir locked for writing in thread-safe mode. Lookups that only
+hold a read lock call it for loaded directories, so then it changes nothing.
+*/
+static int load_entries(struct inode *dir) {
+    struct mft_source *src = fs_pool_table(dir->pool);
+    if (!dir->unloaded) {
+        if (src && dir->is_directory && !thread_safe) {
+            dir->referenced = 1;
+            cache_stats.hits++;
+        }
+        return 0;
+    }
+    cache_stats.misses++;
+
+    // With a budget the pointers go into the pool, where eviction can free them again. In place
+    // they would turn the pages of the table into private memory for good.
+    if (cache_budget) {
+        uintptr_t *entries = fs_pool_alloc(dir->pool, entries_size(dir, dir->num_entries));
+        if (entries) {
+            memcpy(entries, dir->entries, entries_size(dir, dir->num_entries));
+            fs_pool_free(dir->pool, dir->entries, entries_size(dir, dir->num_entries));
+            dir->entries = entries;
+        }
+    }
+
+    for (uint32_t j = 0; j < dir->num_entries; j++) {
+        struct mft_view v;
+        struct inode *child = NULL;
+        if (find_record(src, dir->entries[j], &v) == 0)
+            child = inode_from_record(dir->pool, &v);
+        if (!child) {
+            // Keep the children that could be created, the directory cannot stay half loaded.
+            // It no longer matches the table, so it must not be evicted and loaded again.
+            debug(__func__, "directory refers to a missing or damaged inode:", dir->name);
+            dir->num_entries = j;
+            dir->unloaded = 0;
+            dir->dirty = 1;
+            clock_add(src, dir);
+            return -1;
+        }
+        dir->entries[j] = (uintptr_t) child;
+    }
+    dir->unloaded = 0;
+    dir->referenced = 1;
+    if (clock_add(src, dir) == -1) {
+        // Without a slot in the ring it is never evicted, which is safe
+        debug(__func__, "failed to allocate memory for the inode cache", "");
+    }
+
+    // The caller is about to use the children, so they must survive the eviction they caused
+    dir->pins++;
+    evict_to_budget(src);
+    dir->pins--;
+    return 0;
+}
+
+int load_directory(struct inode *dir) {
+    if (!dir)
+        return 0;
+    lock_tree(dir, 0);
+    lock_dir(dir, 1);
+    int result = load_entries(dir);
+    unlock_dir(dir);
+    unlock_tree(dir);
+    return result;
+}
+
+/*
+Loads every directory below node.
+
+@return 0 on success, -1 if any directory could not be loaded
+*/
+static int load_subtree(struct inode *node) {
+    if (!node->is_directory)
+        return 0;
+    int result = load_entries(node);
+    for (uint32_t i = 0; i < node->num_entries; i++) {
+        if (load_subtree((struct inode *) node->entries[i]) == -1)
+            result = -1;
+    }
+    return result;
+}
+
+// The part of a table that one thread of load_parallel works on
+struct load_worker {
+    pthread_t thread;
+    const struct mft_source *src;
+    struct inode **nodes;               // by id, shared by all workers
+    atomic_uchar *claimed;              // by id, set when a directory refers to the inode
+    uint32_t num_ids;
+    struct fs_pool *tree_pool;
+    struct fs_pool *pool;               // arena of the thread, merged into tree_pool at the end
+    uint32_t first, last;               // range of ids
+    uint64_t created;
+    int failed;
+};
+
+/*
+First pass of the parallel loader: creates the inodes of all ids in the range of the worker in its own
+arena. The entries of directories are still ids.
+*/
+static void *parse_records(void *arg) {
+    struct load_worker *w = arg;
+    w->pool = fs_pool_create();
+    if (!w->pool) {
+        w->failed = 1;
+        return NULL;
+    }
+    for (uint32_t id = w->first; id < w->last; id++) {
+        struct mft_view v;
+        if (find_record(w->src, id, &v) == -1)
+            continue;
+        struct inode *node = inode_from_record(w->pool, &v);
+        if (!node) {
+            w->failed = 1;
+            return NULL;
+        }
+        node->pool = w->tree_pool;
+        w->nodes[id] = node;
+        w->created++;
+    }
+    return NULL;
+}
+
+/*
+Second pass: checks that every child id of the directories in the range names an inode that no other
+directory refers to, so that the ids describe a tree. Nothing is changed yet, so that the serial loader
+can still read the table if this fails.
+*/
+static void *check_children(void *arg) {
+    struct load_worker *w = arg;
+    for (uint32_t id = w->first; id < w->last && !w->failed; id++) {
+        struct inode *dir = w->nodes[id];
+        if (!dir || !dir->unloaded)
+            continue;
+        for (uint32_t j = 0; j < dir->num_entries; j++) {
+            uintptr_t child = dir->entries[j];
+            if (child == 0 || child >= w->num_ids || !w->nodes[child]
+                || atomic_exchange(&w->claimed[child], 1)) {
+                w->failed = 1;
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+Third pass: turns the child ids of the directories in the range into pointers.
+*/
+static void *link_children(void *arg) {
+    struct load_worker *w = arg;
+    for (uint32_t id = w->first; id < w->last; id++) {
+        struct inode *dir = w->nodes[id];
+        if (!dir || !dir->unloaded)
+            continue;
+        for (uint32_t j = 0; j < dir->num_entries; j++)
+            dir->entries[j] = (uintptr_t) w->nodes[dir->entries[j]];
+        dir->unloaded = 0;
+    }
+    return NULL;
+}
+
+/*
+Releases an inode that is not in the tree, and the inodes below it.
+*/
+static void release_orphan(struct inode *node) {
+    if (node->is_directory && !node->unloaded) {
+        for (uint32_t i = 0; i < node->num_entries; i++)
+            release_orphan((struct inode *) node->entries[i]);
+    }
+    release_node(node);
+}
+
+/*
+Runs one pass on all workers, the first one on the calling thread.
+
+@return 0 if the pass succeeded on every worker, -1 if not
+*/
+static int run_workers(struct load_worker *workers, int count, void *(*pass)(void *)) {
+    int started = 1;
+    for (; started < count; started++) {
+        if (pthread_create(&workers[started].thread, NULL, pass, &workers[started]) != 0)
+            break;
+    }
+    // Ranges whose thread could not be started are done here
+    for (int i = started; i < count; i++)
+        pass(&workers[i]);
+    pass(&workers[0]);
+
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        if (i > 0 && i < started)
+            pthread_join(workers[i].thread, NULL);
+        if (workers[i].failed)
+            result = -1;
+    }
+    return result;
+}
+
+/*
+Loads the whole tree of a table with several threads. Every thread creates the inodes of a range of ids
+in an arena of its own, then the child ids are checked and turned into pointers in parallel as well. The
+result is the same tree that load_subtree builds from the root.
+
+@param count number of threads
+@return the root, or NULL if the table is damaged or memory ran out; the tree pool is then unchanged and
+        the serial loader can try the table again
+*/
+static struct inode *load_parallel(struct fs_pool *pool, struct mft_source *src, uint32_t max_id,
+                                   int count) {
+    uint32_t num_ids = max_id + 1;
+    struct inode **nodes = calloc(num_ids, sizeof(struct inode *));
+    atomic_uchar *claimed = calloc(num_ids, sizeof(atomic_uchar));
+    struct load_worker *workers = calloc(count, sizeof(struct load_worker));
+    if (!nodes || !claimed || !workers) {
+        free(nodes);
+        free(claimed);
+        free(workers);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; i++) {
+        workers[i].src = src;
+        workers[i].nodes = nodes;
+        workers[i].claimed = claimed;
+        workers[i].num_ids = num_ids;
+        workers[i].tree_pool = pool;
+        workers[i].first = (uint64_t) num_ids * i / count;
+        workers[i].last = (uint64_t) num_ids * (i + 1) / count;
+    }
+
+    struct inode *root = NULL;
+    if (run_workers(workers, count, parse_records) == 0 && nodes[0]
+        && run_workers(workers, count, check_children) == 0) {
+        run_workers(workers, count, link_children);
+        root = nodes[0];
     }
-    // Add a pointer to the new dir from parent dir
-    parent->entries[parent->num_entries - 1] = (uintptr_t) node;
 
-    debug(__func__, "created directory: ", name);
-    return node;
+    if (!root) {
+        for (int i = 0; i < count; i++)
+            fs_pool_destroy(workers[i].pool);
+    } else {
+        uint64_t created = 0;
+        for (int i = 0; i < count; i++) {
+            fs_pool_merge(pool, workers[i].pool);
+            created += workers[i].created;
+        }
+        src->resident += created;
+        cache_stats.resident += created;
 
+        // Records that no directory refers to are not part of the tree, nor is anything below them
+        for (uint32_t id = 1; id < num_ids; id++) {
+            if (nodes[id] && !claimed[id])
+                release_orphan(nodes[id]);
+        }
+    }
+    free(nodes);
+    free(claimed);
+    free(workers);
+    return root;
 }
 
+/*
+Scans a legacy table once, only reading the lengths of the records, and notes where the record of
+every id starts. This is the index that version 2 tables already carry.
 
+@return 0 on success, -1 if the table is damaged or memory ran out
+*/
+static int scan_legacy(struct fs_pool *pool, struct mft_source *src, uint32_t *max_id) {
+    size_t pos = 0;
+    uint32_t capacity = src->offsets_capacity;
+
+    while (pos < src->size) {
+        struct mft_view v;
+        size_t start = pos;
+        if (read_legacy_record(src->bytes, src->size, &pos, &v) == -1) {
+            debug(__func__, "master file table ends inside a record", "");
+            return -1;
+        }
 
-struct inode *find_inode_by_name(struct inode *parent, const char *name)
-{
-
-    if (!parent)
-    {
-        return NULL;
-    }
-    if (!(parent->is_directory))
-    {
-        return NULL;
+        if (v.id >= capacity) {
+            uint64_t grown_capacity = capacity ? capacity : 64;
+            while (grown_capacity <= v.id)
+                grown_capacity *= 2;
+            uint64_t *grown = fs_pool_realloc(pool, src->offsets, capacity * sizeof(uint64_t),
+                                              grown_capacity * sizeof(uint64_t));
+            if (!grown) {
+                debug(__func__, "failed to allocate memory for record offsets", "");
+                return -1;
+            }
+            memset(grown + capacity, 0, (grown_capacity - capacity) * sizeof(uint64_t));
+            src->offsets = grown;
+            capacity = grown_capacity;
+            src->offsets_capacity = capacity;
+        }
+        if (v.id >= src->num_offsets)
+            src->num_offsets = v.id + 1;
+        src->offsets[v.id] = start + 1;
+        if (v.id > *max_id)
+            *max_id = v.id;
     }
+    return 0;
+}
 
-    for (int i = 0; i < parent->num_entries; i++)
-    {
-        struct inode *child = (struct inode *)parent->entries[i];
-        if (strcmp(child->name, name) == 0)
-        {
-            //fprintf(stderr, "name:%s\nchild name:%s\n", child->name, name);
-            return child;
+/*
+Reads everything that is left in fd into one malloc'd buffer, for tables that cannot be mapped.
+
+@param fd file to read
+@param size receives the number of bytes read
+@return the buffer, or NULL on error or if nothing was read
+*/
+static char *read_whole_file(int fd, size_t *size) {
+    size_t capacity = 64 * 1024;
+    size_t done = 0;
+    char *bytes = malloc(capacity);
+
+    while (bytes) {
+        if (done == capacity) {
+            char *grown = realloc(bytes, capacity * 2);
+            if (!grown)
+                break;
+            bytes = grown;
+            capacity *= 2;
         }
+        ssize_t n = read(fd, bytes + done, capacity - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            break;
+        }
+        if (n == 0) {
+            if (done == 0)
+                break;
+            *size = done;
+            return bytes;
+        }
+        done += n;
     }
-
-    // fprintf(stderr, "%s is not implemented\n", __FUNCTION__);
+    free(bytes);
     return NULL;
 }
 
-int delete_file(struct inode* parent, struct inode* node)
-{
-    
-    if (!parent) {
-        debug(__func__, "aborting file deletion: parent pointer was null", "");
+/*
+Maps or reads a master file table, hands its bytes to the pool, and fills in where its records are in
+src. The bytes stay in the pool even if the table turns out to be damaged.
+
+@param max_id receives the largest id in the table
+@return 0 on success, -1 on error
+*/
+static int open_table(struct fs_pool *pool, const char *master_file_table, struct mft_source *src,
+                      uint32_t *max_id) {
+    int fd = open(master_file_table, O_RDONLY);
+    if (fd == -1) {
+        debug(__func__, "failed to open file:", master_file_table);
         return -1;
     }
-    if (!node) {
-        debug(__func__, "aborting file deletion: file is null", "");
-        return -1;
+
+    // A private mapping, so that ids can become pointers in place without touching the file
+    struct stat st;
+    size_t size = 0;
+    char *bytes = MAP_FAILED;
+    int mapped = 1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size = st.st_size;
+        bytes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
     }
-    if (node->is_directory) {
-        debug(__func__, "aborting file deletion: node is a directory", node->name);
-        return -1;
+    if (bytes != MAP_FAILED) {
+        // A lazy load only touches the records it needs, so it should not map their neighbours too
+        madvise(bytes, size, lazy_loading || cache_budget ? MADV_RANDOM : MADV_WILLNEED);
+    } else {
+        // Pipes and other files that cannot be mapped are read in one go
+        bytes = read_whole_file(fd, &size);
+        mapped = 0;
     }
-    if (!parent->is_directory) {
-        debug(__func__, "aborting file deletion: parent is not a directory", "");
+    close(fd);
+    if (!bytes) {
+        debug(__func__, "failed to read file:", master_file_table);
         return -1;
     }
-
-    int file_index = -1;
-    for (int i = 0; i < parent->num_entries; i++) {
-        if ((uintptr_t)node == parent->entries[i]) {
-            file_index = i;
-            break;
-        }
-    }
-    
-    if (file_index == -1) {
-        debug(__func__, "aborting file deletion: file not found in parent directory", "");
+    if (fs_pool_attach(pool, bytes, size, mapped) == -1) {
+        debug(__func__, "failed to allocate memory pool", "");
+        if (mapped)
+            munmap(bytes, size);
+        else
+            free(bytes);
         return -1;
     }
 
-    
-    for (int i = 0; i < node->num_entries; i++) {
-        int result = free_block(node->entries[i]);
-        if (result == -1) {
-            debug(__func__, "warning: failed to free block", "");
+    src->bytes = bytes;
+    src->size = size;
+
+    // Version 2 tables carry their own index, legacy tables are scanned for one
+    *max_id = 0;
+    if (mft_is_v2(bytes, size)) {
+        src->header = mft_check(bytes, size);
+        if (!src->header) {
+            debug(__func__, "master file table has a damaged header", "");
             return -1;
         }
+        *max_id = src->header->max_id;
+        return 0;
     }
+    return scan_legacy(pool, src, max_id);
+}
 
-    for (int i = file_index; i < parent->num_entries - 1; i++){
-        parent->entries[i] = parent->entries[i + 1];
-    }
-    --parent->num_entries;
-    
-    free_node(node);
-
-    uintptr_t *new_entries = realloc(parent->entries, parent->num_entries * sizeof(uintptr_t));
-    if (!new_entries){
-        debug(__func__, "failed to reallocate memory for entry array", "");
-        //free(new_entries);
-        return -1;
-    }
-    parent->entries = new_entries;
+/*
+Makes the loaded directories below node clean members of the ring of src, and counts the inodes.
 
-    debug(__func__, "file deleted successfully", "");
-    return 0;
+@return the number of inodes below node and node itself
+*/
+static uint64_t adopt_subtree(struct mft_source *src, struct inode *node) {
+    uint64_t count = 1;
+    node->dirty = 0;
+    if (!node->is_directory || node->unloaded)
+        return count;
+    if (node->num_entries > 0 && clock_add(src, node) == -1)
+        debug(__func__, "failed to allocate memory for the inode cache", "");
+    for (uint32_t i = 0; i < node->num_entries; i++)
+        count += adopt_subtree(src, (struct inode *) node->entries[i]);
+    return count;
 }
 
-int delete_dir( struct inode* parent, struct inode* node )
-{
-    
-    if (!node){
-        debug(__func__, "aborting dir deletion: node was null", "");
-        return -1;
-    }
-    // Check if the dir is root, in that case delete it
-    if (!parent){
-        free_node(node);
-        debug(__func__, "freeing root directory", "");
-        return 0;
-    }
+/*
+Copies the names and entries below node that still point into the table of size bytes at old into the
+pool, so that the table can be released.
 
-    if (!node->is_directory) {
-        debug(__func__, "aborting dir deletion: node is a directory", node->name);
-        return -1;
+@return 0 on success, -1 if memory ran out; what could not be copied still points into the table
+*/
+static int copy_from_table(struct fs_pool *pool, struct inode *node, const char *old, size_t size) {
+    if (node->name >= old && node->name < old + size) {
+        char *name = fs_pool_strdup(pool, node->name);
+        if (!name)
+            return -1;
+        node->name = name;
     }
-    if (!parent->is_directory) {
-        debug(__func__, "aborting dir deletion: parent is not a directory", "");
-        return -1;
+    const char *entries = (const char *) node->entries;
+    if (entries && entries >= old && entries < old + size) {
+        size_t bytes = entries_size(node, node->num_entries);
+        uintptr_t *copy = fs_pool_alloc(pool, bytes);
+        if (!copy)
+            return -1;
+        memcpy(copy, entries, bytes);
+        node->entries = copy;
     }
-    
-    int dir_index = -1;
-    for (int i = 0; i < parent->num_entries; i++) {
-        if ((uintptr_t)node == parent->entries[i]) {
-            dir_index = i;
-            break;
-        }
+    if (node->is_directory && !node->unloaded) {
+        for (uint32_t i = 0; i < node->num_entries; i++)
+            if (copy_from_table(pool, (struct inode *) node->entries[i], old, size) == -1)
+                return -1;
     }
-    
-    if (dir_index == -1) {
-        debug(__func__, "aborting dir deletion: directory not found in parent", "");
+    return 0;
+}
+
+/*
+Makes the table that the whole tree below root was just saved to the one that its directories are
+loaded from after an eviction. Names and entries that are still used in place in the old table are
+copied into the pool, and the old table is released, so that a tree that is saved again and again
+keeps only one table.
+
+@return 0 on success, -1 on error, in which case the tree still uses the old table
+*/
+static int rebind_table(struct inode *root, const char *master_file_table) {
+    struct fs_pool *pool = root->pool;
+    struct mft_source *src = fs_pool_table(pool);
+    struct mft_source fresh;
+    memset(&fresh, 0, sizeof(struct mft_source));
+
+    uint32_t max_id;
+    if (open_table(pool, master_file_table, &fresh, &max_id) == -1) {
+        fs_pool_free(pool, fresh.offsets, fresh.offsets_capacity * sizeof(uint64_t));
         return -1;
     }
 
-    // Loop over all entries and call delete_file or delete_dir
-    for (uint32_t i = 0; i < node->num_entries; i++){
-        // Delete all files from a directory before calling delete_dir recursively to delete any files in subdirectories etc.
-        uintptr_t child = node->entries[i];
-        if (!((struct inode*) child)->is_directory){
-            delete_file(node, (struct inode*) child);
-        }else{
-            delete_dir(node, (struct inode*) child);
+    if (!src) {
+        // A tree that was created in memory is counted from now on
+        src = fs_pool_alloc(pool, sizeof(struct mft_source));
+        if (!src) {
+            fs_pool_free(pool, fresh.offsets, fresh.offsets_capacity * sizeof(uint64_t));
+            return -1;
         }
+        memset(src, 0, sizeof(struct mft_source));
+        fs_pool_set_table(pool, src);
     }
-    
-
-    for (int i = dir_index; i < parent->num_entries - 1; i++) {
-        parent->entries[i] = parent->entries[i + 1];
+    fs_pool_free(pool, src->offsets, src->offsets_capacity * sizeof(uint64_t));
+    char *old_bytes = src->bytes;
+    size_t old_size = src->size;
+    src->bytes = fresh.bytes;
+    src->size = fresh.size;
+    src->header = fresh.header;
+    src->offsets = fresh.offsets;
+    src->num_offsets = fresh.num_offsets;
+    src->offsets_capacity = fresh.offsets_capacity;
+
+    cache_stats.resident -= src->resident;
+    src->resident = adopt_subtree(src, root);
+    cache_stats.resident += src->resident;
+
+    if (old_bytes) {
+        if (copy_from_table(pool, root, old_bytes, old_size) == 0)
+            fs_pool_detach(pool, old_bytes);
+        else
+            debug(__func__, "the old table stays in memory, failed to copy names out of it", "");
     }
-    --parent->num_entries;
-
 
-    free(node->entries);
-    free(node->name);
-    free(node);
-
-    
-    if (parent->num_entries > 0) {
-        uintptr_t* new_entries = realloc(parent->entries, parent->num_entries * sizeof(uintptr_t));
-        if (new_entries) {
-            parent->entries = new_entries;
-        }
-    } else {
-        free(parent->entries);
-        parent->entries = NULL;
-    }
+    evict_to_budget(src);
     return 0;
 }
 
-
 /*
-Function genreted by ChatGPT to dump the content of a binary file, used for debugging.
+Opens the journal next to a table for the tree of src. A journal of another table is closed first.
 
-@param filename the name of the file to be dumped
+@param truncate 1 to drop the records in the journal, after the table was written
+@return 0 on success, -1 on error, in which case the tree has no journal
 */
-void hexdump(const char* filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        perror("Feil ved åpning av fil for hexdump");
-        return;
-    }
-
-    printf("\n=== Hexdump av %s ===\n", filename);
-    unsigned char buffer[16];  // Leser 16 bytes av gangen
-    size_t bytesRead;
-    size_t offset = 0; // For å vise posisjon i filen
+static int attach_journal(struct mft_source *src, struct fs_pool *pool, const char *master_file_table,
+                          int truncate) {
+    if (src->journal && strcmp(src->journal_table, master_file_table) == 0)
+        return truncate ? journal_reset(src->journal) : 0;
+
+    journal_close(src->journal);
+    src->journal = NULL;
+    fs_pool_free(pool, src->journal_table, src->journal_table ? strlen(src->journal_table) + 1 : 0);
+    src->journal_table = fs_pool_strdup(pool, master_file_table);
+    if (!src->journal_table)
+        return -1;
 
-    while ((bytesRead = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        printf("%08zx  ", offset); // Utskrift av offset i hex
+    size_t length = strlen(master_file_table);
+    char *path = malloc(length + sizeof(".journal"));
+    if (!path)
+        return -1;
+    memcpy(path, master_file_table, length);
+    memcpy(path + length, ".journal", sizeof(".journal"));
+    src->journal = journal_open(path, truncate);
+    free(path);
+    return src->journal ? 0 : -1;
+}
 
-        // Skriv ut hex-verdier
-        for (size_t i = 0; i < bytesRead; i++) {
-            printf("%02x ", buffer[i]);
-            if (i == 7) printf(" "); // Ekstra mellomrom midt i linjen
-        }
+// The inodes of a tree by id, while its journal is replayed
+struct replay {
+    struct inode **nodes;
+    uint32_t size;
+};
 
-        // Fyll inn mellomrom hvis det er færre enn 16 bytes lest
-        for (size_t i = bytesRead; i < 16; i++) {
-            printf("   ");
-            if (i == 7) printf(" ");
-        }
+/*
+Returns the inode with the given id, or NULL.
+*/
+static struct inode *replay_find(const struct replay *r, uint32_t id) {
+    return id < r->size ? r->nodes[id] : NULL;
+}
 
-        // Skriv ut ASCII-tegnene ved siden av
-        printf(" |");
-        for (size_t i = 0; i < bytesRead; i++) {
-            printf("%c", (buffer[i] >= 32 && buffer[i] <= 126) ? buffer[i] : '.');
-        }
-        printf("|\n");
+/*
+Remembers the inode of an id.
 
-        offset += bytesRead;
+@return 0 on success, -1 if memory could not be allocated
+*/
+static int replay_set(struct replay *r, uint32_t id, struct inode *node) {
+    if (id >= r->size) {
+        uint64_t size = r->size ? r->size : 64;
+        while (size <= id)
+            size *= 2;
+        struct inode **grown = realloc(r->nodes, size * sizeof(struct inode *));
+        if (!grown)
+            return -1;
+        memset(grown + r->size, 0, (size - r->size) * sizeof(struct inode *));
+        r->nodes = grown;
+        r->size = size;
     }
+    r->nodes[id] = node;
+    return 0;
+}
 
-    fclose(file);
+/*
+Remembers the ids of node and the inodes below it, which must all be loaded.
+
+@return 0 on success, -1 if memory could not be allocated
+*/
+static int replay_add_subtree(struct replay *r, struct inode *node) {
+    if (replay_set(r, node->id, node) == -1)
+        return -1;
+    if (node->is_directory) {
+        for (uint32_t i = 0; i < node->num_entries; i++) {
+            if (replay_add_subtree(r, (struct inode *) node->entries[i]) == -1)
+                return -1;
+        }
+    }
+    return 0;
 }
 
+/*
+Marks the blocks of the extents of a replayed file as used or free in the block allocation table, which
+only has them if it was written after the change that the record repeats.
+*/
+static void replay_blocks(const struct inode *node, int used) {
+    if (node->is_directory || node->is_inline)
+        return;
+    const struct Extent *extents = (const struct Extent *) node->entries;
+    for (uint32_t i = 0; i < node->num_entries; i++) {
+        if (extents[i].blockno != EXTENT_HOLE && mark_extent(extents[i].blockno, extents[i].extent, used) == -1)
+            debug(__func__, "failed to mark the blocks of replayed file", node->name);
+    }
+}
 
 /*
-Helper function to recursively write inode properties to file in order.
+Applies a record of the changed data of a file: the bytes of an inline file, or the extents of a file that
+got new blocks, which replace its old extents and any reservation and are marked as used. A file that was
+deleted later in the journal is gone already, and its record is skipped.
+*/
+static void replay_change(struct inode *node, const struct journal_record *record, const void *entries) {
+    if (!node || node->is_directory)
+        return;
+    if (record->flags & JOURNAL_INLINE) {
+        if (!node->is_inline || record->num_entries * sizeof(struct Extent) < node->filesize)
+            return;
+        memcpy(node->entries, entries, node->filesize);
+        node->dirty = 1;
+        return;
+    }
+    if (node->is_inline)
+        return;
 
-@param file Master File Table (MFT) to be written
-@param node reference to node which contents should be written to the MFT
- */
-void _save_inodes_rec(FILE *file, struct inode* node){
-    if (!node){
-        debug(__func__, "failed to write to file: node was null", "");
+    size_t size = record->num_entries * sizeof(struct Extent);
+    uintptr_t *extents = size > 0 ? fs_pool_alloc(node->pool, size) : NULL;
+    if (!extents && size > 0) {
+        debug(__func__, "failed to allocate memory for replayed extents of", node->name);
         return;
     }
+    if (size > 0)
+        memcpy(extents, entries, size);
+    forget_reservation(node);
+    fs_pool_free(node->pool, node->entries, node->num_entries * sizeof(struct Extent));
+    node->entries = extents;
+    node->num_entries = record->num_entries;
+    node->dirty = 1;
+    replay_blocks(node, 1);
+}
 
-    fwrite(&node->id, sizeof(uint32_t), 1, file);
-    // + 1 for null terminator '\0'
-    uint32_t name_length = strlen(node->name) + 1;
-    fwrite(&name_length, sizeof(uint32_t), 1, file);
-
-    fwrite(node->name, sizeof(char), name_length, file);
-    debug(__func__, "wrote (name) to MFT:", node->name);
-
-    fwrite(&node->is_directory, sizeof(char), 1, file);
-    fwrite(&node->is_readonly, sizeof(char), 1, file);
-    fwrite(&node->filesize, sizeof(uint32_t), 1, file);
-    fwrite(&node->num_entries, sizeof(uint32_t), 1, file);
-
-    if (node->num_entries > 0){
-        if (node->is_directory) {
-            
-            uint32_t* child_ids = malloc(node->num_entries * sizeof(uint32_t));
-            if (!child_ids) {
-                debug(__func__, "failed to allocate memory for child IDs", "");
-                return;
-            }
-            
-            for (uint32_t i = 0; i < node->num_entries; i++) {
-                struct inode* child = (struct inode*)node->entries[i];
-                child_ids[i] = child->id;
-            }
-            
-            fwrite(child_ids, sizeof(uint32_t), node->num_entries, file);
-            free(child_ids);
-        } else {
-            
-            fwrite(node->entries, sizeof(uintptr_t), node->num_entries, file);
-        }
+/*
+Applies one record of a journal. The blocks of created and deleted files are marked as used and free in
+the block allocation table, since the table that was last written may not know them. A record that finds
+its work done, because the table was written after it, is skipped.
+*/
+static void replay_record(void *arg, const struct journal_record *record, const char *name,
+                          const void *entries) {
+    struct replay *r = arg;
+    struct inode *parent = replay_find(r, record->parent_id);
+    struct inode *node = replay_find(r, record->id);
+    if (record->op == JOURNAL_CHANGE_FILE) {
+        replay_change(node, record, entries);
+        return;
     }
+    if (!parent || !parent->is_directory)
+        return;
 
-    if (node->is_directory){
-        for (uint32_t i = 0; i < node->num_entries; i++){
-            _save_inodes_rec(file, (struct inode*) node->entries[i]);
+    if (record->op == JOURNAL_CREATE_FILE || record->op == JOURNAL_CREATE_DIR) {
+        if (node || !name || find_inode_by_name(parent, name))
+            return;
+        struct fs_pool *pool = parent->pool;
+        int is_directory = record->op == JOURNAL_CREATE_DIR;
+        uint32_t num_entries = is_directory ? 0 : record->num_entries;
+        size_t size = num_entries * sizeof(struct Extent);
+
+        char *copy = fs_pool_strdup(pool, name);
+        uintptr_t *extents = size > 0 ? fs_pool_alloc(pool, size) : NULL;
+        if (copy && (extents || size == 0))
+            node = create_inode(pool, record->id, copy, is_directory, record->is_readonly,
+                                is_directory ? 0 : record->filesize, num_entries, extents);
+        if (!node) {
+            debug(__func__, "failed to allocate memory for replayed inode", name);
+            fs_pool_free(pool, copy, copy ? strlen(copy) + 1 : 0);
+            fs_pool_free(pool, extents, size);
+            return;
+        }
+        if (size > 0)
+            memcpy(extents, entries, size);
+        if (add_entry(parent, node) == -1) {
+            debug(__func__, "failed to allocate memory for replayed inode", name);
+            release_node(node);
+            return;
         }
+        replay_blocks(node, 1);
+        // The bytes of an inline file follow in change records. A file that was created with
+        // delayed allocation and not saved since is pending again.
+        if (!is_directory && (record->flags & JOURNAL_INLINE) && record->filesize > 0)
+            store_inline(node);
+        else if (!is_directory && (record->flags & JOURNAL_RESERVED))
+            reserve_file_blocks(node, (record->filesize + BLOCKSIZE - 1) / BLOCKSIZE);
+        if (replay_set(r, record->id, node) == -1)
+            debug(__func__, "later records cannot find replayed inode", name);
+        reserve_ids(record->id);
+        return;
     }
 
+    if (record->op == JOURNAL_DELETE_FILE || record->op == JOURNAL_DELETE_DIR) {
+        int position = node ? entry_position(parent, node) : -1;
+        if (position == -1 || (node->is_directory && node->num_entries > 0))
+            return;
+        remove_entry(parent, position);
+        replay_set(r, record->id, NULL);
+        replay_blocks(node, 0);
+        release_node(node);
+    }
 }
 
-void save_inodes(const char *master_file_table, struct inode *root)
-{
-    if (DEBUG_MODE) hexdump(master_file_table);
-    FILE *file = fopen(master_file_table, "wb");
-    debug(__func__, "attempting to save to file:", master_file_table);
-    if (!file){
-        debug(__func__, "failed to open MFT file", "");
+/*
+Opens the journal of a freshly loaded tree and applies the changes in it. A journal with records needs
+the whole tree, so it is loaded first.
+*/
+static void replay_journal(struct inode *root, const char *master_file_table) {
+    struct mft_source *src = fs_pool_table(root->pool);
+    if (attach_journal(src, root->pool, master_file_table, 0) == -1) {
+        debug(__func__, "failed to open the journal of", master_file_table);
         return;
     }
-    _save_inodes_rec(file, root);
-    debug(__func__, "finish write to file:", master_file_table);
-    fclose(file);
-    if (DEBUG_MODE) hexdump(master_file_table);
+    if (journal_size(src->journal) == 0)
+        return;
+
+    struct replay r = { NULL, 0 };
+    evictions_paused++;
+    if (load_subtree(root) == -1 || replay_add_subtree(&r, root) == -1) {
+        debug(__func__, "failed to load the tree for the journal of", master_file_table);
+    } else if (journal_replay(src->journal, replay_record, &r) == -1) {
+        debug(__func__, "failed to read the journal of", master_file_table);
+    }
+    evictions_paused--;
+    free(r.nodes);
+    evict_to_budget(src);
 }
 
 struct inode *load_inodes(const char *master_file_table) {
-    FILE *file = fopen(master_file_table, "rb");
-
-    if (!file) {
-        debug(__func__, "failed to open file:", master_file_table);
+    struct fs_pool *pool = fs_pool_create();
+    struct mft_source *src = pool ? fs_pool_alloc(pool, sizeof(struct mft_source)) : NULL;
+    if (!src) {
+        debug(__func__, "failed to allocate memory pool", "");
+        fs_pool_destroy(pool);
+        return NULL;
+    }
+    memset(src, 0, sizeof(struct mft_source));
+    fs_pool_set_table(pool, src);
+    if (thread_safe)
+        fs_pool_share(pool);
+
+    uint32_t max_id;
+    if (open_table(pool, master_file_table, src, &max_id) == -1) {
+        fs_pool_destroy(pool);
         return NULL;
     }
 
-    struct inode *root = NULL;
-    struct inode **inode_map = NULL;
-    size_t inode_count = 0;
-
-    while (1) {
-        uint32_t id, name_length, filesize, num_entries;
-        char is_directory, is_readonly;
-        char *name;
-        uintptr_t *entries;
-
-        size_t bytesRead = fread(&id, sizeof(uint32_t), 1, file); 
-
-        if (bytesRead != 1) 
-            break;
-        if(id > MAX_ID)
-            MAX_ID = id;
-
-        fread(&name_length, sizeof(uint32_t), 1, file);
-        name = malloc(name_length);
-        if (!name){
-            debug(__func__, "failed to allocate memory for name", "");
-            //free(name);
-            return NULL;
-        }
-        fread(name, sizeof(char), name_length, file);
-        fread(&is_directory, sizeof(char), 1, file);
-        fread(&is_readonly, sizeof(char), 1, file);
-
-        if (!is_directory) {
-            fread(&filesize, sizeof(uint32_t), 1, file);
-        } else {
-            filesize = 0;
-        }
-
-        fread(&num_entries, sizeof(uint32_t), 1, file);
-        entries = malloc(num_entries * sizeof(uintptr_t));
-        if (!entries){
-            debug(__func__, "failed to allocate memory for entries", "");
-            free(name);
-            return NULL;
-        }
-        fread(entries, sizeof(uintptr_t), num_entries, file);
-
-        debug(__func__, "loading inode", name);
-        struct inode *node = create_inode(id,name,is_directory,is_readonly,filesize,num_entries,entries);
+    // New inodes continue after the largest id in the table
+    reserve_ids(max_id);
 
-        if (id >= inode_count) {
-            inode_map = realloc(inode_map, (id + 1) * sizeof(struct inode *));
-            if (!inode_map){
-                free(inode_map);
-                debug(__func__, "failed to allocate memory for inode map", "");
-                return NULL;
-            }
-            memset(inode_map + inode_count, 0, (id + 1 - inode_count) * sizeof(struct inode *));
-            inode_count = id + 1;
-        }
-        inode_map[id] = node;
+    // A whole table of many inodes is loaded by several threads, if there are processors for them
+    long threads = load_threads ? load_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t inodes = src->header ? src->header->inode_count : src->num_offsets;
+    if (threads > (long) (inodes / MIN_INODES_PER_THREAD))
+        threads = inodes / MIN_INODES_PER_THREAD;
+    if (threads > MAX_LOAD_THREADS)
+        threads = MAX_LOAD_THREADS;
 
-        if (id == 0) {
-            root = node;
+    struct mft_view v;
+    struct inode *root = NULL;
+    if (!lazy_loading && !cache_budget && threads > 1 && max_id < 4 * inodes) {
+        root = load_parallel(pool, src, max_id, threads);
+        if (root) {
+            fs_pool_set_root(pool, root);
+            if (journaling)
+                replay_journal(root, master_file_table);
+            return root;
         }
+        debug(__func__, "parallel load failed, loading on one thread", "");
     }
-
-    fclose(file);
-
-    for (size_t i = 0; i < inode_count; i++) {
-        struct inode *node = inode_map[i];
-        if (!node || !node->is_directory) continue;
-        for (size_t j = 0; j < node->num_entries; j++) {
-            node->entries[j] = (uintptr_t)inode_map[node->entries[j]];
-        }
+    if (find_record(src, 0, &v) == 0)
+        root = inode_from_record(pool, &v);
+    if (!root) {
+        debug(__func__, "master file table has no root inode", "");
+        fs_pool_destroy(pool);
+        return NULL;
     }
+    fs_pool_set_root(pool, root);
 
-    free(inode_map);
+    // In lazy mode directories are loaded when they are first used, and a budget needs lazy mode
+    if (!lazy_loading && !cache_budget && load_subtree(root) == -1) {
+        fs_shutdown(root);
+        return NULL;
+    }
+    if (journaling)
+        replay_journal(root, master_file_table);
     return root;
 }
 
@@ -632,7 +2905,15 @@ void fs_shutdown(struct inode* inode)
         return;
     }
 
-    if (inode->is_directory)
+    // A whole tree goes at once with its pool
+    if (fs_pool_root(inode->pool) == inode)
+    {
+        release_tree(inode);
+        return;
+    }
+
+    // Children that were never loaded have no memory of their own
+    if (inode->is_directory && !inode->unloaded)
     {
         for (uint32_t i = 0; i < inode->num_entries; i++)
         {
@@ -640,9 +2921,7 @@ void fs_shutdown(struct inode* inode)
         }
     }
 
-    free(inode->name);
-    free(inode->entries);
-    free(inode);
+    release_node(inode);
 }
 
 /* This static variable is used to change the indentation while 
@@ -650,18 +2929,21 @@ void fs_shutdown(struct inode* inode)
  */
 static int indent = 0;
 
-static void debug_fs_print_table( const char* table );
-static void debug_fs_tree_walk( struct inode* node, char* table );
+static void debug_fs_print_table( const char* table, uint32_t num_blocks );
+static void debug_fs_tree_walk( struct inode* node, char* table, uint32_t num_blocks );
 
 void debug_fs( struct inode* node )
 {
-    char* table = calloc( NUM_BLOCKS, 1 );
-    debug_fs_tree_walk( node, table );
-    debug_fs_print_table( table );
+    uint32_t num_blocks = get_num_blocks( );
+    char* table = calloc( num_blocks ? num_blocks : 1, 1 );
+    if( node ) lock_tree( node, 1 );
+    debug_fs_tree_walk( node, table, num_blocks );
+    if( node ) unlock_tree( node );
+    debug_fs_print_table( table, num_blocks );
     free( table );
 }
 
-static void debug_fs_tree_walk( struct inode* node, char* table )
+static void debug_fs_tree_walk( struct inode* node, char* table, uint32_t num_blocks )
 {
     if( node == NULL ) return;
     for( int i=0; i<indent; i++ )
@@ -670,10 +2952,11 @@ static void debug_fs_tree_walk( struct inode* node, char* table )
     {
         printf("%s (id %d)\n", node->name, node->id );
         indent++;
+        load_entries( node );
         for( int i=0; i<node->num_entries; i++ )
         {
             struct inode* child = (struct inode*)node->entries[i];
-            debug_fs_tree_walk( child, table );
+            debug_fs_tree_walk( child, table, num_blocks );
         }
         indent--;
     }
@@ -681,28 +2964,29 @@ static void debug_fs_tree_walk( struct inode* node, char* table )
     {
         printf("%s (id %d size %d)\n", node->name, node->id, node->filesize );
 
-        /* The following is an ugly solution. We expect you to discover a
-         * better way of handling extents in the node->entries array, and did
-         * it like this because we don't want to give away a good solution here.
-         */
-        // Handle entries as blocks allocated to the file
-        // Each entry represents a block number - mark it in the table
+        // Each entry is an extent - mark all of its blocks in the table
+        struct Extent* extents = (struct Extent*)node->entries;
         for( int i=0; i<node->num_entries; i++ )
         {
-            int blockno = (int)node->entries[i];
-            if (blockno >= 0 && blockno < NUM_BLOCKS) {
-                table[blockno] = 1;
+            if( extents[i].blockno == EXTENT_HOLE )
+                continue;
+            for( uint32_t j=0; j<extents[i].extent; j++ )
+            {
+                uint32_t blockno = extents[i].blockno + j;
+                if (blockno < num_blocks) {
+                    table[blockno] = 1;
+                }
             }
         }
     }
 }
 
-static void debug_fs_print_table( const char* table )
+static void debug_fs_print_table( const char* table, uint32_t num_blocks )
 {
     printf("Blocks recorded in master file table:");
-    for( int i=0; i<NUM_BLOCKS; i++ )
+    for( uint32_t i=0; i<num_blocks; i++ )
     {
-        if( i % 20 == 0 ) printf("\n%03d: ", i);
+        if( i % 20 == 0 ) printf("\n%03u: ", i);
         printf("%d", table[i] );
     }
     printf("\n\n");
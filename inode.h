@@ -5,17 +5,72 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 /*******************************************************************************
  * BEGIN: ADD YOUR OWN STRUCT AND MACROS BELOW HERE
  ******************************************************************************/
 
+/* A run of extent consecutive blocks on the simulated disk,
+ * starting at blockno. The entries of a file inode are an array
+ * of extents, and they are stored in the master file table in
+ * this layout.
+ * An extent with blockno EXTENT_HOLE is a hole of extent blocks
+ * of a sparse file, which have no blocks on the disk. The blocks
+ * of a file after its last extent are a hole as well.
+ */
 struct Extent
 {
     uint32_t blockno;
     uint32_t extent;
 };
 
+#define EXTENT_HOLE UINT32_MAX
+
+/* Hash index over the names in a large directory, see dir_index.h.
+ */
+struct dir_index;
+
+/* Entry of the path cache used by lookup_path, see path_cache.h.
+ */
+struct path_cache_entry;
+
+/* Memory pool of a tree of inodes, see fs_pool.h.
+ */
+struct fs_pool;
+
+/* Reader-writer lock of a directory, see set_thread_safe.
+ */
+struct dir_lock;
+
+/* A file opened for reading with readahead, see fs_open.
+ */
+struct fs_file;
+
+/* An open file that is read sequentially reads READAHEAD_MIN_BLOCKS
+ * blocks ahead at first, and twice as many with every window it
+ * finishes, up to READAHEAD_MAX_BLOCKS (1 MiB) unless
+ * set_readahead_window says otherwise.
+ */
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 256
+
+/* The largest file that set_inline_threshold can keep in its
+ * inode: one block.
+ */
+#define INLINE_DATA_MAX 4096
+
+/* Counters of the inode cache, see set_inode_cache_budget.
+ */
+struct inode_cache_stats
+{
+    uint64_t hits;           /* directory uses that found the children loaded */
+    uint64_t misses;         /* directory uses that loaded them from the table */
+    uint64_t evictions;      /* directories that gave their children back */
+    uint64_t evicted_inodes; /* inodes released by those evictions */
+    uint64_t resident;       /* inodes in memory in trees loaded from a table */
+};
+
 /*******************************************************************************
  * END: ADD YOUR OWN STRUCT AND MACROS ABOVE HERE
  ******************************************************************************/
@@ -26,7 +81,8 @@ struct Extent
  * that the dynamically allocated array entries
  * contains values that you must interpret as pointers
  * when is_directory==1 and that you must interpret
- * as block numbers when is_directory==0.
+ * as an array of num_entries struct Extent when
+ * is_directory==0.
  */
 struct inode
 {
@@ -34,16 +90,29 @@ struct inode
 	char*      name;
 	char       is_directory;
 	char       is_readonly;
+	char       is_inline; /* entries holds the filesize bytes of the file, see set_inline_threshold */
 	uint32_t   filesize;
 	uint32_t   num_entries;
 	uintptr_t* entries;
+	struct dir_index* index; /* NULL until the directory is large */
+	struct path_cache_entry* cached; /* path cache entries that resolve to this inode */
+	struct fs_pool* pool; /* owns the memory of this inode and its tree */
+	char       unloaded; /* entries are still child ids in the table, see load_directory */
+	char       dirty; /* changed since the tree was last loaded or saved */
+	char       referenced; /* used since the inode cache last looked at it */
+	uint32_t   pins; /* see pin_inode */
+	uint32_t   reserved; /* blocks reserved for a file that has no extents yet, see set_delayed_allocation */
+	uint32_t   clock_slot; /* position among the loaded directories of the tree */
+	struct dir_lock* lock; /* NULL unless the tree is thread-safe */
 };
 
 /* Create a file below the inode parent. Parent must
  * be a directory. The size of the file is size_in_bytes,
  * and create_file calls the allocate_block() function
- * enough number of times to reserve blocks in the simulated
- * disk to store all of these bytes.
+ * to reserve enough blocks in the simulated disk to store
+ * all of these bytes. The blocks are taken as a few long
+ * extents, the longest free runs first. After
+ * set_delayed_allocation(1) they are only reserved here.
  * Returns a pointer to file's inodes.
  */
 struct inode* create_file( struct inode* parent,
@@ -61,12 +130,15 @@ struct inode* create_dir( struct inode* parent, const char* name );
  * the node parent. If one of them has the name "name",
  * its inode pointer is returned.
  * parent must be directory.
+ * Directories with DIR_INDEX_THRESHOLD or more entries get a
+ * hash index on their first lookup, and are searched through it
+ * from then on.
  */
 struct inode* find_inode_by_name( struct inode* parent, const char* name );
 
 /* Delete the file given by its inode, if it is an inode
  * directly referenced by parent.
- * The function calls free_block for every block that is
+ * The function calls free_extent for every extent that is
  * referenced by this file. This removes those blocks from
  * simulate disk.
  */
@@ -81,13 +153,18 @@ int delete_dir( struct inode* parent, struct inode* node );
 
 /* Write the given inode root and all inodes referenced by it
  * to the master file table, following the oblig instructions.
+ * The table is written in version 2 of the format (see mft.h)
+ * unless set_master_file_table_version(1) was called.
+ * The table is written to a new file that replaces the old one,
+ * so a tree that was loaded from it can be saved back to it.
  * No inodes are changed.
  */
 void save_inodes( const char* master_file_table, struct inode* root );
 
 /* Read the file master file table and create an inode in memory
  * for every inode that is stored in the file. Set the pointers
- * between inodes correctly.
+ * between inodes correctly. Both version 2 tables and legacy
+ * tables without a header are read.
  * The file containing the master file table remains unchanged.
  */
 struct inode* load_inodes( const char* master_file_table );
@@ -101,6 +178,9 @@ struct inode* load_inodes( const char* master_file_table );
  *
  * This function can be used to end a program after
  * save_inodes and helps you to avoid valgrind errors.
+ * When node is the root of its tree, all inodes come from
+ * the same pool, and the pool is released at once without
+ * visiting them.
  */
 void fs_shutdown( struct inode* node );
 
@@ -115,6 +195,250 @@ void debug_fs( struct inode* node );
  * BEGIN: ADD YOUR OWN FUNCTION DECLARATIONS BELOW HERE
  ******************************************************************************/
 
+/* Resolve a path like "/etc/httpd/conf" below root, one name
+ * per component. Repeated slashes are ignored; "." and ".." have
+ * no special meaning.
+ * Results are remembered in a bounded cache, by (directory, name)
+ * and by full path and its prefixes, so resolving the same path
+ * again is a single hash probe. delete_file, delete_dir and
+ * fs_shutdown drop the cached entries of the inodes they free.
+ * Returns the inode, or NULL if the path does not exist.
+ */
+struct inode* lookup_path( struct inode* root, const char* path );
+
+/* Choose the format that save_inodes writes: 2 (the default) for
+ * the indexed format with a header, or 1 for the legacy stream of
+ * records that older programs read.
+ */
+void set_master_file_table_version( int version );
+
+/* With enable 1, load_inodes only creates the root, and every
+ * directory creates the inodes of its children the first time
+ * find_inode_by_name, create_*, delete_dir, save_inodes or a
+ * traversal like debug_fs needs them. Work and memory then grow
+ * with the part of the tree that is used. The default is 0,
+ * which loads the whole tree at once.
+ */
+void set_lazy_loading( int enable );
+
+/* Set the number of threads that load_inodes uses to load a
+ * whole table: the threads create the inodes of a range of ids
+ * each, then link the directories to their children. 1 loads on
+ * the calling thread, and 0 (the default) uses one thread per
+ * processor. Small tables, lazy loading and a cache budget always
+ * load on the calling thread. The tree is the same either way.
+ */
+void set_load_threads( int threads );
+
+/* Create the inodes of the children of dir if it was lazily loaded
+ * and they do not exist yet. Code that walks node->entries itself
+ * must call this first.
+ * Returns 0 on success and -1 if the table is damaged or memory
+ * ran out; the children that could be created are kept.
+ */
+int load_directory( struct inode* dir );
+
+/* With enable 1, a tree that load_inodes or save_inodes binds to
+ * a master file table logs every create_*, delete_file and
+ * delete_dir as a small record in the file
+ * master_file_table.journal, instead of waiting for the next
+ * save_inodes. load_inodes replays the journal over the table,
+ * and save_inodes to the table empties it. The default is 0.
+ * Records of new files hold their extents, and the replay marks
+ * those blocks as used in the block allocation table, and the
+ * blocks of deleted files as free, so the table need not have
+ * been written before the program stopped. save_inodes writes
+ * the table before it empties the journal.
+ */
+void set_journaling( int enable );
+
+/* When the journal of a tree grows past bytes, the next change
+ * saves the whole tree to its table, which empties the journal.
+ * The default is 4 MiB.
+ */
+void set_journal_threshold( size_t bytes );
+
+/* Limit the memory of the inodes of every tree that was loaded
+ * from a master file table to about bytes. When a directory is
+ * loaded and the tree is over its budget, the children of clean
+ * directories that were not used recently are released again
+ * (CLOCK order), and load_directory brings them back from the
+ * table when they are used next. A budget implies lazy loading.
+ * The default is 0, no limit.
+ *
+ * Directories that were changed by create_* or delete_* stay in
+ * memory until the next save_inodes of the tree, which makes the
+ * saved file the table they are loaded from from then on.
+ *
+ * With a budget, an inode pointer returned by find_inode_by_name
+ * or lookup_path stays valid until the next call that loads a
+ * directory, unless it is pinned.
+ */
+void set_inode_cache_budget( size_t bytes );
+
+/* Keep node, its parents and its children in memory until the
+ * matching unpin_inode, whatever the budget.
+ */
+void pin_inode( struct inode* node );
+void unpin_inode( struct inode* node );
+
+/* Copy the counters of the inode cache to stats. */
+void get_inode_cache_stats( struct inode_cache_stats* stats );
+
+/* With enable 1, the trees that are created or loaded from then
+ * on may be used by several threads at once. Call this before
+ * the first tree is created, and before other threads start.
+ *
+ * Every directory gets a reader-writer lock. find_inode_by_name
+ * and lookup_path only take read locks, one directory at a time,
+ * so any number of lookups run in parallel, in the same
+ * directory as well. create_*, delete_file and delete_dir take
+ * the lock of the parent for writing, so changes wait only for
+ * other users of the same directory. save_inodes and debug_fs
+ * wait until no other call uses the tree. Ids are taken
+ * atomically, and the block allocator locks itself.
+ *
+ * The inode cache budget is not enforced for such trees, since
+ * any inode may be in use by another thread; pin_inode has no
+ * meaning either. An inode must not be deleted while another
+ * thread still uses it, and fs_shutdown and free_node may only
+ * be called when no other thread uses the tree.
+ * The default is 0, where none of this locking is done.
+ */
+void set_thread_safe( int enable );
+
+/* With enable 1, create_file only reserves the blocks of a new
+ * file (see reserve_blocks in block_allocation.h), and the file
+ * has no extents yet. The files that are pending like this get
+ * their blocks together, by place_delayed_blocks or the next
+ * save_inodes of their tree, in the order of the tree, so the
+ * files of a directory end up next to each other. Each file gets
+ * one extent if a run of free blocks is long enough for it.
+ * fs_read, fs_write and fs_open place the blocks of a pending
+ * file first. delete_file and fs_shutdown give the reservations
+ * of pending files back. The default is 0, where create_file
+ * allocates the blocks at once.
+ */
+void set_delayed_allocation( int enable );
+
+/* Give every pending file below root its blocks, see
+ * set_delayed_allocation. save_inodes calls this.
+ * Returns 0 on success and -1 if a file could not get its blocks;
+ * that file stays pending.
+ */
+int place_delayed_blocks( struct inode* root );
+
+/* Give the file node its blocks now if it is pending, see
+ * set_delayed_allocation.
+ * Returns 0 on success and -1 if it could not get its blocks.
+ */
+int place_file_blocks( struct inode* node );
+
+/* With enable 1, create_file gives new files no blocks: the
+ * whole file is a hole, which reads as zeros. fs_write gives the
+ * blocks it writes to their blocks first, as fs_fallocate does,
+ * so a file only takes the blocks that were written. The default
+ * is 0. Inline files are not sparse.
+ */
+void set_sparse_files( int enable );
+
+/* Give the holes of the file node between byte offset and
+ * offset + len blocks now, so that later writes find them, as
+ * few extents as the free runs allow. The new blocks read as
+ * zeros. The range ends at the size of the file, which does not
+ * change. The extents are saved by save_inodes, and a tree with
+ * a journal logs them there as well, see set_journaling.
+ * A file must not be read or written by another thread while
+ * this changes its extents.
+ * Returns 0 on success and -1 if node is not a file that can be
+ * written, or the disk does not have enough free blocks, in which
+ * case the file is unchanged.
+ */
+int fs_fallocate( struct inode* node, uint64_t offset, uint64_t len );
+
+/* Keep the bytes of files of at most bytes bytes in the inode
+ * instead of blocks: create_file allocates no blocks for them,
+ * num_entries is 0, and entries points to the bytes of the file.
+ * The bytes are stored in the entries section of the record in
+ * the master file table, so they are read together with the
+ * inode, and fs_read, fs_write and fs_read_view copy them in
+ * memory. They are saved by save_inodes, like the rest of the
+ * inode. Version 1 tables have no room for them, so save_inodes
+ * does not write a version 1 table of a tree with inline files.
+ * bytes is at most INLINE_DATA_MAX. The default is 0, where every
+ * file gets blocks.
+ */
+void set_inline_threshold( size_t bytes );
+
+/* Read up to len bytes of the file node, starting at byte offset,
+ * into buf. The bytes are in the block image, see block_image.h,
+ * which must be open. The extents of the file are walked in order,
+ * and extents that follow each other on the disk as well are read
+ * as one run. Blocks that are in the block cache are copied from
+ * memory, and the missing blocks of a run are read with one preadv
+ * call.
+ * Returns the number of bytes read, which is less than len at the
+ * end of the file, or -1 on error.
+ */
+ssize_t fs_read( struct inode* node, uint64_t offset, void* buf, size_t len );
+
+/* Write up to len bytes from buf to the file node, starting at
+ * byte offset.
+ * Files keep the size they were created with: bytes after the end
+ * of the file are not written. Read-only files cannot be written.
+ * The bytes are kept in the block cache until fs_sync().
+ * Returns the number of bytes written, or -1 on error.
+ */
+ssize_t fs_write( struct inode* node, uint64_t offset, const void* buf, size_t len );
+
+/* Like fs_read, but without copying: *data is set to point to the
+ * bytes at offset in a read-only mapping of the block image. Only
+ * bytes up to the end of the run of contiguous blocks that holds
+ * offset are returned, so a large file is read with one call per
+ * run. Cached blocks in the range are written to the image first,
+ * since the mapping only shows the image. The pointer stays
+ * valid until close_block_image(), or for an inline file, whose
+ * bytes are not mapped, until the file is deleted or its tree is
+ * released. A hole is shown as up to 64 KiB of zeros at a time.
+ * Returns the number of bytes at *data, 0 at the end of the file,
+ * or -1 on error.
+ */
+ssize_t fs_read_view( struct inode* node, uint64_t offset, size_t len, const void** data );
+
+/* Write the file data that fs_write left in the block cache (see
+ * block_cache.h) to the block image. close_block_image() does the
+ * same.
+ * Returns 0 on success and -1 if a block could not be written.
+ */
+int fs_sync( void );
+
+/* Open the file node for reading with fs_file_read. Returns NULL
+ * if node is a directory or memory ran out.
+ */
+struct fs_file* fs_open( struct inode* node );
+
+/* Like fs_read, but reads that continue where the last one ended
+ * are sequential, and the open file reads ahead of them: the next
+ * window of the file is read into a buffer of the open file with
+ * one pread per contiguous run of blocks, and the kernel is asked
+ * to fetch the window after that in the background. The window
+ * grows while the reads stay sequential. Other reads go through
+ * the block cache like fs_read. Reads of a whole window or more
+ * are read into buf directly. What was read ahead is dropped when
+ * any file is written with fs_write.
+ * Returns the number of bytes read, or -1 on error.
+ */
+ssize_t fs_file_read( struct fs_file* file, uint64_t offset, void* buf, size_t len );
+
+/* Release an open file. The inode is not changed. NULL is allowed.
+ */
+void fs_close( struct fs_file* file );
+
+/* Set the largest readahead window of open files in blocks. 0 turns
+ * readahead off.
+ */
+void set_readahead_window( uint32_t max_blocks );
+
 /*******************************************************************************
  * END: ADD YOUR OWN FUNCTION DECLARATIONS ABOVE HERE
  ******************************************************************************/
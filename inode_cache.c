@@ -0,0 +1,117 @@
+#include "inode.h"
+#include "block_allocation.h"
+
+#include <stdio.h>
+
+#define NUM_DIRS  20
+#define NUM_FILES 50
+
+/* Find every file of every directory, and return how many were
+ * found.
+ */
+static int find_all( struct inode* root )
+{
+    char name[32];
+    int  found = 0;
+    for( int d=0; d<NUM_DIRS; d++ )
+    {
+        snprintf( name, sizeof(name), "dir-%02d", d );
+        struct inode* dir = find_inode_by_name( root, name );
+        for( int f=0; dir && f<NUM_FILES; f++ )
+        {
+            snprintf( name, sizeof(name), "file-%02d", f );
+            if( find_inode_by_name( dir, name ) )
+                found++;
+        }
+    }
+    return found;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 3 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char  name[32];
+    struct inode_cache_stats stats;
+
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+
+    printf("===================================\n");
+    printf("= Create %d directories with %d\n", NUM_DIRS, NUM_FILES );
+    printf("= files each and save them\n");
+    printf("===================================\n");
+    struct inode* root = create_dir( NULL, "/" );
+    for( int d=0; d<NUM_DIRS; d++ )
+    {
+        snprintf( name, sizeof(name), "dir-%02d", d );
+        struct inode* dir = create_dir( root, name );
+        for( int f=0; f<NUM_FILES; f++ )
+        {
+            snprintf( name, sizeof(name), "file-%02d", f );
+            create_file( dir, name, 0, 0 );
+        }
+    }
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+
+    printf("===================================\n");
+    printf("= Load them with a budget of\n");
+    printf("= about 5 directories\n");
+    printf("===================================\n");
+    size_t budget = 5 * NUM_FILES * ( sizeof(struct inode) + 16 );
+    set_inode_cache_budget( budget );
+    root = load_inodes( mft_name );
+
+    int found = find_all( root );
+    get_inode_cache_stats( &stats );
+    printf("Found %d files\n", found );
+    printf("Directories were evicted: %s\n", stats.evictions > 0 ? "yes" : "no" );
+    printf("Inodes in memory are fewer than in the tree: %s\n",
+           stats.resident < NUM_DIRS * NUM_FILES ? "yes" : "no" );
+
+    printf("===================================\n");
+    printf("= Pin a file and walk the tree    =\n");
+    printf("===================================\n");
+    struct inode* dir  = find_inode_by_name( root, "dir-00" );
+    struct inode* file = find_inode_by_name( dir, "file-07" );
+    pin_inode( file );
+    uint64_t evictions = stats.evictions;
+    found = find_all( root );
+    get_inode_cache_stats( &stats );
+    printf("Found %d files, more directories were evicted: %s\n", found,
+           stats.evictions > evictions ? "yes" : "no" );
+    printf("The pinned file is still %s (id %d)\n", file->name, file->id );
+    printf("dir-00 still holds it: %s\n",
+           find_inode_by_name( find_inode_by_name( root, "dir-00" ), "file-07" ) == file ? "yes" : "no" );
+    unpin_inode( file );
+
+    printf("===================================\n");
+    printf("= Change, save and walk again     =\n");
+    printf("===================================\n");
+    for( int d=0; d<NUM_DIRS; d+=4 )
+    {
+        snprintf( name, sizeof(name), "dir-%02d", d );
+        dir = find_inode_by_name( root, name );
+        delete_file( dir, find_inode_by_name( dir, "file-00" ) );
+        save_inodes( mft_name, root );
+    }
+    found = find_all( root );
+    printf("Found %d files\n", found );
+    fs_shutdown( root );
+
+    set_inode_cache_budget( 0 );
+    root = load_inodes( mft_name );
+    printf("Found %d files after loading the whole table\n", find_all( root ) );
+    fs_shutdown( root );
+}
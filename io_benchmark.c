@@ -0,0 +1,254 @@
+#include "inode.h"
+#include "block_allocation.h"
+#include "block_image.h"
+#include "block_cache.h"
+#include "io_engine.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/* Creates FILES files of SIZE KiB on a disk that just fits them,
+ * writes a pattern to every file with fs_write, and reads the
+ * files back with fs_read and fs_read_view in one call per file,
+ * with fs_read and fs_file_read in 4 KiB pieces, and with the
+ * asynchronous engine, once with io_uring and once with threads.
+ * All reads are checked against the pattern.
+ */
+
+static double now( void )
+{
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static unsigned char pattern( int file, uint64_t offset )
+{
+    return (unsigned char)( file * 31 + offset * 7 + offset / BLOCKSIZE );
+}
+
+/* Read all files with asynchronous requests of up to 32 blocks,
+ * one run of an extent at a time, and check them. Returns the
+ * number of errors, or -1 if the backend is not available.
+ */
+static int read_async( enum io_backend backend, struct inode** files, int num_files,
+                       int file_size, double* seconds )
+{
+    struct io_engine_config config = { backend, 0, 0, 0, 0 };
+    struct io_engine* engine = io_engine_create( &config );
+    if( !engine )
+        return -1;
+
+    int blocks = ( file_size + BLOCKSIZE - 1 ) / BLOCKSIZE;
+    struct io_request* requests = calloc( blocks, sizeof(struct io_request) );
+    char* data = malloc( (size_t)blocks * BLOCKSIZE );
+    int errors = 0;
+    double start = now( );
+    for( int f = 0; f < num_files; f++ )
+    {
+        const struct Extent* extents = (const struct Extent*)files[f]->entries;
+        int r = 0;
+        int block = 0;
+        for( uint32_t e = 0; e < files[f]->num_entries; e++ )
+        {
+            for( uint32_t done = 0; done < extents[e].extent; done += 32 )
+            {
+                struct io_request* request = &requests[r++];
+                request->op    = IO_READ;
+                request->block = extents[e].blockno + done;
+                request->count = extents[e].extent - done < 32 ? extents[e].extent - done : 32;
+                request->buf   = data + (size_t)( block + done ) * BLOCKSIZE;
+                io_engine_submit( engine, request );
+            }
+            block += extents[e].extent;
+        }
+        io_engine_poll( engine, NULL, 0, r );
+        struct io_request* done[64];
+        while( io_engine_poll( engine, done, 64, 0 ) > 0 )
+            ;
+        for( int i = 0; i < r; i++ )
+            if( requests[i].result != (ssize_t)requests[i].count * BLOCKSIZE )
+                errors++;
+        for( int i = 0; i < file_size; i++ )
+            if( (unsigned char)data[i] != pattern( f, i ) )
+            {
+                errors++;
+                break;
+            }
+    }
+    *seconds = now( ) - start;
+    printf( "io_engine %-9s%6.1f MiB/s\n", io_engine_backend( engine ),
+            (double)num_files * file_size / ( 1024 * 1024 ) / *seconds );
+    io_engine_destroy( engine );
+    free( data );
+    free( requests );
+    return errors;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 5 )
+    {
+        fprintf( stderr, "Usage: %s BAT IMAGE FILES SIZE\n"
+                         "       where\n"
+                         "       BAT is the name of the block allocation table\n"
+                         "       IMAGE is the name of the block image\n"
+                         "       FILES is the number of files\n"
+                         "       SIZE is the size of every file in KiB\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* bat_name = argv[1];
+    char* image_name = argv[2];
+    int   num_files = atoi( argv[3] );
+    int   file_size = atoi( argv[4] ) * 1024;
+    if( num_files <= 0 || file_size <= 0 )
+    {
+        fprintf( stderr, "FILES and SIZE must be positive\n" );
+        exit( -1 );
+    }
+
+    int blocks_per_file = ( file_size + BLOCKSIZE - 1 ) / BLOCKSIZE;
+    set_block_allocation_table_name( bat_name );
+    format_disk_blocks( (uint32_t)num_files * blocks_per_file );
+    remove( image_name );
+    if( set_block_image_name( image_name ) == -1 )
+        exit( -1 );
+
+    struct inode* root = create_dir( NULL, "/" );
+    struct inode** files = malloc( num_files * sizeof(struct inode*) );
+    char* buffer = malloc( file_size );
+    char name[64];
+    for( int f = 0; f < num_files; f++ )
+    {
+        snprintf( name, sizeof(name), "file%d", f );
+        files[f] = create_file( root, name, 0, file_size );
+        if( !files[f] )
+        {
+            fprintf( stderr, "failed to create %s\n", name );
+            exit( -1 );
+        }
+    }
+
+    double start = now( );
+    for( int f = 0; f < num_files; f++ )
+    {
+        for( int i = 0; i < file_size; i++ )
+            buffer[i] = pattern( f, i );
+        if( fs_write( files[f], 0, buffer, file_size ) != file_size )
+        {
+            fprintf( stderr, "failed to write file%d\n", f );
+            exit( -1 );
+        }
+    }
+    if( fs_sync( ) == -1 )
+    {
+        fprintf( stderr, "failed to write the cached blocks\n" );
+        exit( -1 );
+    }
+    double write_seconds = now( ) - start;
+
+    int errors = 0;
+    start = now( );
+    for( int f = 0; f < num_files; f++ )
+    {
+        if( fs_read( files[f], 0, buffer, file_size ) != file_size )
+            errors++;
+        for( int i = 0; i < file_size; i++ )
+            if( (unsigned char)buffer[i] != pattern( f, i ) )
+            {
+                errors++;
+                break;
+            }
+    }
+    double read_seconds = now( ) - start;
+
+    start = now( );
+    for( int f = 0; f < num_files; f++ )
+    {
+        uint64_t offset = 0;
+        while( offset < (uint64_t)file_size )
+        {
+            const void* data;
+            ssize_t n = fs_read_view( files[f], offset, file_size - offset, &data );
+            if( n <= 0 )
+            {
+                errors++;
+                break;
+            }
+            const unsigned char* bytes = data;
+            for( ssize_t i = 0; i < n; i++ )
+                if( bytes[i] != pattern( f, offset + i ) )
+                {
+                    errors++;
+                    break;
+                }
+            offset += n;
+        }
+    }
+    double view_seconds = now( ) - start;
+
+    /* 4 KiB at a time, as a program that streams a log would. */
+    char piece[4096];
+    start = now( );
+    for( int f = 0; f < num_files; f++ )
+    {
+        for( int offset = 0; offset < file_size; offset += sizeof(piece) )
+        {
+            ssize_t n = fs_read( files[f], offset, piece, sizeof(piece) );
+            for( ssize_t i = 0; i < n; i++ )
+                if( (unsigned char)piece[i] != pattern( f, offset + i ) )
+                {
+                    errors++;
+                    break;
+                }
+        }
+    }
+    double piece_seconds = now( ) - start;
+
+    start = now( );
+    for( int f = 0; f < num_files; f++ )
+    {
+        struct fs_file* file = fs_open( files[f] );
+        for( int offset = 0; offset < file_size; offset += sizeof(piece) )
+        {
+            ssize_t n = fs_file_read( file, offset, piece, sizeof(piece) );
+            for( ssize_t i = 0; i < n; i++ )
+                if( (unsigned char)piece[i] != pattern( f, offset + i ) )
+                {
+                    errors++;
+                    break;
+                }
+        }
+        fs_close( file );
+    }
+    double readahead_seconds = now( ) - start;
+
+    double mib = (double)num_files * file_size / ( 1024 * 1024 );
+    printf( "fs_write:     %8.1f MiB/s\n", mib / write_seconds );
+    printf( "fs_read:      %8.1f MiB/s\n", mib / read_seconds );
+    printf( "fs_read_view: %8.1f MiB/s\n", mib / view_seconds );
+    printf( "fs_read 4K:   %8.1f MiB/s\n", mib / piece_seconds );
+    printf( "fs_file_read: %8.1f MiB/s\n", mib / readahead_seconds );
+    double async_seconds;
+    for( int backend = IO_BACKEND_URING; backend <= IO_BACKEND_THREADS; backend++ )
+    {
+        int async_errors = read_async( backend, files, num_files, file_size, &async_seconds );
+        if( async_errors > 0 )
+            errors += async_errors;
+    }
+    struct block_cache_stats stats;
+    get_block_cache_stats( &stats );
+    printf( "block cache:  %llu hits, %llu misses, %llu evictions, %llu written back in %llu runs\n",
+            (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+            (unsigned long long)stats.evictions, (unsigned long long)stats.writebacks,
+            (unsigned long long)stats.write_runs );
+    printf( "%s\n", errors ? "DIFFERENT DATA" : "same data" );
+
+    free( buffer );
+    free( files );
+    fs_shutdown( root );
+    close_block_image( );
+    return errors ? -1 : 0;
+}
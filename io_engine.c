@@ -0,0 +1,583 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "io_engine.h"
+#include "block_image.h"
+#include "block_cache.h"
+#include "block_allocation.h"
+
+/* The rings that an io_uring instance shares with the kernel. We
+ * call the system calls ourselves, so nothing but the kernel
+ * headers is needed.
+ */
+struct uring
+{
+    int    fd;
+    int    sqpoll;
+    void*  sq_ring;
+    size_t sq_ring_size;
+    void*  cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_flags;
+    uint32_t* sq_array;
+    uint32_t  sq_mask;
+    uint32_t  sq_entries;
+
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t  cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+struct io_engine
+{
+    struct io_engine_config config;
+    int          is_uring;
+    struct uring ring;
+
+    /* Requests that were queued, but not submitted yet. */
+    struct io_request* queue_head;
+    struct io_request* queue_tail;
+    uint32_t           queued;
+
+    uint32_t in_flight;
+
+    /* Completed requests without a callback that io_engine_poll()
+     * did not return yet.
+     */
+    struct io_request* ready_head;
+    struct io_request* ready_tail;
+    uint32_t           ready;
+
+    /* The thread backend. Workers take requests from work and put
+     * them on finished; both lists are guarded by lock.
+     */
+    pthread_t*         workers;
+    uint32_t           num_workers;
+    pthread_mutex_t    lock;
+    pthread_cond_t     work_cond;
+    pthread_cond_t     done_cond;
+    struct io_request* work_head;
+    struct io_request* work_tail;
+    struct io_request* finished;
+    int                stopping;
+};
+
+static void append( struct io_request** head, struct io_request** tail, struct io_request* request )
+{
+    request->next = NULL;
+    if( *tail ) (*tail)->next = request;
+    else        *head = request;
+    *tail = request;
+}
+
+static uint32_t load_acquire( uint32_t* p )
+{
+    return atomic_load_explicit( (_Atomic uint32_t*)p, memory_order_acquire );
+}
+
+static void store_release( uint32_t* p, uint32_t value )
+{
+    atomic_store_explicit( (_Atomic uint32_t*)p, value, memory_order_release );
+}
+
+/* ---------------------------------------------------------------- */
+/* io_uring                                                         */
+/* ---------------------------------------------------------------- */
+
+static int uring_enter( int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags )
+{
+    return syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0 );
+}
+
+static void uring_close( struct uring* ring )
+{
+    if( ring->sqes )
+        munmap( ring->sqes, ring->sqes_size );
+    if( ring->cq_ring && ring->cq_ring != ring->sq_ring )
+        munmap( ring->cq_ring, ring->cq_ring_size );
+    if( ring->sq_ring )
+        munmap( ring->sq_ring, ring->sq_ring_size );
+    if( ring->fd != -1 )
+        close( ring->fd );
+    memset( ring, 0, sizeof(struct uring) );
+    ring->fd = -1;
+}
+
+/* Set up an io_uring with entries submission slots.
+ * Returns 0 on success and -1 if the kernel does not allow it.
+ */
+static int uring_open( struct uring* ring, uint32_t entries, int poll )
+{
+    struct io_uring_params params;
+    memset( ring, 0, sizeof(struct uring) );
+    memset( &params, 0, sizeof(params) );
+    if( poll )
+    {
+        params.flags = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000;
+    }
+    ring->fd = syscall( __NR_io_uring_setup, entries, &params );
+    if( ring->fd == -1 && poll )
+    {
+        /* A polling kernel thread may need privileges. */
+        memset( &params, 0, sizeof(params) );
+        ring->fd = syscall( __NR_io_uring_setup, entries, &params );
+    }
+    if( ring->fd == -1 )
+        return -1;
+    ring->sqpoll = ( params.flags & IORING_SETUP_SQPOLL ) != 0;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = ( params.features & IORING_FEAT_SINGLE_MMAP ) != 0;
+    if( single && ring->cq_ring_size > ring->sq_ring_size )
+        ring->sq_ring_size = ring->cq_ring_size;
+
+    ring->sq_ring = mmap( NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQ_RING );
+    if( ring->sq_ring == MAP_FAILED )
+    {
+        ring->sq_ring = NULL;
+        uring_close( ring );
+        return -1;
+    }
+    if( single )
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap( NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              ring->fd, IORING_OFF_CQ_RING );
+        if( ring->cq_ring == MAP_FAILED )
+        {
+            ring->cq_ring = NULL;
+            uring_close( ring );
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQES );
+    if( ring->sqes == MAP_FAILED )
+    {
+        ring->sqes = NULL;
+        uring_close( ring );
+        return -1;
+    }
+
+    char* sq = ring->sq_ring;
+    char* cq = ring->cq_ring;
+    ring->sq_head    = (uint32_t*)( sq + params.sq_off.head );
+    ring->sq_tail    = (uint32_t*)( sq + params.sq_off.tail );
+    ring->sq_flags   = (uint32_t*)( sq + params.sq_off.flags );
+    ring->sq_array   = (uint32_t*)( sq + params.sq_off.array );
+    ring->sq_mask    = *(uint32_t*)( sq + params.sq_off.ring_mask );
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head    = (uint32_t*)( cq + params.cq_off.head );
+    ring->cq_tail    = (uint32_t*)( cq + params.cq_off.tail );
+    ring->cq_mask    = *(uint32_t*)( cq + params.cq_off.ring_mask );
+    ring->cqes       = (struct io_uring_cqe*)( cq + params.cq_off.cqes );
+    return 0;
+}
+
+/* Put a request into the next submission slot. Returns 0, or -1
+ * if the submission ring is full.
+ */
+static int uring_prepare( struct uring* ring, struct io_request* request )
+{
+    uint32_t tail = *ring->sq_tail;
+    if( tail - load_acquire( ring->sq_head ) >= ring->sq_entries )
+        return -1;
+
+    uint32_t index = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset( sqe, 0, sizeof(struct io_uring_sqe) );
+    sqe->opcode    = request->op == IO_WRITE ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd        = block_image_fd( );
+    sqe->addr      = (uintptr_t)&request->iov;
+    sqe->len       = 1;
+    sqe->off       = (uint64_t)request->block * BLOCKSIZE;
+    sqe->user_data = (uintptr_t)request;
+    ring->sq_array[index] = index;
+    store_release( ring->sq_tail, tail + 1 );
+    return 0;
+}
+
+/* Tell the kernel about count new submissions. Returns 0, or -1
+ * with errno set if the kernel refused them; the submissions it did
+ * not take are then still in the ring.
+ */
+static int uring_submit( struct uring* ring, uint32_t count )
+{
+    if( ring->sqpoll )
+    {
+        atomic_thread_fence( memory_order_seq_cst );
+        if( load_acquire( ring->sq_flags ) & IORING_SQ_NEED_WAKEUP )
+            uring_enter( ring->fd, 0, 0, IORING_ENTER_SQ_WAKEUP );
+        return 0;
+    }
+    while( count > 0 )
+    {
+        int n = uring_enter( ring->fd, count, 0, 0 );
+        if( n == -1 && errno == EINTR )
+            continue;
+        if( n == -1 && errno != EAGAIN && errno != EBUSY )
+        {
+            int error = errno;
+            fprintf( stderr, "Failed to submit to io_uring (%s)\n", strerror( error ) );
+            errno = error;
+            return -1;
+        }
+        if( n <= 0 )
+        {
+            /* The kernel is busy with completions; wait for one. */
+            uring_enter( ring->fd, 0, 1, IORING_ENTER_GETEVENTS );
+            continue;
+        }
+        count -= n;
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* Thread backend                                                   */
+/* ---------------------------------------------------------------- */
+
+static void* worker_main( void* arg )
+{
+    struct io_engine* engine = arg;
+    pthread_mutex_lock( &engine->lock );
+    for( ;; )
+    {
+        while( !engine->work_head && !engine->stopping )
+            pthread_cond_wait( &engine->work_cond, &engine->lock );
+        if( !engine->work_head )
+            break;
+        struct io_request* request = engine->work_head;
+        engine->work_head = request->next;
+        if( !engine->work_head )
+            engine->work_tail = NULL;
+        pthread_mutex_unlock( &engine->lock );
+
+        uint64_t offset = (uint64_t)request->block * BLOCKSIZE;
+        ssize_t n = request->op == IO_WRITE
+                  ? block_image_write( request->iov.iov_base, request->iov.iov_len, offset )
+                  : block_image_read( request->iov.iov_base, request->iov.iov_len, offset );
+        request->result = n == -1 ? -errno : n;
+
+        pthread_mutex_lock( &engine->lock );
+        request->next = engine->finished;
+        engine->finished = request;
+        pthread_cond_signal( &engine->done_cond );
+    }
+    pthread_mutex_unlock( &engine->lock );
+    return NULL;
+}
+
+static int start_workers( struct io_engine* engine )
+{
+    pthread_mutex_init( &engine->lock, NULL );
+    pthread_cond_init( &engine->work_cond, NULL );
+    pthread_cond_init( &engine->done_cond, NULL );
+    engine->workers = malloc( engine->config.threads * sizeof(pthread_t) );
+    if( !engine->workers )
+        return -1;
+    for( uint32_t i = 0; i < engine->config.threads; i++ )
+    {
+        if( pthread_create( &engine->workers[i], NULL, worker_main, engine ) != 0 )
+            break;
+        engine->num_workers++;
+    }
+    return engine->num_workers > 0 ? 0 : -1;
+}
+
+static void stop_workers( struct io_engine* engine )
+{
+    pthread_mutex_lock( &engine->lock );
+    engine->stopping = 1;
+    pthread_cond_broadcast( &engine->work_cond );
+    pthread_mutex_unlock( &engine->lock );
+    for( uint32_t i = 0; i < engine->num_workers; i++ )
+        pthread_join( engine->workers[i], NULL );
+    free( engine->workers );
+    pthread_cond_destroy( &engine->done_cond );
+    pthread_cond_destroy( &engine->work_cond );
+    pthread_mutex_destroy( &engine->lock );
+}
+
+/* ---------------------------------------------------------------- */
+/* The engine                                                       */
+/* ---------------------------------------------------------------- */
+
+struct io_engine* io_engine_create( const struct io_engine_config* config )
+{
+    if( block_image_fd( ) == -1 )
+    {
+        fprintf( stderr, "The block image has not been opened\n" );
+        return NULL;
+    }
+    struct io_engine* engine = calloc( 1, sizeof(struct io_engine) );
+    if( !engine )
+        return NULL;
+    if( config )
+        engine->config = *config;
+    if( engine->config.queue_depth == 0 ) engine->config.queue_depth = IO_ENGINE_QUEUE_DEPTH;
+    if( engine->config.batch_size == 0 )  engine->config.batch_size  = IO_ENGINE_BATCH_SIZE;
+    if( engine->config.threads == 0 )     engine->config.threads     = IO_ENGINE_THREADS;
+    engine->ring.fd = -1;
+
+    if( engine->config.backend != IO_BACKEND_THREADS )
+    {
+        if( uring_open( &engine->ring, engine->config.queue_depth, engine->config.poll ) == 0 )
+        {
+            engine->is_uring = 1;
+            /* The kernel may round the ring up. */
+            if( engine->config.queue_depth > engine->ring.sq_entries )
+                engine->config.queue_depth = engine->ring.sq_entries;
+            return engine;
+        }
+        if( engine->config.backend == IO_BACKEND_URING )
+        {
+            fprintf( stderr, "io_uring is not available (%s)\n", strerror( errno ) );
+            free( engine );
+            return NULL;
+        }
+    }
+
+    if( start_workers( engine ) == -1 )
+    {
+        fprintf( stderr, "Failed to start the threads of the I/O engine\n" );
+        stop_workers( engine );
+        free( engine );
+        return NULL;
+    }
+    return engine;
+}
+
+const char* io_engine_backend( const struct io_engine* engine )
+{
+    return engine->is_uring ? "io_uring" : "threads";
+}
+
+uint32_t io_engine_pending( const struct io_engine* engine )
+{
+    return engine->queued + engine->in_flight + engine->ready;
+}
+
+int io_engine_submit( struct io_engine* engine, struct io_request* request )
+{
+    if( !request || !request->buf || request->count == 0
+        || (uint64_t)request->block + request->count > get_num_blocks( ) )
+    {
+        fprintf( stderr, "Invalid I/O request\n" );
+        return -1;
+    }
+
+    /* The image must agree with the block cache. */
+    if( request->op == IO_READ )
+        block_cache_flush_blocks( request->block, request->count );
+    else
+        block_cache_forget( request->block, request->count );
+
+    request->iov.iov_base = request->buf;
+    request->iov.iov_len  = (size_t)request->count * BLOCKSIZE;
+    request->result = 0;
+    append( &engine->queue_head, &engine->queue_tail, request );
+    engine->queued++;
+    if( engine->queued >= engine->config.batch_size )
+        io_engine_flush( engine );
+    return 0;
+}
+
+/* A request completed: call its callback, or keep it for
+ * io_engine_poll().
+ */
+static void complete( struct io_engine* engine, struct io_request* request )
+{
+    engine->in_flight--;
+    if( request->done )
+    {
+        request->done( request );
+    }
+    else
+    {
+        append( &engine->ready_head, &engine->ready_tail, request );
+        engine->ready++;
+    }
+}
+
+/* Take the submissions that the kernel did not accept back out of
+ * the ring, and complete their requests with the error, so that
+ * they are no longer counted as in flight.
+ */
+static void fail_unsubmitted( struct io_engine* engine, int error )
+{
+    struct uring* ring = &engine->ring;
+    uint32_t head = load_acquire( ring->sq_head );
+    uint32_t tail = *ring->sq_tail;
+    store_release( ring->sq_tail, head );
+    for( ; head != tail; head++ )
+    {
+        struct io_uring_sqe* sqe = &ring->sqes[ring->sq_array[head & ring->sq_mask]];
+        struct io_request* request = (struct io_request*)(uintptr_t)sqe->user_data;
+        request->result = -error;
+        complete( engine, request );
+    }
+}
+
+void io_engine_flush( struct io_engine* engine )
+{
+    uint32_t count = 0;
+    if( !engine->is_uring )
+        pthread_mutex_lock( &engine->lock );
+    while( engine->queue_head && engine->in_flight < engine->config.queue_depth )
+    {
+        struct io_request* request = engine->queue_head;
+        if( engine->is_uring && uring_prepare( &engine->ring, request ) == -1 )
+            break;
+        engine->queue_head = request->next;
+        if( !engine->queue_head )
+            engine->queue_tail = NULL;
+        engine->queued--;
+        engine->in_flight++;
+        if( !engine->is_uring )
+            append( &engine->work_head, &engine->work_tail, request );
+        count++;
+    }
+    if( !engine->is_uring )
+    {
+        if( count > 0 )
+            pthread_cond_broadcast( &engine->work_cond );
+        pthread_mutex_unlock( &engine->lock );
+    }
+    else if( count > 0 && uring_submit( &engine->ring, count ) == -1 )
+    {
+        fail_unsubmitted( engine, errno );
+    }
+}
+
+/* Collect the requests that completed so far. With wait set, wait
+ * for one first if none did. Returns the number of requests.
+ */
+static uint32_t reap( struct io_engine* engine, int wait )
+{
+    uint32_t count = 0;
+    if( engine->is_uring )
+    {
+        struct uring* ring = &engine->ring;
+        for( ;; )
+        {
+            uint32_t head = *ring->cq_head;
+            uint32_t tail = load_acquire( ring->cq_tail );
+            while( head != tail )
+            {
+                struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+                struct io_request* request = (struct io_request*)(uintptr_t)cqe->user_data;
+                request->result = cqe->res;
+                head++;
+                store_release( ring->cq_head, head );
+                complete( engine, request );
+                count++;
+            }
+            if( count > 0 || !wait )
+                break;
+            if( !engine->config.poll )
+                uring_enter( ring->fd, 0, 1, IORING_ENTER_GETEVENTS );
+        }
+        return count;
+    }
+
+    pthread_mutex_lock( &engine->lock );
+    while( wait && !engine->finished )
+    {
+        if( engine->config.poll )
+        {
+            pthread_mutex_unlock( &engine->lock );
+            sched_yield( );
+            pthread_mutex_lock( &engine->lock );
+        }
+        else
+        {
+            pthread_cond_wait( &engine->done_cond, &engine->lock );
+        }
+    }
+    struct io_request* finished = engine->finished;
+    engine->finished = NULL;
+    pthread_mutex_unlock( &engine->lock );
+
+    /* The list is newest first. */
+    struct io_request* in_order = NULL;
+    while( finished )
+    {
+        struct io_request* next = finished->next;
+        finished->next = in_order;
+        in_order = finished;
+        finished = next;
+    }
+    while( in_order )
+    {
+        struct io_request* next = in_order->next;
+        complete( engine, in_order );
+        count++;
+        in_order = next;
+    }
+    return count;
+}
+
+int io_engine_poll( struct io_engine* engine, struct io_request** done, int max, int min_complete )
+{
+    int completed = 0;
+    io_engine_flush( engine );
+    for( ;; )
+    {
+        completed += reap( engine, 0 );
+        io_engine_flush( engine );
+        if( completed >= min_complete || engine->in_flight == 0 )
+            break;
+        completed += reap( engine, 1 );
+        io_engine_flush( engine );
+        if( completed >= min_complete || engine->in_flight == 0 )
+            break;
+    }
+
+    int n = 0;
+    while( n < max && engine->ready_head )
+    {
+        struct io_request* request = engine->ready_head;
+        engine->ready_head = request->next;
+        if( !engine->ready_head )
+            engine->ready_tail = NULL;
+        engine->ready--;
+        done[n++] = request;
+    }
+    return n;
+}
+
+void io_engine_destroy( struct io_engine* engine )
+{
+    if( !engine )
+        return;
+    while( engine->queued + engine->in_flight > 0 )
+        io_engine_poll( engine, NULL, 0, engine->queued + engine->in_flight );
+    if( engine->is_uring )
+        uring_close( &engine->ring );
+    else
+        stop_workers( engine );
+    free( engine );
+}
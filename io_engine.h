@@ -0,0 +1,115 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Asynchronous reads and writes of blocks of the block image.
+ *
+ * Requests name blocks by the numbers in the extents of a file.
+ * io_engine_submit() queues a request, and the queued requests are
+ * handed to the kernel together, once batch_size of them are
+ * waiting or when io_engine_flush() is called. At most queue_depth
+ * requests are in flight; the others wait in the queue until
+ * earlier ones complete. io_engine_poll() collects completed
+ * requests: it calls the callback of a request that has one, and
+ * returns the others to the caller.
+ *
+ * The engine uses io_uring when the kernel has it, and otherwise a
+ * pool of threads that call pread and pwrite. An engine belongs to
+ * the thread that created it; only that thread may submit and poll.
+ *
+ * Reads first write dirty blocks of their range from the block
+ * cache to the image, and writes drop their blocks from the cache.
+ * Until a request completes, its blocks must not be read or
+ * written through fs_read() or fs_write().
+ */
+
+#define IO_ENGINE_QUEUE_DEPTH 64
+#define IO_ENGINE_BATCH_SIZE  16
+#define IO_ENGINE_THREADS     4
+
+enum io_op
+{
+    IO_READ  = 0,
+    IO_WRITE = 1
+};
+
+enum io_backend
+{
+    IO_BACKEND_AUTO    = 0, /* io_uring if the kernel has it, threads otherwise */
+    IO_BACKEND_URING   = 1,
+    IO_BACKEND_THREADS = 2
+};
+
+/* Settings of an engine. Fields that are 0 get the defaults above.
+ */
+struct io_engine_config
+{
+    enum io_backend backend;
+    uint32_t queue_depth; /* requests in flight at most */
+    uint32_t batch_size;  /* queued requests that are submitted together */
+    uint32_t threads;     /* workers of the thread backend */
+    int      poll;        /* 1 to spin while waiting for completions instead of
+                           * sleeping; io_uring then also polls submissions with
+                           * a kernel thread (SQPOLL) where that is allowed */
+};
+
+struct io_request
+{
+    enum io_op op;
+    uint32_t   block;  /* first block in the image */
+    uint32_t   count;  /* number of blocks */
+    void*      buf;    /* count * BLOCKSIZE bytes */
+    void     (*done)( struct io_request* request ); /* NULL to get the request from io_engine_poll() */
+    void*      arg;    /* for the caller */
+    ssize_t    result; /* bytes transferred, or -errno, once the request completed */
+
+    /* Used by the engine. */
+    struct io_request* next;
+    struct iovec       iov;
+};
+
+struct io_engine;
+
+/* Create an engine over the open block image. config may be NULL
+ * for the defaults. Returns NULL if the image is not open, memory
+ * ran out, or io_uring was asked for and the kernel does not have
+ * it.
+ */
+struct io_engine* io_engine_create( const struct io_engine_config* config );
+
+/* Wait for all requests, then release the engine. NULL is allowed. */
+void io_engine_destroy( struct io_engine* engine );
+
+/* Return "io_uring" or "threads". */
+const char* io_engine_backend( const struct io_engine* engine );
+
+/* Queue a request. It is submitted when batch_size requests are
+ * queued, or by io_engine_flush() or io_engine_poll().
+ * Returns 0, or -1 if the request is not valid.
+ */
+int io_engine_submit( struct io_engine* engine, struct io_request* request );
+
+/* Submit the queued requests, as many as the queue depth allows.
+ * Requests that the kernel refuses complete at once, with -errno
+ * as their result.
+ */
+void io_engine_flush( struct io_engine* engine );
+
+/* Submit what is queued, and collect completed requests until at
+ * least min_complete requests completed in this call, or none are
+ * left. Completed requests without a callback are stored in done,
+ * at most max of them; the rest are kept for the next call.
+ * Returns the number of requests stored in done.
+ */
+int io_engine_poll( struct io_engine* engine, struct io_request** done, int max, int min_complete );
+
+/* Return the number of requests that were submitted and were not
+ * collected by io_engine_poll() yet.
+ */
+uint32_t io_engine_pending( const struct io_engine* engine );
+
+#endif // IO_ENGINE_H
@@ -0,0 +1,148 @@
+#include "inode.h"
+#include "block_allocation.h"
+#include "block_image.h"
+#include "io_engine.h"
+
+#include <stdio.h>
+
+#define FILE_BLOCKS 16
+#define READ_BLOCKS 4
+
+static int written;
+
+static void count_write( struct io_request* request )
+{
+    if( request->result == BLOCKSIZE )
+        written++;
+}
+
+/* Write every block of the file with its own request, read the file
+ * back with requests of READ_BLOCKS blocks, and print whether the
+ * engine and fs_read() saw the bytes that were written.
+ */
+static void write_and_read( const struct io_engine_config* config, struct inode* file, char letter )
+{
+    static char blocks[FILE_BLOCKS][BLOCKSIZE];
+    static char copy[FILE_BLOCKS * BLOCKSIZE];
+    struct io_request  requests[FILE_BLOCKS];
+    struct io_request* done[FILE_BLOCKS];
+    struct Extent*     extent = (struct Extent*)file->entries;
+
+    struct io_engine* engine = io_engine_create( config );
+    if( !engine )
+    {
+        printf("No engine\n");
+        return;
+    }
+
+    written = 0;
+    for( int b=0; b<FILE_BLOCKS; b++ )
+    {
+        memset( blocks[b], letter + b, BLOCKSIZE );
+        memset( &requests[b], 0, sizeof(requests[b]) );
+        requests[b].op    = IO_WRITE;
+        requests[b].block = extent->blockno + b;
+        requests[b].count = 1;
+        requests[b].buf   = blocks[b];
+        requests[b].done  = count_write;
+        io_engine_submit( engine, &requests[b] );
+    }
+    io_engine_poll( engine, done, FILE_BLOCKS, FILE_BLOCKS );
+    printf("Wrote %d of %d blocks\n", written, FILE_BLOCKS );
+
+    int reads = 0;
+    int good  = 1;
+    for( int b=0; b<FILE_BLOCKS; b+=READ_BLOCKS )
+    {
+        memset( &requests[b], 0, sizeof(requests[b]) );
+        requests[b].op    = IO_READ;
+        requests[b].block = extent->blockno + b;
+        requests[b].count = READ_BLOCKS;
+        requests[b].buf   = copy + b * BLOCKSIZE;
+        io_engine_submit( engine, &requests[b] );
+    }
+    while( io_engine_pending( engine ) > 0 )
+    {
+        int n = io_engine_poll( engine, done, FILE_BLOCKS, 1 );
+        for( int i=0; i<n; i++ )
+        {
+            if( done[i]->result != READ_BLOCKS * BLOCKSIZE )
+                good = 0;
+            reads++;
+        }
+    }
+    io_engine_destroy( engine );
+    if( memcmp( copy, blocks, sizeof(copy) ) != 0 )
+        good = 0;
+    printf("Read the file back with %d requests, the bytes are %s\n", reads, good ? "right" : "wrong" );
+
+    memset( copy, 0, sizeof(copy) );
+    fs_read( file, 0, copy, sizeof(copy) );
+    printf("fs_read sees %s bytes\n", memcmp( copy, blocks, sizeof(copy) ) == 0 ? "the new" : "old" );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 4 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT IMG\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         "       IMG is the name of the block image\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char* img_name = argv[3];
+    char  buf[BLOCKSIZE];
+
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+    remove( img_name );
+    if( set_block_image_name( img_name ) == -1 )
+        exit( -1 );
+
+    struct inode* root = create_dir( NULL, "/" );
+    struct inode* file = create_file( root, "data", 0, FILE_BLOCKS * BLOCKSIZE );
+    memset( buf, '-', sizeof(buf) );
+    for( int b=0; b<FILE_BLOCKS; b++ )
+        fs_write( file, b * BLOCKSIZE, buf, sizeof(buf) );
+
+    printf("===================================\n");
+    printf("= Requests with the thread pool   =\n");
+    printf("===================================\n");
+    struct io_engine_config config;
+    memset( &config, 0, sizeof(config) );
+    config.backend    = IO_BACKEND_THREADS;
+    config.batch_size = 4;
+    write_and_read( &config, file, 'a' );
+
+    printf("===================================\n");
+    printf("= Requests with the default       =\n");
+    printf("= backend                         =\n");
+    printf("===================================\n");
+    write_and_read( NULL, file, 'A' );
+
+    printf("===================================\n");
+    printf("= Requests that are not valid     =\n");
+    printf("===================================\n");
+    struct io_engine* engine = io_engine_create( NULL );
+    struct io_request request;
+    memset( &request, 0, sizeof(request) );
+    request.op    = IO_READ;
+    request.block = get_num_blocks( ) - 1;
+    request.count = 2;
+    request.buf   = buf;
+    printf("Past the end of the disk: %d\n", io_engine_submit( engine, &request ) );
+    request.count = 0;
+    printf("No blocks: %d\n", io_engine_submit( engine, &request ) );
+    printf("Pending: %u\n", io_engine_pending( engine ) );
+    io_engine_destroy( engine );
+
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+    close_block_image( );
+}
@@ -0,0 +1,227 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct journal_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t reserved;
+};
+
+struct journal
+{
+    int             fd;
+    uint64_t        size; // where the next record goes
+    pthread_mutex_t lock; // threads that change different directories append at the same time
+};
+
+// The checksum covers everything after the size and checksum fields
+#define CHECKED_OFFSET (2 * sizeof(uint32_t))
+
+/*
+FNV-1a hash of size bytes.
+*/
+static uint32_t checksum(const char* bytes, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++){
+        hash ^= (unsigned char) bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+Writes size bytes at offset, continuing after short writes.
+
+@return 0 on success, -1 on error
+*/
+static int write_at(int fd, const char* bytes, size_t size, uint64_t offset)
+{
+    while (size > 0){
+        ssize_t written = pwrite(fd, bytes, size, offset);
+        if (written == -1){
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+/*
+Cuts the file after its header and writes the header again.
+
+@return 0 on success, -1 on error
+*/
+static int write_header(struct journal* journal)
+{
+    struct journal_header header = { JOURNAL_MAGIC, JOURNAL_VERSION, 0 };
+    if (ftruncate(journal->fd, 0) == -1
+        || write_at(journal->fd, (const char*) &header, sizeof(header), 0) == -1){
+        return -1;
+    }
+    journal->size = sizeof(header);
+    return 0;
+}
+
+struct journal* journal_open(const char* path, int truncate)
+{
+    struct journal* journal = malloc(sizeof(struct journal));
+    if (!journal){
+        return NULL;
+    }
+    journal->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (journal->fd == -1){
+        free(journal);
+        return NULL;
+    }
+    pthread_mutex_init(&journal->lock, NULL);
+
+    struct stat st;
+    struct journal_header header;
+    if (fstat(journal->fd, &st) == -1){
+        journal_close(journal);
+        return NULL;
+    }
+    if (truncate || st.st_size == 0){
+        if (write_header(journal) == -1){
+            journal_close(journal);
+            return NULL;
+        }
+        return journal;
+    }
+    if ((size_t) st.st_size < sizeof(header)
+        || pread(journal->fd, &header, sizeof(header), 0) != sizeof(header)
+        || header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION){
+        journal_close(journal);
+        return NULL;
+    }
+    journal->size = st.st_size;
+    return journal;
+}
+
+void journal_close(struct journal* journal)
+{
+    if (!journal){
+        return;
+    }
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal);
+}
+
+int journal_reset(struct journal* journal)
+{
+    pthread_mutex_lock(&journal->lock);
+    int result = write_header(journal);
+    pthread_mutex_unlock(&journal->lock);
+    return result;
+}
+
+int journal_append(struct journal* journal, struct journal_record* record,
+                   const char* name, const void* entries)
+{
+    record->name_length = name ? strlen(name) + 1 : 0;
+    size_t entries_size = (size_t) record->num_entries * 2 * sizeof(uint32_t);
+    size_t size = sizeof(struct journal_record) + record->name_length + entries_size;
+    record->size = size;
+
+    // One write per record, so that a record is never split by another one
+    char buffer[512];
+    char* bytes = size <= sizeof(buffer) ? buffer : malloc(size);
+    if (!bytes){
+        return -1;
+    }
+    memcpy(bytes, record, sizeof(struct journal_record));
+    if (name){
+        memcpy(bytes + sizeof(struct journal_record), name, record->name_length);
+    }
+    if (entries_size > 0){
+        memcpy(bytes + sizeof(struct journal_record) + record->name_length, entries, entries_size);
+    }
+    record->checksum = checksum(bytes + CHECKED_OFFSET, size - CHECKED_OFFSET);
+    memcpy(bytes + sizeof(uint32_t), &record->checksum, sizeof(uint32_t));
+
+    pthread_mutex_lock(&journal->lock);
+    int result = write_at(journal->fd, bytes, size, journal->size);
+    if (result == 0){
+        journal->size += size;
+    }
+    pthread_mutex_unlock(&journal->lock);
+    if (bytes != buffer){
+        free(bytes);
+    }
+    return result;
+}
+
+int journal_replay(struct journal* journal, journal_apply_fn apply, void* arg)
+{
+    size_t size = journal->size - sizeof(struct journal_header);
+    if (size == 0){
+        return 0;
+    }
+    char* bytes = malloc(size);
+    if (!bytes){
+        return -1;
+    }
+    size_t done = 0;
+    while (done < size){
+        ssize_t n = pread(journal->fd, bytes + done, size - done, sizeof(struct journal_header) + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0){
+            free(bytes);
+            return -1;
+        }
+        done += n;
+    }
+
+    int count = 0;
+    size_t pos = 0;
+    while (size - pos >= sizeof(struct journal_record)){
+        struct journal_record record;
+        memcpy(&record, bytes + pos, sizeof(struct journal_record));
+        size_t entries_size = (size_t) record.num_entries * 2 * sizeof(uint32_t);
+        if (record.size < sizeof(struct journal_record) || record.size > size - pos
+            || record.size != sizeof(struct journal_record) + (size_t) record.name_length + entries_size
+            || record.checksum != checksum(bytes + pos + CHECKED_OFFSET, record.size - CHECKED_OFFSET)){
+            break;
+        }
+        const char* name = record.name_length ? bytes + pos + sizeof(struct journal_record) : NULL;
+        if (name && name[record.name_length - 1] != '\0'){
+            break;
+        }
+        apply(arg, &record, name, bytes + pos + sizeof(struct journal_record) + record.name_length);
+        pos += record.size;
+        count++;
+    }
+    free(bytes);
+
+    // Whatever follows the last good record was cut short
+    if (pos < size){
+        journal->size = sizeof(struct journal_header) + pos;
+        if (ftruncate(journal->fd, journal->size) == -1){
+            return -1;
+        }
+    }
+    return count;
+}
+
+uint64_t journal_size(struct journal* journal)
+{
+    pthread_mutex_lock(&journal->lock);
+    uint64_t size = journal->size - sizeof(struct journal_header);
+    pthread_mutex_unlock(&journal->lock);
+    return size;
+}
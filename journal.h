@@ -0,0 +1,103 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* An append-only log of the changes made to a tree since its
+ * master file table was last written.
+ *
+ * The file starts with a header, followed by one record per
+ * create_file, create_dir, delete_file or delete_dir, and one per
+ * write to an inline file. A record is a struct journal_record,
+ * then the name of a new inode with its '\0', then the extents of
+ * a new file, or the bytes of an inline file padded to whole
+ * extents. Each record carries
+ * a checksum, so a record that was only partly written when the
+ * program stopped ends the log.
+ *
+ * Records name inodes by id, and ids are never used twice, so a
+ * record that is replayed a second time finds its work done and
+ * changes nothing.
+ */
+#define JOURNAL_MAGIC   0x4a54464dU /* "MFTJ" */
+#define JOURNAL_VERSION 1
+
+enum journal_op
+{
+    JOURNAL_CREATE_FILE = 1,
+    JOURNAL_CREATE_DIR  = 2,
+    JOURNAL_DELETE_FILE = 3,
+    JOURNAL_DELETE_DIR  = 4,
+    JOURNAL_CHANGE_FILE = 5  /* the data of a file that exists */
+};
+
+/* A new file keeps its bytes in its inode, see set_inline_threshold.
+ * A changed file with this flag has its bytes in the entries.
+ */
+#define JOURNAL_INLINE 1
+
+/* A new file has only reserved its blocks, see
+ * set_delayed_allocation.
+ */
+#define JOURNAL_RESERVED 2
+
+struct journal_record
+{
+    uint32_t size;         /* of the whole record, with name and extents */
+    uint32_t checksum;     /* of the bytes after this field */
+    uint8_t  op;           /* enum journal_op */
+    uint8_t  is_readonly;
+    uint16_t flags;        /* JOURNAL_INLINE or JOURNAL_RESERVED */
+    uint32_t id;
+    uint32_t parent_id;
+    uint32_t filesize;
+    uint32_t num_entries;  /* extents of a new or changed file */
+    uint32_t name_length;  /* including the '\0', 0 for deletions */
+};
+
+struct journal;
+
+/* Open the journal file path for appending, and create it if it
+ * does not exist. With truncate 1 the records in it are dropped.
+ * Returns NULL if the file cannot be opened or is not a journal.
+ */
+struct journal* journal_open( const char* path, int truncate );
+
+/* Close the file and release the journal. NULL is allowed. */
+void journal_close( struct journal* journal );
+
+/* Drop all records, after the changes in them were written to
+ * the master file table. Returns 0 on success and -1 on error.
+ */
+int journal_reset( struct journal* journal );
+
+/* Append one record. size, checksum and name_length are filled
+ * in here. name may be NULL for deletions, and entries points to
+ * record->num_entries extents.
+ * Returns 0 on success and -1 if the record could not be written.
+ */
+int journal_append( struct journal* journal, struct journal_record* record,
+                    const char* name, const void* entries );
+
+/* Called by journal_replay for every complete record. name and
+ * entries point into a buffer that is released after the call.
+ */
+typedef void (*journal_apply_fn)( void* arg, const struct journal_record* record,
+                                  const char* name, const void* entries );
+
+/* Call apply for every record in order. A damaged or partly
+ * written record ends the log; it and everything after it are
+ * cut off, so new records follow the last good one.
+ * Returns the number of records, or -1 if the file cannot be read.
+ */
+int journal_replay( struct journal* journal, journal_apply_fn apply, void* arg );
+
+/* Return the number of bytes of the records in the journal. */
+uint64_t journal_size( struct journal* journal );
+
+/* journal_append, journal_reset and journal_size may be called
+ * from several threads at once. journal_replay may not.
+ */
+
+#endif
@@ -0,0 +1,94 @@
+#include "inode.h"
+#include "block_allocation.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Create a filesystem, save it, and change it some more with the
+ * journal on. The process then stops without saving the tree or
+ * releasing it, as if it had crashed. The block allocation table
+ * is not written after the save either, so it does not know the
+ * blocks of the changes.
+ */
+static void change_and_crash( char* mft_name, char* bat_name )
+{
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+    set_journaling( 1 );
+
+    printf("===================================\n");
+    printf("= Create and save a filesystem    =\n");
+    printf("===================================\n");
+    struct inode* root    = create_dir( NULL, "/" );
+    create_file( root, "kernel", 1, 20000 );
+    struct inode* dir_etc = create_dir( root, "etc" );
+    struct inode* f_hosts = create_file( dir_etc, "hosts", 0, 200 );
+    struct inode* dir_tmp = create_dir( root, "tmp" );
+    save_inodes( mft_name, root );
+    debug_fs( root );
+
+    printf("===================================\n");
+    printf("= Change it without saving        =\n");
+    printf("===================================\n");
+    struct inode* dir_usr = create_dir( root, "usr" );
+    struct inode* dir_bin = create_dir( dir_usr, "bin" );
+    create_file( dir_bin, "ls", 1, 14322 );
+    create_file( dir_etc, "passwd", 0, 1000 );
+    delete_file( dir_etc, f_hosts );
+    delete_dir( root, dir_tmp );
+    struct inode* f_core = create_file( root, "core", 0, 9000 );
+    delete_file( root, f_core );
+    debug_fs( root );
+
+    printf("===================================\n");
+    printf("= Crash                           =\n");
+    printf("===================================\n");
+    fflush( stdout );
+    _exit( 0 );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 3 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+
+    fflush( stdout );
+    pid_t pid = fork( );
+    if( pid == 0 )
+        change_and_crash( mft_name, bat_name );
+    if( pid == -1 || waitpid( pid, NULL, 0 ) != pid )
+    {
+        fprintf( stderr, "Failed to run the crashing process\n" );
+        exit( -1 );
+    }
+
+    printf("===================================\n");
+    printf("= Load the table and replay the   =\n");
+    printf("= journal                         =\n");
+    printf("===================================\n");
+    set_block_allocation_table_name( bat_name );
+    set_journaling( 1 );
+    struct inode* root = load_inodes( mft_name );
+    debug_fs( root );
+    debug_disk();
+
+    printf("===================================\n");
+    printf("= Save, which empties the journal =\n");
+    printf("===================================\n");
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+    root = load_inodes( mft_name );
+    debug_fs( root );
+    fs_shutdown( root );
+}
@@ -0,0 +1,93 @@
+#include "inode.h"
+#include "block_allocation.h"
+
+#include <stdio.h>
+
+#define NUM_MESSAGES 1000
+
+/* Look up a few names in the directory and print what was found. */
+static void find_some( struct inode* spool )
+{
+    const char* names[] = { "msg-0000", "msg-0001", "msg-0500", "msg-0998", "msg-0999", "msg-1000" };
+    for( int i=0; i<6; i++ )
+    {
+        struct inode* node = find_inode_by_name( spool, names[i] );
+        if( node ) printf("Found %s (id %d)\n", names[i], node->id );
+        else       printf("Did not find %s\n", names[i] );
+    }
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 3 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char  name[32];
+
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+
+    printf("===================================\n");
+    printf("= Create a directory with %d files\n", NUM_MESSAGES );
+    printf("===================================\n");
+    struct inode* root  = create_dir( NULL, "/" );
+    struct inode* spool = create_dir( root, "spool" );
+    for( int i=0; i<NUM_MESSAGES; i++ )
+    {
+        snprintf( name, sizeof(name), "msg-%04d", i );
+        create_file( spool, name, 0, 0 );
+    }
+    printf("spool has %d entries\n", spool->num_entries );
+    find_some( spool );
+    printf("spool %s a name index\n", spool->index ? "has" : "does not have" );
+
+    printf("===================================\n");
+    printf("= Delete every second file        =\n");
+    printf("===================================\n");
+    int deleted = 0;
+    for( int i=0; i<NUM_MESSAGES; i+=2 )
+    {
+        snprintf( name, sizeof(name), "msg-%04d", i );
+        if( delete_file( spool, find_inode_by_name( spool, name ) ) == 0 )
+            deleted++;
+    }
+    printf("Deleted %d files, spool has %d entries\n", deleted, spool->num_entries );
+    find_some( spool );
+
+    printf("===================================\n");
+    printf("= Create msg-0000 again           =\n");
+    printf("===================================\n");
+    create_file( spool, "msg-0000", 0, 0 );
+    find_some( spool );
+
+    printf("===================================\n");
+    printf("= Save, load and look up again    =\n");
+    printf("===================================\n");
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+
+    root  = load_inodes( mft_name );
+    spool = find_inode_by_name( root, "spool" );
+    printf("spool has %d entries\n", spool->num_entries );
+    find_some( spool );
+
+    int missing = 0;
+    for( int i=1; i<NUM_MESSAGES; i+=2 )
+    {
+        snprintf( name, sizeof(name), "msg-%04d", i );
+        if( find_inode_by_name( spool, name ) == NULL )
+            missing++;
+    }
+    printf("%d of the %d odd files are missing\n", missing, NUM_MESSAGES / 2 );
+
+    fs_shutdown( root );
+}
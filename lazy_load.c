@@ -0,0 +1,93 @@
+#include "inode.h"
+#include "block_allocation.h"
+
+#include <stdio.h>
+
+/* Print how many inodes are in memory, and how many directories
+ * were loaded from the table since the last call.
+ */
+static void print_stats( const char* when )
+{
+    static uint64_t misses = 0;
+    struct inode_cache_stats stats;
+    get_inode_cache_stats( &stats );
+    printf("%s: %llu inodes in memory, %llu directories loaded\n", when,
+           (unsigned long long)stats.resident, (unsigned long long)( stats.misses - misses ) );
+    misses = stats.misses;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 3 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+
+    printf("===================================\n");
+    printf("= Create and save a filesystem    =\n");
+    printf("===================================\n");
+    struct inode* root      = create_dir( NULL, "/" );
+    create_file( root, "kernel", 1, 20000 );
+    struct inode* dir_etc   = create_dir( root, "etc" );
+    create_file( dir_etc, "hosts", 0, 200 );
+    struct inode* dir_usr   = create_dir( root, "usr" );
+    struct inode* dir_bin   = create_dir( dir_usr, "bin" );
+    create_file( dir_bin, "ls", 1, 14322 );
+    struct inode* dir_local = create_dir( dir_usr, "local" );
+    struct inode* dir_lbin  = create_dir( dir_local, "bin" );
+    create_file( dir_lbin, "gcc", 1, 12623 );
+    struct inode* dir_home  = create_dir( root, "home" );
+    create_file( dir_home, "notes", 0, 5000 );
+    debug_fs( root );
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+
+    printf("===================================\n");
+    printf("= Load it lazily                  =\n");
+    printf("===================================\n");
+    set_lazy_loading( 1 );
+    print_stats( "Before loading" );
+    root = load_inodes( mft_name );
+    print_stats( "After loading" );
+
+    struct inode* gcc = lookup_path( root, "/usr/local/bin/gcc" );
+    if( gcc ) printf("Found /usr/local/bin/gcc (id %d size %d)\n", gcc->id, gcc->filesize );
+    print_stats( "After finding /usr/local/bin/gcc" );
+
+    gcc = lookup_path( root, "/usr/local/bin/gcc" );
+    print_stats( "After finding it again" );
+
+    struct inode* dir_etc_loaded = find_inode_by_name( root, "etc" );
+    printf("etc is %s\n", dir_etc_loaded->unloaded ? "not loaded yet" : "loaded" );
+
+    printf("===================================\n");
+    printf("= Change it and save it           =\n");
+    printf("===================================\n");
+    create_file( dir_etc_loaded, "passwd", 0, 1000 );
+    print_stats( "After creating /etc/passwd" );
+    save_inodes( mft_name, root );
+    print_stats( "After saving" );
+    debug_fs( root );
+    print_stats( "After debug_fs" );
+    fs_shutdown( root );
+
+    printf("===================================\n");
+    printf("= Load it at once                 =\n");
+    printf("===================================\n");
+    set_lazy_loading( 0 );
+    root = load_inodes( mft_name );
+    print_stats( "After loading" );
+    debug_fs( root );
+    fs_shutdown( root );
+}
@@ -0,0 +1,111 @@
+#include "inode.h"
+#include "block_allocation.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/* Builds a tree of INODES inodes, saves it to MFT, and loads it
+ * again with 1, 2, 4, ... up to THREADS threads. Every loaded tree
+ * is saved in the legacy format to MFT.check and compared with the
+ * tree that one thread loaded.
+ */
+
+static double now( void )
+{
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static char* read_file( const char* name, long* size )
+{
+    FILE* f = fopen( name, "rb" );
+    if( !f ) return NULL;
+    fseek( f, 0, SEEK_END );
+    *size = ftell( f );
+    fseek( f, 0, SEEK_SET );
+    char* bytes = malloc( *size ? *size : 1 );
+    if( bytes && fread( bytes, 1, *size, f ) != (size_t)*size )
+    {
+        free( bytes );
+        bytes = NULL;
+    }
+    fclose( f );
+    return bytes;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 4 )
+    {
+        fprintf( stderr, "Usage: %s MFT INODES THREADS\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table that is written\n"
+                         "       INODES is the number of inodes in the tree\n"
+                         "       THREADS is the largest number of threads to load with\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    int   num_inodes = atoi( argv[2] );
+    int   max_threads = atoi( argv[3] );
+
+    char check_name[1024];
+    snprintf( check_name, sizeof(check_name), "%s.check", mft_name );
+
+    /* Directories of 1000 empty files, so that no blocks are
+     * needed on the simulated disk. */
+    struct inode* root = create_dir( NULL, "/" );
+    char name[64];
+    for( int d = 0; d * 1001 < num_inodes; d++ )
+    {
+        snprintf( name, sizeof(name), "dir%d", d );
+        struct inode* dir = create_dir( root, name );
+        for( int f = 0; f < 1000 && d * 1001 + f + 1 < num_inodes; f++ )
+        {
+            snprintf( name, sizeof(name), "file%d.txt", f );
+            create_file( dir, name, 0, 0 );
+        }
+    }
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+
+    char* expected = NULL;
+    long  expected_size = 0;
+    int   result = 0;
+    for( int threads = 1; threads <= max_threads; threads *= 2 )
+    {
+        set_load_threads( threads );
+        double start = now( );
+        root = load_inodes( mft_name );
+        double seconds = now( ) - start;
+        if( !root )
+        {
+            fprintf( stderr, "failed to load %s\n", mft_name );
+            exit( -1 );
+        }
+
+        set_master_file_table_version( 1 );
+        save_inodes( check_name, root );
+        set_master_file_table_version( 2 );
+        fs_shutdown( root );
+
+        long size = 0;
+        char* got = read_file( check_name, &size );
+        if( !expected )
+        {
+            expected = got;
+            expected_size = size;
+            got = NULL;
+        }
+        int same = got == NULL || ( size == expected_size && memcmp( got, expected, size ) == 0 );
+        free( got );
+
+        printf( "%2d threads: load %.3f s, %s\n", threads, seconds, same ? "same tree" : "DIFFERENT TREE" );
+        if( !same ) result = -1;
+    }
+    free( expected );
+    remove( check_name );
+    return result;
+}
@@ -0,0 +1,234 @@
+#include "mft.h"
+#include "inode.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Rounds offset up to the next multiple of 8.
+*/
+static uint64_t align8(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t) 7;
+}
+
+/*
+Returns 1 if length bytes starting at offset fit in size bytes.
+*/
+static int inside(uint64_t size, uint64_t offset, uint64_t length)
+{
+    return offset <= size && length <= size - offset;
+}
+
+int mft_is_v2(const char* bytes, size_t size)
+{
+    uint32_t magic;
+    if (size < sizeof(struct mft_header)){
+        return 0;
+    }
+    memcpy(&magic, bytes, sizeof(uint32_t));
+    return magic == MFT_MAGIC;
+}
+
+const struct mft_header* mft_check(const char* bytes, size_t size)
+{
+    if (!mft_is_v2(bytes, size)){
+        return NULL;
+    }
+    const struct mft_header* h = (const struct mft_header*) bytes;
+
+    if (h->version != MFT_VERSION
+        || h->record_size < sizeof(struct mft_record) || h->record_size % 8 != 0
+        || h->records_offset % 8 != 0 || h->index_offset % 8 != 0 || h->entries_offset % 8 != 0){
+        return NULL;
+    }
+    if (!inside(size, h->records_offset, 0)
+        || h->inode_count > (size - h->records_offset) / h->record_size){
+        return NULL;
+    }
+    if (!inside(size, h->index_offset, ((uint64_t) h->max_id + 1) * sizeof(uint64_t))
+        || !inside(size, h->entries_offset, h->entries_size)
+        || !inside(size, h->strings_offset, h->strings_size)){
+        return NULL;
+    }
+    return h;
+}
+
+struct mft_record* mft_record_at(char* bytes, const struct mft_header* header, uint32_t i)
+{
+    return (struct mft_record*) (bytes + header->records_offset + (uint64_t) i * header->record_size);
+}
+
+struct mft_record* mft_find(char* bytes, const struct mft_header* header, uint32_t id)
+{
+    if (id > header->max_id){
+        return NULL;
+    }
+    const uint64_t* index = (const uint64_t*) (bytes + header->index_offset);
+    uint64_t offset = index[id];
+    if (offset < header->records_offset || (offset - header->records_offset) % header->record_size != 0
+        || (offset - header->records_offset) / header->record_size >= header->inode_count){
+        return NULL;
+    }
+
+    struct mft_record* record = (struct mft_record*) (bytes + offset);
+    return record->id == id ? record : NULL;
+}
+
+uint32_t mft_record_number(const char* bytes, const struct mft_header* header,
+                           const struct mft_record* record)
+{
+    return ((const char*) record - bytes - header->records_offset) / header->record_size;
+}
+
+uint64_t mft_entries_size(const struct mft_record* record)
+{
+    return record->is_inline ? align8(record->filesize) : (uint64_t) record->num_entries * 8;
+}
+
+int mft_record_check(const char* bytes, const struct mft_header* header,
+                     const struct mft_record* record)
+{
+    if (record->name_length == 0
+        || !inside(header->strings_size, record->name_offset, record->name_length)
+        || bytes[header->strings_offset + record->name_offset + record->name_length - 1] != '\0'){
+        return -1;
+    }
+    if (record->entries_offset % 8 != 0
+        || !inside(header->entries_size, record->entries_offset, mft_entries_size(record))){
+        return -1;
+    }
+    return 0;
+}
+
+// Running totals of the sizing pass
+struct mft_sizes
+{
+    uint32_t inode_count;
+    uint32_t max_id;
+    uint64_t num_entries; // 8-byte words, of entries and inline bytes
+    uint64_t strings_size;
+};
+
+/*
+Adds the inodes below node to the totals.
+*/
+static void size_rec(const struct inode* node, struct mft_sizes* sizes)
+{
+    sizes->inode_count++;
+    if (node->id > sizes->max_id){
+        sizes->max_id = node->id;
+    }
+    sizes->num_entries += node->is_inline ? align8(node->filesize) / 8 : node->num_entries;
+    sizes->strings_size += strlen(node->name) + 1;
+
+    if (node->is_directory){
+        for (uint32_t i = 0; i < node->num_entries; i++){
+            size_rec((const struct inode*) node->entries[i], sizes);
+        }
+    }
+}
+
+// Where the next record, entry and name go while serializing
+struct mft_writer
+{
+    char*                    bytes;
+    const struct mft_header* header;
+    uint32_t                 next_record;
+    uint64_t                 next_entry;  // bytes into the entries section
+    uint64_t                 next_string; // bytes into the string table
+};
+
+/*
+Writes the record, name and entries of node at the next free places.
+*/
+static void serialize_node(const struct inode* node, struct mft_writer* w)
+{
+    const struct mft_header* h = w->header;
+    struct mft_record* record = mft_record_at(w->bytes, h, w->next_record++);
+    uint32_t name_length = strlen(node->name) + 1;
+
+    record->id = node->id;
+    record->filesize = node->is_directory ? 0 : node->filesize;
+    record->num_entries = node->num_entries;
+    record->name_length = name_length;
+    record->name_offset = w->next_string;
+    record->entries_offset = w->next_entry;
+    record->is_directory = node->is_directory;
+    record->is_readonly = node->is_readonly;
+    record->is_inline = node->is_inline;
+
+    uint64_t* index = (uint64_t*) (w->bytes + h->index_offset);
+    index[node->id] = (char*) record - w->bytes;
+
+    memcpy(w->bytes + h->strings_offset + w->next_string, node->name, name_length);
+    w->next_string += name_length;
+
+    char* entries = w->bytes + h->entries_offset + w->next_entry;
+    w->next_entry += mft_entries_size(record);
+    if (node->is_inline){
+        memcpy(entries, node->entries, node->filesize);
+        return;
+    }
+    if (!node->is_directory){
+        if (node->num_entries > 0){
+            memcpy(entries, node->entries, node->num_entries * sizeof(struct Extent));
+        }
+        return;
+    }
+
+    // Directory entries are stored as 64-bit inode IDs
+    for (uint32_t i = 0; i < node->num_entries; i++){
+        uint64_t child_id = ((const struct inode*) node->entries[i])->id;
+        memcpy(entries + i * sizeof(uint64_t), &child_id, sizeof(uint64_t));
+    }
+}
+
+char* mft_serialize(const struct inode* root, size_t* size)
+{
+    struct mft_sizes sizes = {0};
+    size_rec(root, &sizes);
+
+    struct mft_header header = {0};
+    header.magic = MFT_MAGIC;
+    header.version = MFT_VERSION;
+    header.inode_count = sizes.inode_count;
+    header.max_id = sizes.max_id;
+    header.record_size = sizeof(struct mft_record);
+    header.records_offset = align8(sizeof(struct mft_header));
+    header.index_offset = align8(header.records_offset + (uint64_t) sizes.inode_count * header.record_size);
+    header.entries_offset = align8(header.index_offset + ((uint64_t) sizes.max_id + 1) * sizeof(uint64_t));
+    header.entries_size = sizes.num_entries * 8;
+    header.strings_offset = header.entries_offset + header.entries_size;
+    header.strings_size = sizes.strings_size;
+
+    // Zeroed, so that padding and ids without an inode read as 0
+    uint64_t total = header.strings_offset + header.strings_size;
+    char* bytes = calloc(1, total);
+    const struct inode** queue = malloc(sizes.inode_count * sizeof(struct inode*));
+    if (!bytes || !queue){
+        free(bytes);
+        free(queue);
+        return NULL;
+    }
+    memcpy(bytes, &header, sizeof(struct mft_header));
+
+    // Breadth first, so that the records and names of the children of a directory are next to
+    // each other, and loading one directory touches as few pages as possible
+    struct mft_writer writer = { bytes, (const struct mft_header*) bytes, 0, 0, 0 };
+    uint32_t head = 0, tail = 0;
+    queue[tail++] = root;
+    while (head < tail){
+        const struct inode* node = queue[head++];
+        serialize_node(node, &writer);
+        if (node->is_directory){
+            for (uint32_t i = 0; i < node->num_entries; i++){
+                queue[tail++] = (const struct inode*) node->entries[i];
+            }
+        }
+    }
+    free(queue);
+
+    *size = total;
+    return bytes;
+}
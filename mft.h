@@ -0,0 +1,100 @@
+#ifndef MFT_H
+#define MFT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct inode;
+
+/* Version 2 of the master file table.
+ *
+ * The file starts with a header, followed by four sections:
+ *  - records: one fixed size record per inode, breadth first from
+ *             the root, so the children of a directory are adjacent
+ *  - index:   for every id from 0 to max_id, the file offset of
+ *             the record with that id, or 0 if there is none
+ *  - entries: the entries of all inodes, 8 bytes each; 64-bit
+ *             child ids for directories, struct Extent for files,
+ *             and the bytes of inline files, padded to 8
+ *  - strings: the names of all inodes, each ending with '\0'
+ *
+ * Every section starts at a multiple of 8 bytes, so a loader can
+ * use the entries in place. Any inode is found from its id with
+ * one lookup in the index, without reading the other records.
+ *
+ * Tables that were written before version 2 have no header and are
+ * a stream of variable length records; load_inodes reads both.
+ */
+#define MFT_MAGIC   0x3254464dU /* "MFT2" */
+#define MFT_VERSION 2
+
+struct mft_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t inode_count;
+    uint32_t max_id;
+    uint32_t record_size;    /* stride of the record array */
+    uint32_t reserved;
+    uint64_t records_offset;
+    uint64_t index_offset;
+    uint64_t entries_offset;
+    uint64_t entries_size;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct mft_record
+{
+    uint32_t id;
+    uint32_t filesize;
+    uint32_t num_entries;
+    uint32_t name_length;    /* including the '\0' */
+    uint64_t name_offset;    /* from the start of the string table */
+    uint64_t entries_offset; /* from the start of the entries section */
+    uint8_t  is_directory;
+    uint8_t  is_readonly;
+    uint8_t  is_inline;      /* the entries are the filesize bytes of the file, num_entries is 0 */
+    uint8_t  reserved[5];
+};
+
+/* Return 1 if the size bytes at bytes start with a version 2
+ * header, 0 if they are a legacy table.
+ */
+int mft_is_v2( const char* bytes, size_t size );
+
+/* Check that the header and the sections of a version 2 table lie
+ * inside its size bytes. bytes must be 8-byte aligned.
+ * Returns the header, or NULL if the table is damaged.
+ */
+const struct mft_header* mft_check( const char* bytes, size_t size );
+
+/* Return the i-th record of a checked table. */
+struct mft_record* mft_record_at( char* bytes, const struct mft_header* header, uint32_t i );
+
+/* Return the record with the given id in O(1), or NULL if the
+ * table has no such inode.
+ */
+struct mft_record* mft_find( char* bytes, const struct mft_header* header, uint32_t id );
+
+/* Return the position of a record in the record array. */
+uint32_t mft_record_number( const char* bytes, const struct mft_header* header,
+                            const struct mft_record* record );
+
+/* Return the number of bytes of the entries of a record. */
+uint64_t mft_entries_size( const struct mft_record* record );
+
+/* Check that the name and the entries of a record lie inside their
+ * sections, and that the name ends with '\0'.
+ * Returns 0 if they do and -1 if not.
+ */
+int mft_record_check( const char* bytes, const struct mft_header* header,
+                      const struct mft_record* record );
+
+/* Serialize the tree below root into a new version 2 table.
+ * Returns a malloc'd buffer and its size in *size, or NULL if
+ * memory could not be allocated.
+ */
+char* mft_serialize( const struct inode* root, size_t* size );
+
+#endif
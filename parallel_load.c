@@ -0,0 +1,92 @@
+#include "inode.h"
+#include "block_allocation.h"
+
+#include <stdio.h>
+
+#define NUM_DIRS  200
+#define NUM_FILES 200
+
+/* Count the inodes below node, including node. */
+static int count_inodes( struct inode* node )
+{
+    int count = 1;
+    for( uint32_t i=0; node->is_directory && i<node->num_entries; i++ )
+        count += count_inodes( (struct inode*)node->entries[i] );
+    return count;
+}
+
+/* Return 1 if the trees below a and b have the same inodes in the
+ * same order, and 0 otherwise.
+ */
+static int same_tree( struct inode* a, struct inode* b )
+{
+    if( a->id != b->id || strcmp( a->name, b->name ) != 0
+     || a->is_directory != b->is_directory || a->is_readonly != b->is_readonly
+     || a->filesize != b->filesize || a->num_entries != b->num_entries )
+        return 0;
+    for( uint32_t i=0; a->is_directory && i<a->num_entries; i++ )
+    {
+        if( !same_tree( (struct inode*)a->entries[i], (struct inode*)b->entries[i] ) )
+            return 0;
+    }
+    return 1;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 3 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char  name[32];
+
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+
+    printf("===================================\n");
+    printf("= Create %d directories with %d\n", NUM_DIRS, NUM_FILES );
+    printf("= files each and save them\n");
+    printf("===================================\n");
+    struct inode* root = create_dir( NULL, "/" );
+    for( int d=0; d<NUM_DIRS; d++ )
+    {
+        snprintf( name, sizeof(name), "dir-%03d", d );
+        struct inode* dir = create_dir( root, name );
+        for( int f=0; f<NUM_FILES; f++ )
+        {
+            snprintf( name, sizeof(name), "file-%03d", f );
+            create_file( dir, name, f % 2, 0 );
+        }
+    }
+    create_file( root, "kernel", 1, 20000 );
+    printf("The tree has %d inodes\n", count_inodes( root ) );
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+
+    printf("===================================\n");
+    printf("= Load them with 4 threads and    =\n");
+    printf("= with 1 thread                   =\n");
+    printf("===================================\n");
+    set_load_threads( 4 );
+    struct inode* parallel = load_inodes( mft_name );
+    set_load_threads( 1 );
+    struct inode* serial = load_inodes( mft_name );
+    printf("Loaded %d and %d inodes\n", count_inodes( parallel ), count_inodes( serial ) );
+    printf("The trees are %s\n", same_tree( parallel, serial ) ? "the same" : "different" );
+
+    struct inode* file = lookup_path( parallel, "/dir-123/file-045" );
+    if( file ) printf("Found /dir-123/file-045 (id %d)\n", file->id );
+    file = lookup_path( parallel, "/kernel" );
+    if( file ) printf("Found /kernel (id %d size %d)\n", file->id, file->filesize );
+
+    fs_shutdown( serial );
+    fs_shutdown( parallel );
+}
@@ -0,0 +1,211 @@
+#include "path_cache.h"
+#include "inode.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PATH_CACHE_SETS (PATH_CACHE_ENTRIES / PATH_CACHE_WAYS)
+
+struct path_cache_entry
+{
+    uint32_t            hash;
+    uint32_t            len;
+    const struct inode* base;
+    char*               key;  // NULL if the entry is empty
+    struct inode*       node;
+
+    // All entries that resolve to the same inode are linked from inode->cached
+    struct path_cache_entry*  ref_next;
+    struct path_cache_entry** ref_prev;
+};
+
+struct path_cache_set
+{
+    struct path_cache_entry ways[PATH_CACHE_WAYS];
+    uint32_t                victim; // next way to drop when the set is full
+};
+
+// Allocated on the first insert
+static struct path_cache_set* sets = NULL;
+
+// Advanced whenever entries are dropped because their inode goes away
+static uint64_t generation = 0;
+
+// Taken by every function below once path_cache_set_thread_safe(1) was called
+static int locking = 0;
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void lock_cache(int exclusive)
+{
+    if (locking){
+        if (exclusive){
+            pthread_rwlock_wrlock(&lock);
+        }else{
+            pthread_rwlock_rdlock(&lock);
+        }
+    }
+}
+
+static void unlock_cache(void)
+{
+    if (locking){
+        pthread_rwlock_unlock(&lock);
+    }
+}
+
+/*
+FNV-1a hash of the base pointer and len bytes of key.
+*/
+static uint32_t hash_key(const struct inode* base, const char* key, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+    uintptr_t b = (uintptr_t) base;
+    for (size_t i = 0; i < sizeof(uintptr_t); i++){
+        hash ^= (uint8_t)(b >> (8 * i));
+        hash *= 16777619u;
+    }
+    for (uint32_t i = 0; i < len; i++){
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+Empties an entry and unlinks it from the list of its inode.
+*/
+static void drop(struct path_cache_entry* entry)
+{
+    if (!entry->key){
+        return;
+    }
+    *entry->ref_prev = entry->ref_next;
+    if (entry->ref_next){
+        entry->ref_next->ref_prev = entry->ref_prev;
+    }
+    free(entry->key);
+    entry->key = NULL;
+    entry->node = NULL;
+}
+
+void path_cache_set_thread_safe(int enable)
+{
+    locking = enable;
+}
+
+uint64_t path_cache_generation(void)
+{
+    lock_cache(0);
+    uint64_t current = generation;
+    unlock_cache();
+    return current;
+}
+
+struct inode* path_cache_find(const struct inode* base, const char* key, uint32_t len)
+{
+    lock_cache(0);
+    struct inode* node = NULL;
+    if (sets){
+        uint32_t hash = hash_key(base, key, len);
+        struct path_cache_set* set = &sets[hash % PATH_CACHE_SETS];
+        for (int i = 0; i < PATH_CACHE_WAYS; i++){
+            struct path_cache_entry* entry = &set->ways[i];
+            if (entry->key && entry->hash == hash && entry->base == base
+                && entry->len == len && memcmp(entry->key, key, len) == 0){
+                node = entry->node;
+                break;
+            }
+        }
+    }
+    unlock_cache();
+    return node;
+}
+
+/*
+The body of path_cache_insert, called with the lock held.
+*/
+static void insert(const struct inode* base, const char* key, uint32_t len, struct inode* node)
+{
+    if (!sets){
+        sets = calloc(PATH_CACHE_SETS, sizeof(struct path_cache_set));
+        if (!sets){
+            return;
+        }
+    }
+
+    uint32_t hash = hash_key(base, key, len);
+    struct path_cache_set* set = &sets[hash % PATH_CACHE_SETS];
+
+    // Use an empty way if there is one, otherwise drop the oldest one
+    struct path_cache_entry* entry = NULL;
+    for (int i = 0; i < PATH_CACHE_WAYS; i++){
+        if (!set->ways[i].key){
+            entry = &set->ways[i];
+            break;
+        }
+    }
+    if (!entry){
+        entry = &set->ways[set->victim];
+        set->victim = (set->victim + 1) % PATH_CACHE_WAYS;
+        drop(entry);
+    }
+
+    char* copy = malloc(len + 1);
+    if (!copy){
+        return;
+    }
+    memcpy(copy, key, len);
+    copy[len] = '\0';
+
+    entry->hash = hash;
+    entry->len = len;
+    entry->base = base;
+    entry->key = copy;
+    entry->node = node;
+
+    entry->ref_next = node->cached;
+    entry->ref_prev = &node->cached;
+    if (node->cached){
+        node->cached->ref_prev = &entry->ref_next;
+    }
+    node->cached = entry;
+}
+
+void path_cache_insert(const struct inode* base, const char* key, uint32_t len, struct inode* node,
+                       uint64_t since)
+{
+    lock_cache(1);
+    if (generation == since){
+        insert(base, key, len, node);
+    }
+    unlock_cache();
+}
+
+void path_cache_forget(struct inode* node)
+{
+    lock_cache(1);
+    generation++;
+    while (node->cached){
+        drop(node->cached);
+    }
+    unlock_cache();
+}
+
+void path_cache_clear(void)
+{
+    lock_cache(1);
+    generation++;
+    if (!sets){
+        unlock_cache();
+        return;
+    }
+    for (uint32_t s = 0; s < PATH_CACHE_SETS; s++){
+        for (int i = 0; i < PATH_CACHE_WAYS; i++){
+            drop(&sets[s].ways[i]);
+        }
+    }
+    free(sets);
+    sets = NULL;
+    unlock_cache();
+}
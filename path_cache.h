@@ -0,0 +1,67 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <stdint.h>
+
+struct inode;
+
+/* A bounded cache of path lookups, used by lookup_path.
+ *
+ * Every entry maps a base inode and a string below it to the inode
+ * that the string resolves to. Two kinds of keys are stored:
+ *  - (parent, name) for a single step from a directory to an entry
+ *  - (root, "a/b/c") for a full path and the prefixes of it
+ * so that a path that was resolved before costs one hash probe,
+ * and a new path below a known directory starts from there.
+ *
+ * The cache is set associative: a key hashes to one set of
+ * PATH_CACHE_WAYS entries, and a full set drops its entries round
+ * robin. It holds at most PATH_CACHE_ENTRIES entries.
+ *
+ * Only hits are cached. Creating an inode therefore never makes
+ * an entry wrong, and an inode that is freed must be given to
+ * path_cache_forget first, which drops the entries that resolve
+ * to it.
+ *
+ * A lookup that runs while another thread frees inodes may find
+ * one of them just before it is forgotten. path_cache_insert
+ * therefore takes the generation that was current when the lookup
+ * started, and drops the entry if inodes were forgotten since.
+ */
+#define PATH_CACHE_ENTRIES 16384
+#define PATH_CACHE_WAYS    4
+
+struct path_cache_entry;
+
+/* Return the inode that len bytes of key resolve to below base,
+ * or NULL if it is not in the cache.
+ */
+struct inode* path_cache_find(const struct inode* base, const char* key, uint32_t len);
+
+/* Remember that len bytes of key resolve to node below base.
+ * Nothing happens if memory could not be allocated, or if any
+ * inode was forgotten after path_cache_generation returned since.
+ */
+void path_cache_insert(const struct inode* base, const char* key, uint32_t len, struct inode* node,
+                       uint64_t since);
+
+/* Return the number of times inodes were forgotten so far. */
+uint64_t path_cache_generation(void);
+
+/* Drop all entries that resolve to node. Must be called before
+ * node is freed.
+ */
+void path_cache_forget(struct inode* node);
+
+/* Drop all entries and release the memory of the cache. The
+ * inodes of the entries must not have been freed yet.
+ */
+void path_cache_clear(void);
+
+/* With enable 1, the functions above may be called from several
+ * threads at once and take a reader-writer lock. Must be set
+ * while no other thread uses the cache.
+ */
+void path_cache_set_thread_safe(int enable);
+
+#endif
@@ -0,0 +1,85 @@
+#include "inode.h"
+#include "block_allocation.h"
+
+#include <stdio.h>
+
+/* Resolve path below root and print the result. */
+static void find( struct inode* root, const char* path )
+{
+    struct inode* node = lookup_path( root, path );
+    if( node ) printf("Found %s (id %d)\n", path, node->id );
+    else       printf("Did not find %s\n", path );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 3 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+
+    printf("===================================\n");
+    printf("= Create a filesystem             =\n");
+    printf("===================================\n");
+    struct inode* root      = create_dir( NULL, "/" );
+    struct inode* dir_etc   = create_dir( root, "etc" );
+    struct inode* dir_httpd = create_dir( dir_etc, "httpd" );
+    struct inode* f_conf    = create_file( dir_httpd, "conf", 0, 1000 );
+    struct inode* f_hosts   = create_file( dir_etc, "hosts", 0, 200 );
+    struct inode* dir_usr   = create_dir( root, "usr" );
+    struct inode* dir_bin   = create_dir( dir_usr, "bin" );
+    create_file( dir_bin, "ls", 1, 14322 );
+    debug_fs( root );
+
+    printf("===================================\n");
+    printf("= Resolve some paths              =\n");
+    printf("===================================\n");
+    find( root, "/etc/httpd/conf" );
+    find( root, "/etc/httpd/conf" );
+    find( root, "//etc///hosts" );
+    find( root, "/usr/bin/ls" );
+    find( root, "/usr/bin" );
+    find( root, "/" );
+    find( root, "/usr/bin/ls/x" );
+    find( root, "/usr/./bin/ls" );
+    find( root, "/var/log" );
+
+    printf("===================================\n");
+    printf("= Delete /etc/httpd/conf and      =\n");
+    printf("= /etc/hosts                      =\n");
+    printf("===================================\n");
+    delete_file( dir_httpd, f_conf );
+    delete_file( dir_etc, f_hosts );
+    find( root, "/etc/httpd/conf" );
+    find( root, "/etc/hosts" );
+    find( root, "/etc/httpd" );
+
+    printf("===================================\n");
+    printf("= Create /etc/hosts again         =\n");
+    printf("===================================\n");
+    create_file( dir_etc, "hosts", 0, 300 );
+    find( root, "/etc/hosts" );
+
+    printf("===================================\n");
+    printf("= Save and load                   =\n");
+    printf("===================================\n");
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+    root = load_inodes( mft_name );
+    find( root, "/etc/hosts" );
+    find( root, "/etc/httpd/conf" );
+    find( root, "/usr/bin/ls" );
+
+    fs_shutdown( root );
+}
@@ -0,0 +1,96 @@
+#include "inode.h"
+#include "block_allocation.h"
+#include "block_image.h"
+#include "block_cache.h"
+
+#include <stdio.h>
+
+#define FILE_BLOCKS 48
+
+/* Read the open file from start to end in pieces of 1000 bytes,
+ * and print whether every piece held the expected bytes and how
+ * many blocks the block cache had to read for it.
+ */
+static void read_sequentially( struct fs_file* file, const char* expected, const char* how )
+{
+    struct block_cache_stats before, after;
+    char buf[1000];
+    int  good = 1;
+    get_block_cache_stats( &before );
+    for( uint64_t offset=0; offset<FILE_BLOCKS * BLOCKSIZE; offset+=sizeof(buf) )
+    {
+        ssize_t n = fs_file_read( file, offset, buf, sizeof(buf) );
+        if( n <= 0 || memcmp( buf, expected + offset, n ) != 0 )
+            good = 0;
+    }
+    get_block_cache_stats( &after );
+    printf("%s: the bytes are %s, the cache read %llu blocks\n", how, good ? "right" : "wrong",
+           (unsigned long long)( after.misses - before.misses ) );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 4 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT IMG\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         "       IMG is the name of the block image\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char* img_name = argv[3];
+    static char data[FILE_BLOCKS * BLOCKSIZE];
+
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+    remove( img_name );
+    if( set_block_image_name( img_name ) == -1 )
+        exit( -1 );
+
+    printf("===================================\n");
+    printf("= Write a file of %d blocks\n", FILE_BLOCKS );
+    printf("===================================\n");
+    struct inode* root = create_dir( NULL, "/" );
+    create_file( root, "gap", 0, 3 * BLOCKSIZE );
+    struct inode* file = create_file( root, "log", 0, sizeof(data) );
+    for( size_t i=0; i<sizeof(data); i++ )
+        data[i] = 'a' + i % 26;
+    fs_write( file, 0, data, sizeof(data) );
+    fs_sync( );
+    set_block_cache_size( 16 );
+    debug_fs( root );
+
+    printf("===================================\n");
+    printf("= Read it sequentially            =\n");
+    printf("===================================\n");
+    struct fs_file* open_file = fs_open( file );
+    read_sequentially( open_file, data, "With readahead" );
+    fs_close( open_file );
+
+    set_readahead_window( 0 );
+    open_file = fs_open( file );
+    read_sequentially( open_file, data, "Without readahead" );
+    fs_close( open_file );
+    set_readahead_window( READAHEAD_MAX_BLOCKS );
+
+    printf("===================================\n");
+    printf("= Write while reading ahead       =\n");
+    printf("===================================\n");
+    open_file = fs_open( file );
+    char buf[16];
+    fs_file_read( open_file, 0, buf, sizeof(buf) );
+    fs_file_read( open_file, sizeof(buf), buf, sizeof(buf) );
+    memcpy( data + 3 * BLOCKSIZE, "changed", 7 );
+    fs_write( file, 3 * BLOCKSIZE, "changed", 7 );
+    read_sequentially( open_file, data, "After fs_write" );
+    fs_close( open_file );
+
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+    close_block_image( );
+}
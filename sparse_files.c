@@ -0,0 +1,137 @@
+#include "inode.h"
+#include "block_allocation.h"
+#include "block_image.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define FILE_BLOCKS 10
+
+/* Print the extents of a file below root, and for every block of
+ * the file the first byte that is not zero, or '.' if there is none.
+ */
+static void print_file( struct inode* root, const char* path )
+{
+    static char buf[FILE_BLOCKS * BLOCKSIZE];
+    struct inode* file = lookup_path( root, path );
+    if( !file )
+    {
+        printf("%s is missing\n", path );
+        return;
+    }
+    printf("%s:", path );
+    for( uint32_t e=0; e<file->num_entries; e++ )
+    {
+        struct Extent* extent = (struct Extent*)file->entries + e;
+        if( extent->blockno == EXTENT_HOLE )
+            printf(" hole of %u", extent->extent );
+        else
+            printf(" blocks %u-%u", extent->blockno, extent->blockno + extent->extent - 1 );
+    }
+    ssize_t n = fs_read( file, 0, buf, sizeof(buf) );
+    printf("\n  read %zd bytes: ", n );
+    for( ssize_t b=0; b * BLOCKSIZE < n; b++ )
+    {
+        char c = '.';
+        for( ssize_t i=b * BLOCKSIZE; i<n && i<( b + 1 ) * BLOCKSIZE && c == '.'; i++ )
+            if( buf[i] ) c = buf[i];
+        printf("%c", c );
+    }
+    printf("\n");
+}
+
+/* Create a sparse file and save it, then write into its holes with
+ * the journal on. The process then stops without saving the tree,
+ * as if it had crashed. Only the block image is written, the
+ * block allocation table does not know the new blocks.
+ */
+static void write_and_crash( char* mft_name, char* bat_name, char* img_name )
+{
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+    remove( img_name );
+    if( set_block_image_name( img_name ) == -1 )
+        _exit( -1 );
+    set_sparse_files( 1 );
+    set_journaling( 1 );
+
+    printf("===================================\n");
+    printf("= Create and save a sparse file   =\n");
+    printf("===================================\n");
+    struct inode* root = create_dir( NULL, "/" );
+    struct inode* f_db = create_file( root, "db", 0, FILE_BLOCKS * BLOCKSIZE );
+    fs_write( f_db, 0, "head", 4 );
+    save_inodes( mft_name, root );
+    print_file( root, "/db" );
+
+    printf("===================================\n");
+    printf("= Fill holes without saving       =\n");
+    printf("===================================\n");
+    create_file( root, "other", 0, BLOCKSIZE );
+    fs_write( lookup_path( root, "/other" ), 0, "other", 5 );
+    fs_write( f_db, 4 * BLOCKSIZE + 100, "middle", 6 );
+    printf("fs_fallocate returned %d\n", fs_fallocate( f_db, 7 * BLOCKSIZE, 2 * BLOCKSIZE ) );
+    fs_write( f_db, 8 * BLOCKSIZE, "tail", 4 );
+    print_file( root, "/db" );
+    print_file( root, "/other" );
+
+    fs_sync( );
+    printf("===================================\n");
+    printf("= Crash                           =\n");
+    printf("===================================\n");
+    fflush( stdout );
+    _exit( 0 );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 4 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT IMG\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         "       IMG is the name of the block image\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char* img_name = argv[3];
+
+    fflush( stdout );
+    pid_t pid = fork( );
+    if( pid == 0 )
+        write_and_crash( mft_name, bat_name, img_name );
+    if( pid == -1 || waitpid( pid, NULL, 0 ) != pid )
+    {
+        fprintf( stderr, "Failed to run the crashing process\n" );
+        exit( -1 );
+    }
+
+    printf("===================================\n");
+    printf("= Load the table and replay the   =\n");
+    printf("= journal                         =\n");
+    printf("===================================\n");
+    set_block_allocation_table_name( bat_name );
+    if( set_block_image_name( img_name ) == -1 )
+        exit( -1 );
+    set_sparse_files( 1 );
+    set_journaling( 1 );
+    struct inode* root = load_inodes( mft_name );
+    print_file( root, "/db" );
+    print_file( root, "/other" );
+    debug_disk();
+
+    printf("===================================\n");
+    printf("= Save and load it again          =\n");
+    printf("===================================\n");
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+    root = load_inodes( mft_name );
+    print_file( root, "/db" );
+    fs_shutdown( root );
+    close_block_image( );
+}
@@ -0,0 +1,114 @@
+#include "inode.h"
+#include "block_allocation.h"
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define NUM_THREADS 4
+#define NUM_FILES   100
+
+struct worker
+{
+    struct inode* root;
+    int           number;
+    int           found;
+};
+
+/* Create files in a directory of the thread and in the shared one,
+ * and look up the files of the shared directory while the other
+ * threads change it.
+ */
+static void* work( void* arg )
+{
+    struct worker* w = arg;
+    char name[32];
+    char path[64];
+
+    snprintf( name, sizeof(name), "t%d", w->number );
+    struct inode* own    = create_dir( w->root, name );
+    struct inode* shared = find_inode_by_name( w->root, "shared" );
+    for( int i=0; i<NUM_FILES; i++ )
+    {
+        snprintf( name, sizeof(name), "file-%03d", i );
+        create_file( own, name, 0, 0 );
+        snprintf( name, sizeof(name), "t%d-%03d", w->number, i );
+        create_file( shared, name, 0, 0 );
+        snprintf( path, sizeof(path), "/shared/base-%03d", i % 50 );
+        if( lookup_path( w->root, path ) )
+            w->found++;
+    }
+    return NULL;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 3 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char  name[32];
+
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+    set_thread_safe( 1 );
+
+    printf("===================================\n");
+    printf("= Create a shared directory       =\n");
+    printf("===================================\n");
+    struct inode* root   = create_dir( NULL, "/" );
+    struct inode* shared = create_dir( root, "shared" );
+    for( int i=0; i<50; i++ )
+    {
+        snprintf( name, sizeof(name), "base-%03d", i );
+        create_file( shared, name, 0, 0 );
+    }
+    printf("shared has %d entries\n", shared->num_entries );
+
+    printf("===================================\n");
+    printf("= Change it from %d threads\n", NUM_THREADS );
+    printf("===================================\n");
+    pthread_t      threads[NUM_THREADS];
+    struct worker  workers[NUM_THREADS];
+    for( int t=0; t<NUM_THREADS; t++ )
+    {
+        workers[t].root   = root;
+        workers[t].number = t;
+        workers[t].found  = 0;
+        pthread_create( &threads[t], NULL, work, &workers[t] );
+    }
+    for( int t=0; t<NUM_THREADS; t++ )
+    {
+        pthread_join( threads[t], NULL );
+        printf("Thread %d found %d of %d files in shared\n", t, workers[t].found, NUM_FILES );
+    }
+    printf("/ has %d entries, shared has %d entries\n", root->num_entries, shared->num_entries );
+
+    printf("===================================\n");
+    printf("= Save, load and count            =\n");
+    printf("===================================\n");
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+    root = load_inodes( mft_name );
+    int files = 0;
+    for( int t=0; t<NUM_THREADS; t++ )
+    {
+        snprintf( name, sizeof(name), "t%d", t );
+        struct inode* own = find_inode_by_name( root, name );
+        files += own ? own->num_entries : 0;
+        for( int i=0; i<NUM_FILES; i++ )
+        {
+            snprintf( name, sizeof(name), "t%d-%03d", t, i );
+            files += find_inode_by_name( find_inode_by_name( root, "shared" ), name ) ? 1 : 0;
+        }
+    }
+    printf("Found %d of %d files\n", files, 2 * NUM_THREADS * NUM_FILES );
+    fs_shutdown( root );
+}
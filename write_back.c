@@ -0,0 +1,112 @@
+#include "inode.h"
+#include "block_allocation.h"
+#include "block_image.h"
+#include "block_cache.h"
+
+#include <stdio.h>
+
+#define FILE_BLOCKS 8
+#define PIECE       256
+
+/* Print how many blocks were written back since the last call, and
+ * how many pwritev calls wrote them.
+ */
+static void print_writebacks( const char* when )
+{
+    static struct block_cache_stats last;
+    struct block_cache_stats stats;
+    get_block_cache_stats( &stats );
+    printf("%s: %llu blocks written back in %llu runs, %llu dirty\n", when,
+           (unsigned long long)( stats.writebacks - last.writebacks ),
+           (unsigned long long)( stats.write_runs - last.write_runs ),
+           (unsigned long long)stats.dirty );
+    last = stats;
+}
+
+/* Append to the files in turn, PIECE bytes at a time, until they
+ * are full. Every byte is the letter of its file.
+ */
+static void append_in_turns( struct inode** files, int count )
+{
+    char buf[PIECE];
+    for( uint64_t offset=0; offset<FILE_BLOCKS * BLOCKSIZE; offset+=PIECE )
+    {
+        for( int f=0; f<count; f++ )
+        {
+            memset( buf, 'a' + f, sizeof(buf) );
+            fs_write( files[f], offset, buf, sizeof(buf) );
+        }
+    }
+}
+
+/* Print whether the file holds only the letter of its file. */
+static void check_contents( struct inode* file, char letter )
+{
+    static char buf[FILE_BLOCKS * BLOCKSIZE];
+    ssize_t n = fs_read( file, 0, buf, sizeof(buf) );
+    ssize_t i = 0;
+    while( i < n && buf[i] == letter )
+        i++;
+    printf("%s: read %zd bytes, %s\n", file->name, n, i == n ? "all right" : "wrong" );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc != 4 )
+    {
+        fprintf( stderr, "Usage: %s MFT BAT IMG\n"
+                         "       where\n"
+                         "       MFT is the name of the master_file_table\n"
+                         "       BAT is the name of the block allocation table\n"
+                         "       IMG is the name of the block image\n"
+                         , argv[0] );
+        exit( -1 );
+    }
+
+    char* mft_name = argv[1];
+    char* bat_name = argv[2];
+    char* img_name = argv[3];
+
+    set_block_allocation_table_name( bat_name );
+    format_disk();
+    remove( img_name );
+    if( set_block_image_name( img_name ) == -1 )
+        exit( -1 );
+    set_block_cache_size( 64 );
+    set_block_cache_flush_interval( 0 );
+
+    printf("===================================\n");
+    printf("= Append to two files in pieces   =\n");
+    printf("= of %d bytes\n", PIECE );
+    printf("===================================\n");
+    struct inode* root = create_dir( NULL, "/" );
+    struct inode* files[2];
+    files[0] = create_file( root, "one", 0, FILE_BLOCKS * BLOCKSIZE );
+    create_file( root, "gap", 0, BLOCKSIZE );
+    files[1] = create_file( root, "two", 0, FILE_BLOCKS * BLOCKSIZE );
+    debug_fs( root );
+    append_in_turns( files, 2 );
+    print_writebacks( "After the appends" );
+    fs_sync( );
+    print_writebacks( "After fs_sync" );
+
+    printf("===================================\n");
+    printf("= Again with a dirty limit of 4   =\n");
+    printf("===================================\n");
+    set_block_cache_dirty_limit( 4 );
+    append_in_turns( files, 2 );
+    print_writebacks( "After the appends" );
+    fs_sync( );
+    print_writebacks( "After fs_sync" );
+
+    printf("===================================\n");
+    printf("= Read them from the image        =\n");
+    printf("===================================\n");
+    set_block_cache_size( 0 );
+    check_contents( files[0], 'a' );
+    check_contents( files[1], 'b' );
+
+    save_inodes( mft_name, root );
+    fs_shutdown( root );
+    close_block_image( );
+}